@@ -2,6 +2,7 @@
 
 #include "lock_client.h"
 #include "rpc.h"
+#include "batch.h"
 #include <arpa/inet.h>
 
 #include <stdio.h>
@@ -14,16 +15,18 @@ lock_client::lock_client(std::string dst)
   sockaddr_in dstsock;
   make_sockaddr(dst.c_str(), &dstsock);
   cl = new rpcc(dstsock);
-  if (cl->bind() < 0) {
-    throw std::runtime_error("lock_client: call bind");
-  }
+  // stat only reads
+  cl->hedge(lock_protocol::stat);
+  cl->coalesce(lock_protocol::stat);
+  lp = lock_protocol::client(cl);
+  // no bind(): the first call binds cl, without a round trip of its own
 }
 
 int
 lock_client::stat(lock_protocol::lockid_t lid)
 {
   int r;
-  int ret = cl->call(lock_protocol::stat, cl->id(), lid, r);
+  int ret = lp.stat(cl->id(), lid, r);
   VERIFY (ret == lock_protocol::OK);
   return r;
 }
@@ -32,12 +35,52 @@ lock_protocol::status
 lock_client::acquire(lock_protocol::lockid_t lid)
 {
     int r;
-    return cl->call(lock_protocol::acquire, cl->id(), lid, r);
+    return lp.acquire(cl->id(), lid, r);
 }
 
 lock_protocol::status
 lock_client::release(lock_protocol::lockid_t lid)
 {
     int r;
-    return cl->call(lock_protocol::release, cl->id(), lid, r);
+    return lp.release(cl->id(), lid, r);
+}
+
+lock_protocol::status
+lock_client::batch(unsigned int proc,
+                   const std::vector<lock_protocol::lockid_t> &lids)
+{
+    rpc_batch b;
+    std::vector<int> r(lids.size());
+    for (size_t i = 0; i < lids.size(); i++)
+      b.add(proc, r[i], cl->id(), lids[i]);
+    int ret = b.call(cl);
+    for (size_t i = 0; ret == lock_protocol::OK && i < lids.size(); i++)
+      ret = b.ret(i);
+    return ret;
+}
+
+lock_protocol::status
+lock_client::acquire_all(const std::vector<lock_protocol::lockid_t> &lids)
+{
+    return batch(lock_protocol::acquire, lids);
+}
+
+lock_protocol::status
+lock_client::release_all(const std::vector<lock_protocol::lockid_t> &lids)
+{
+    return batch(lock_protocol::release, lids);
+}
+
+rpc_task<lock_protocol::status>
+lock_client::co_acquire(lock_protocol::lockid_t lid)
+{
+    rpcc::result<int> r = co_await lp.co_acquire(cl->id(), lid);
+    co_return r.ret;
+}
+
+rpc_task<lock_protocol::status>
+lock_client::co_release(lock_protocol::lockid_t lid)
+{
+    rpcc::result<int> r = co_await lp.co_release(cl->id(), lid);
+    co_return r.ret;
 }
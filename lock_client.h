@@ -12,12 +12,21 @@
 class lock_client {
  protected:
   rpcc *cl;
+  lock_protocol::client lp;
+  lock_protocol::status batch(unsigned int proc,
+                             const std::vector<lock_protocol::lockid_t> &);
  public:
   lock_client(std::string d);
   virtual ~lock_client() {};
   virtual lock_protocol::status acquire(lock_protocol::lockid_t);
   virtual lock_protocol::status release(lock_protocol::lockid_t);
   virtual lock_protocol::status stat(lock_protocol::lockid_t);
+  // several locks in one round trip, taken or given back in order
+  lock_protocol::status acquire_all(const std::vector<lock_protocol::lockid_t> &);
+  lock_protocol::status release_all(const std::vector<lock_protocol::lockid_t> &);
+  // for coroutines; the caller is suspended, not blocked, while waiting
+  rpc_task<lock_protocol::status> co_acquire(lock_protocol::lockid_t);
+  rpc_task<lock_protocol::status> co_release(lock_protocol::lockid_t);
 };
 
 
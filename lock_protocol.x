@@ -0,0 +1,16 @@
+// lock protocol
+//
+// compiled into lock_protocol.h by rpc/rpcgen
+
+protocol lock_protocol {
+% enum xxstatus { OK, RETRY, RPCERR, NOENT, IOERR };
+% typedef int status;
+  typedef unsigned long long lockid_t;
+
+  // answered once the lock is granted, which takes no server thread.
+  // acquire and release never block, so they run as they arrive; stat
+  // writes to stdout, which may.
+  inline async proc acquire = 0x7001 (int clt, lockid_t lid) returns int;
+  inline proc release (int clt, lockid_t lid) returns int;
+  proc stat (int clt, lockid_t lid) returns int;
+};
@@ -20,30 +20,46 @@ lock_server::stat(int clt, lock_protocol::lockid_t lid, int &r)
   return ret;
 }
 
-lock_protocol::status lock_server::acquire(const int client_id, const lock_protocol::lockid_t lid, int&)
+void lock_server::acquire(rpc_reply *reply, const int client_id, const lock_protocol::lockid_t lid)
 {
-    std::unique_lock<std::mutex> guard(mutex_);
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
 
-    for (;;) {
         auto iter = locks_.find(lid);
-        if (iter == locks_.end()) {
-            locks_.insert(std::make_pair(lid, client_id));
-            return lock_protocol::OK;
-        } else {
+        if (iter != locks_.end()) {
             // note: a client acquire a lock twice, the second acquire must block too
-            lock_released_.wait(guard);
+            waiters_[lid].push_back(waiter{client_id, reply});
+            return;
         }
+        locks_.insert(std::make_pair(lid, client_id));
     }
+    reply->done(lock_protocol::OK, 0);
 }
 
 lock_protocol::status lock_server::release(const int client_id, const lock_protocol::lockid_t lid, int&)
 {
-    std::lock_guard<std::mutex> guard(mutex_);
+    rpc_reply *granted = NULL;
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
 
-    auto iter = locks_.find(lid);
-    if (iter != locks_.end() && iter->second == client_id) {
-        locks_.erase(iter);
-        lock_released_.notify_one();
+        auto iter = locks_.find(lid);
+        if (iter != locks_.end() && iter->second == client_id) {
+            // straight to the first waiter, if there is one
+            auto w = waiters_.find(lid);
+            if (w == waiters_.end()) {
+                locks_.erase(iter);
+            } else {
+                iter->second = w->second.front().client_id;
+                granted = w->second.front().reply;
+                w->second.pop_front();
+                if (w->second.empty()) {
+                    waiters_.erase(w);
+                }
+            }
+        }
+    }
+    if (granted) {
+        granted->done(lock_protocol::OK, 0);
     }
 
     return lock_protocol::OK;
@@ -9,7 +9,7 @@
 #include "rpc.h"
 #include <string>
 #include <mutex>
-#include <condition_variable>
+#include <deque>
 #include <unordered_map>
 
 class lock_server {
@@ -22,13 +22,20 @@ class lock_server {
   ~lock_server() {};
 
   lock_protocol::status stat(int client_id, lock_protocol::lockid_t lid, int&);
-  lock_protocol::status acquire(int client_id, lock_protocol::lockid_t lid, int&);
+  void acquire(rpc_reply *reply, int client_id, lock_protocol::lockid_t lid);
   lock_protocol::status release(int client_id, lock_protocol::lockid_t lid, int&);
 
 private:
+    // an acquire waiting for the lock to be released
+    struct waiter {
+        int client_id;
+        rpc_reply *reply;
+    };
+
     std::mutex mutex_;
-    std::condition_variable lock_released_;
     std::unordered_map<lock_protocol::lockid_t, int/*client_id*/> locks_;
+    // in the order they asked
+    std::unordered_map<lock_protocol::lockid_t, std::deque<waiter>> waiters_;
 };
 
 #endif
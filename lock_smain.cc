@@ -18,8 +18,9 @@ main(int argc, char *argv[])
 
   srandom(getpid());
 
-  if(argc != 2){
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+  // with amo_log, a restarted server carries on with its clients
+  if(argc != 2 && argc != 3){
+    fprintf(stderr, "Usage: %s port [amo_log]\n", argv[0]);
     exit(1);
   }
 
@@ -32,10 +33,8 @@ main(int argc, char *argv[])
 
 #ifndef RSM
   lock_server ls;
-  rpcs server(atoi(argv[1]), count);
-  server.reg(lock_protocol::stat, &ls, &lock_server::stat);
-  server.reg(lock_protocol::acquire, &ls, &lock_server::acquire);
-  server.reg(lock_protocol::release, &ls, &lock_server::release);
+  rpcs server(atoi(argv[1]), count, argc == 3 ? argv[2] : NULL);
+  lock_protocol::reg(&server, &ls);
 #endif
 
 
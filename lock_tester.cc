@@ -13,7 +13,9 @@
 #include "lang/verify.h"
 
 // must be >= 2
-int nt = 6; //XXX: lab1's rpc handlers are blocking. Since rpcs uses a thread pool of 10 threads, we cannot test more than 10 blocking rpc.
+// acquire waits without a server thread, so this may be more than the
+// server's dispatch threads
+int nt = 10;
 std::string dst;
 lock_client **lc = new lock_client * [nt];
 lock_protocol::lockid_t a = 1;
@@ -73,6 +75,17 @@ test1(void)
     check_release(b);
     lc[0]->release(a);
     check_release(a);
+
+    printf ("acquire a and b in one batch, release both in one batch\n");
+    std::vector<lock_protocol::lockid_t> ab;
+    ab.push_back(a);
+    ab.push_back(b);
+    VERIFY(lc[0]->acquire_all(ab) == lock_protocol::OK);
+    check_grant(a);
+    check_grant(b);
+    check_release(a);
+    check_release(b);
+    VERIFY(lc[0]->release_all(ab) == lock_protocol::OK);
 }
 
 void *
@@ -142,6 +155,23 @@ test5(void *x)
   return 0;
 }
 
+// test6: coroutines on one thread take turns with the lock. a waiter
+// holds no server thread, so there are more of them than the pool has,
+// two to each client.
+rpc_task<>
+test6(int i)
+{
+  for (int j = 0; j < 10; j++) {
+    lock_protocol::status ret = co_await lc[i % nt]->co_acquire(a);
+    VERIFY(ret == lock_protocol::OK);
+    check_grant(a);
+    printf ("test6: coroutine %d got lock\n", i);
+    check_release(a);
+    ret = co_await lc[i % nt]->co_release(a);
+    VERIFY(ret == lock_protocol::OK);
+  }
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -164,8 +194,8 @@ main(int argc, char *argv[])
 
     if (argc > 2) {
       test = atoi(argv[2]);
-      if(test < 1 || test > 5){
-        printf("Test number must be between 1 and 5\n");
+      if(test < 1 || test > 6){
+        printf("Test number must be between 1 and 6\n");
         exit(1);
       }
     }
@@ -233,6 +263,17 @@ main(int argc, char *argv[])
       }
     }
 
+    if(!test || test == 6){
+      printf("test 6\n");
+
+      // test 6
+      std::vector<rpc_task<> > tasks;
+      for (int i = 0; i < 2 * nt; i++)
+	tasks.push_back(test6(i));
+      for (int i = 0; i < 2 * nt; i++)
+	tasks[i].get();
+    }
+
     printf ("%s: passed all tests successfully\n", argv[0]);
 
 }
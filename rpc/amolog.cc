@@ -0,0 +1,265 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "amolog.h"
+#include "slock.h"
+#include "jsl_log.h"
+#include "lang/verify.h"
+
+namespace {
+
+const uint32_t MAGIC = 0x316f6d61;   // "amo1"
+
+inline size_t
+align8(size_t n)
+{
+	return (n + 7) & ~(size_t) 7;
+}
+
+}
+
+amo_log::amo_log() : nonce_(0), cur_(NULL), old_(NULL), compacting_(false)
+{
+	VERIFY(pthread_mutex_init(&m_, 0) == 0);
+}
+
+amo_log::~amo_log()
+{
+	unmap(cur_.load());
+	unmap(old_);
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
+}
+
+amo_log::segment *
+amo_log::map_file(const std::string &path, bool create)
+{
+	int fd = ::open(path.c_str(), O_RDWR | (create ? O_CREAT | O_TRUNC : 0),
+			0644);
+	if (fd < 0) {
+		if (create || errno != ENOENT)
+			jsl_log(JSL_DBG_OFF, "amo_log: open %s: %s\n", path.c_str(),
+					strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	VERIFY(fstat(fd, &st) == 0);
+	void *p = mmap(NULL, MAP_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		jsl_log(JSL_DBG_OFF, "amo_log: mmap %s: %s\n", path.c_str(),
+				strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	segment *s = new segment;
+	s->fd = fd;
+	s->base = (char *) p;
+	s->end = 0;
+	s->size = std::min((size_t) st.st_size, (size_t) MAP_SZ);
+	return s;
+}
+
+void
+amo_log::unmap(segment *s)
+{
+	if (!s)
+		return;
+	VERIFY(munmap(s->base, MAP_SZ) == 0);
+	close(s->fd);
+	delete s;
+}
+
+// hand every finished record to replay. false if s is not a log.
+bool
+amo_log::replay_file(segment *s, unsigned int *nonce,
+		std::function<void(const rec &)> &replay)
+{
+	size_t size = s->size;
+	header *h = (header *) s->base;
+	if (size < sizeof(header) || h->magic != MAGIC)
+		return false;
+	*nonce = h->nonce;
+
+	size_t off = sizeof(header);
+	int n = 0;
+	while (off + sizeof(rec_header) <= size) {
+		rec_header *rh = (rec_header *) (s->base + off);
+		// a record that was never begun ends the log. one that was
+		// begun but not finished, at a crash, is passed over.
+		if (rh->len < sizeof(rec_header) || off + rh->len > size)
+			break;
+		if (rh->type && rh->sz >= 0 &&
+				rh->len >= sizeof(rec_header) + (size_t) rh->sz) {
+			rec r;
+			r.type = rh->type;
+			r.clt_nonce = rh->clt_nonce;
+			r.xid = rh->xid;
+			r.sz = rh->sz;
+			r.buf = rh->type == REPLY && rh->len > sizeof(rec_header) ?
+				(char *) (rh + 1) : NULL;
+			replay(r);
+			n++;
+		}
+		off += rh->len;
+	}
+	jsl_log(JSL_DBG_2, "amo_log: replayed %d records, %lu bytes\n", n,
+			(unsigned long) off);
+	return true;
+}
+
+bool
+amo_log::open(const std::string &path, unsigned int *nonce,
+		std::function<void(const rec &)> replay)
+{
+	path_ = path;
+	// a compaction that did not finish left its file next to the log
+	segment *s = map_file(path_, false);
+	if (s) {
+		if (!replay_file(s, nonce, replay))
+			jsl_log(JSL_DBG_OFF, "amo_log: %s is not a log, starting over\n",
+					path_.c_str());
+		unmap(s);
+	}
+	s = map_file(path_ + ".new", false);
+	if (s) {
+		replay_file(s, nonce, replay);
+		unmap(s);
+	}
+	nonce_ = *nonce;
+
+	compacting_ = true;
+	s = start_file();
+	if (!s) {
+		compacting_ = false;
+		return false;
+	}
+	cur_ = s;
+	return true;
+}
+
+// a new file, next to the log, with just the header
+amo_log::segment *
+amo_log::start_file()
+{
+	segment *s = map_file(path_ + ".new", true);
+	if (!s)
+		return NULL;
+	if (!grow(s, sizeof(header))) {
+		unmap(s);
+		return NULL;
+	}
+	header *h = (header *) s->base;
+	h->magic = MAGIC;
+	h->nonce = nonce_;
+	h->pad = 0;
+	s->end = sizeof(header);
+	return s;
+}
+
+bool
+amo_log::grow(segment *s, size_t need)
+{
+	ScopedLock ml(&m_);
+	while (s->size < need) {
+		size_t n = s->size + GROW_SZ;
+		if (ftruncate(s->fd, n) != 0) {
+			jsl_log(JSL_DBG_OFF, "amo_log: grow %s: %s\n", path_.c_str(),
+					strerror(errno));
+			return false;
+		}
+		s->size = n;
+	}
+	return true;
+}
+
+void
+amo_log::append(int type, unsigned int clt_nonce, unsigned int xid,
+		const char *b, int sz)
+{
+	segment *s = cur_.load(std::memory_order_acquire);
+	int psz = b ? sz : 0;
+	size_t len = align8(sizeof(rec_header) + psz);
+	size_t off = s->end.fetch_add(len);
+	if (off + len > MAP_SZ) {
+		jsl_log(JSL_DBG_OFF, "amo_log: %s full, record dropped\n",
+				path_.c_str());
+		return;
+	}
+	if (off + len > s->size && !grow(s, off + len))
+		return;
+	rec_header *rh = (rec_header *) (s->base + off);
+	rh->len = len;
+	rh->clt_nonce = clt_nonce;
+	rh->xid = xid;
+	rh->sz = sz;
+	rh->pad = 0;
+	if (psz)
+		memcpy(rh + 1, b, psz);
+	__atomic_store_n(&rh->type, (uint32_t) type, __ATOMIC_RELEASE);
+}
+
+void
+amo_log::ack(unsigned int clt_nonce, unsigned int xid_rep)
+{
+	append(ACK, clt_nonce, xid_rep, NULL, 0);
+}
+
+void
+amo_log::reply(unsigned int clt_nonce, unsigned int xid, const char *b,
+		int sz)
+{
+	append(REPLY, clt_nonce, xid, sz <= REPLY_MAX ? b : NULL, sz);
+}
+
+void
+amo_log::client(unsigned int clt_nonce, unsigned int begin)
+{
+	append(CLIENT, clt_nonce, begin, NULL, 0);
+}
+
+bool
+amo_log::full()
+{
+	return cur_.load(std::memory_order_relaxed)->end > COMPACT_SZ &&
+		!compacting_.load(std::memory_order_relaxed);
+}
+
+bool
+amo_log::compact_start()
+{
+	bool idle = false;
+	if (!compacting_.compare_exchange_strong(idle, true))
+		return false;
+	segment *s = start_file();
+	if (!s) {
+		compacting_ = false;
+		return false;
+	}
+	ScopedLock ml(&m_);
+	old_ = cur_.exchange(s);
+	return true;
+}
+
+// the caller has written every client since compact_start(), under its
+// lock, and every client's appends take that lock, so none is still
+// writing to the old file
+void
+amo_log::compact_end()
+{
+	if (rename((path_ + ".new").c_str(), path_.c_str()) != 0)
+		jsl_log(JSL_DBG_OFF, "amo_log: rename to %s: %s\n", path_.c_str(),
+				strerror(errno));
+	segment *s;
+	{
+		ScopedLock ml(&m_);
+		s = old_;
+		old_ = NULL;
+	}
+	unmap(s);
+	compacting_ = false;
+}
@@ -0,0 +1,111 @@
+#ifndef amolog_h
+#define amolog_h
+
+// an append-only log of an rpcs's at-most-once state. a server that
+// restarts on its log keeps its nonce and its clients' windows, so
+// the clients carry on without rebinding, and a duplicate of a call
+// the last instance ran gets the reply it made.
+//
+// the file is a header with the server's nonce, then records: a
+// client's window moving up, a reply the client may ask for again (or
+// only that the call ran, for a reply too big to keep), and, from
+// compaction, a client's window starting over. the file is mapped; an
+// append reserves space with an atomic add and copies the record in,
+// type last, so that recovery can tell a record that was never
+// finished. records of a client are appended under that client's lock,
+// so they are in order for each client.
+//
+// past COMPACT_SZ the log moves on to a new file, which gets a record
+// of every client after appends have gone over to it. replaying the
+// old file and then the new gives the same state, so the old one is
+// replaced only once the new one is complete. the log survives the
+// process, not the machine: nothing is synced.
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+
+class amo_log {
+	public:
+		enum {
+			MAP_SZ = 1 << 30,      // address space for one file
+			GROW_SZ = 1 << 20,     // files grow by this much
+			COMPACT_SZ = 64 << 20,
+			REPLY_MAX = 4096,      // bigger replies are logged as lost
+		};
+		enum rec_type { ACK = 1, REPLY = 2, CLIENT = 3 };
+
+		struct rec {
+			int type;
+			unsigned int clt_nonce;
+			// ACK: the client's xid_rep; REPLY: the call's xid; CLIENT:
+			// the start of the window
+			unsigned int xid;
+			const char *buf;   // REPLY: NULL if lost
+			int sz;
+		};
+
+		amo_log();
+		~amo_log();
+
+		// open the log at path, creating it if need be, and replay what
+		// it holds; *nonce is the server's, from the log if it has one.
+		// leaves the log as compact_start() does. false if path cannot
+		// be used.
+		bool open(const std::string &path, unsigned int *nonce,
+				std::function<void(const rec &)> replay);
+
+		void ack(unsigned int clt_nonce, unsigned int xid_rep);
+		void reply(unsigned int clt_nonce, unsigned int xid, const char *b,
+				int sz);
+		void client(unsigned int clt_nonce, unsigned int begin);
+
+		// whether it is time to compact
+		bool full();
+		// move appends to a new file; false if a compaction is under way.
+		// the caller then records every client, and calls compact_end().
+		bool compact_start();
+		void compact_end();
+
+	private:
+		struct header {
+			uint32_t magic;
+			uint32_t nonce;
+			uint64_t pad;
+		};
+		// 8 byte aligned; len covers the payload that follows
+		struct rec_header {
+			uint32_t type;   // 0 until the rest is written
+			uint32_t len;
+			uint32_t clt_nonce;
+			uint32_t xid;
+			int32_t sz;
+			uint32_t pad;
+		};
+		struct segment {
+			int fd;
+			char *base;
+			std::atomic<size_t> end;    // next free byte
+			std::atomic<size_t> size;   // of the file
+		};
+
+		segment *map_file(const std::string &path, bool create);
+		void unmap(segment *s);
+		bool replay_file(segment *s, unsigned int *nonce,
+				std::function<void(const rec &)> &replay);
+		segment *start_file();
+		void append(int type, unsigned int clt_nonce, unsigned int xid,
+				const char *b, int sz);
+		bool grow(segment *s, size_t need);
+
+		std::string path_;
+		unsigned int nonce_;
+		std::atomic<segment *> cur_;
+		segment *old_;   // until compact_end()
+		pthread_mutex_t m_;   // growing and switching files
+		std::atomic<bool> compacting_;
+};
+
+#endif
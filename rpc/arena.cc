@@ -0,0 +1,326 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <set>
+
+#include "arena.h"
+#include "slock.h"
+#include "lang/verify.h"
+
+namespace {
+
+const int MIN_SHIFT = 10;   // smallest class is 1K, the initial marshall size
+const int NCLASSES = 7;     // 1K .. 64K
+const int MAX_CACHED = 32;  // free buffers an arena keeps per class
+
+class rpc_arena;
+
+struct buf_hdr {
+	rpc_arena *arena;  // owning arena, NULL for oversized buffers
+	std::atomic<int> refs;
+	int cap;
+};
+
+inline buf_hdr *hdr(const char *b) { return (buf_hdr *) b - 1; }
+inline char *data(buf_hdr *h) { return (char *) (h + 1); }
+// a cached buffer links to the next one through its data area
+inline buf_hdr *&link(buf_hdr *h) { return *(buf_hdr **) data(h); }
+
+int
+size_class(int sz)
+{
+	for (int c = 0; c < NCLASSES; c++) {
+		if (sz <= (1 << (c + MIN_SHIFT)))
+			return c;
+	}
+	return -1;
+}
+
+struct counters {
+	counters() : allocs(0), hits(0), oversized(0), frees(0),
+		remote_frees(0), cached_bytes(0) {}
+	std::atomic<unsigned long long> allocs, hits, oversized, frees,
+		remote_frees, cached_bytes;
+
+	void add_to(rpc_arena_stats_t *st) const {
+		st->allocs += allocs.load(std::memory_order_relaxed);
+		st->hits += hits.load(std::memory_order_relaxed);
+		st->oversized += oversized.load(std::memory_order_relaxed);
+		st->frees += frees.load(std::memory_order_relaxed);
+		st->remote_frees += remote_frees.load(std::memory_order_relaxed);
+		st->cached_bytes += cached_bytes.load(std::memory_order_relaxed);
+	}
+};
+
+pthread_mutex_t registry_m = PTHREAD_MUTEX_INITIALIZER;
+std::set<rpc_arena *> registry;   // live arenas, for rpc_arena_stats()
+rpc_arena_stats_t retired;        // totals of deleted arenas
+
+// the local free lists are touched only by the owning thread. other
+// threads push released buffers onto remote_, which the owner drains
+// when its own list of that class runs dry. the arena outlives its
+// thread until the last buffer it handed out has come back.
+class rpc_arena {
+	public:
+		rpc_arena() : remote_(NULL), orphaned_(false), refs_(1) {
+			memset(free_, 0, sizeof(free_));
+			memset(nfree_, 0, sizeof(nfree_));
+			ScopedLock rl(&registry_m);
+			registry.insert(this);
+		}
+
+		~rpc_arena() {
+			ScopedLock rl(&registry_m);
+			registry.erase(this);
+			st_.add_to(&retired);
+		}
+
+		buf_hdr *get(int cls);
+		void put(buf_hdr *h);
+		void put_remote(buf_hdr *h);
+		void owner_exit();
+
+		counters st_;
+
+	private:
+		void cache(buf_hdr *h);
+		void drain_remote();
+		void drop(buf_hdr *h);
+		void unref();
+
+		buf_hdr *free_[NCLASSES];
+		int nfree_[NCLASSES];
+		std::atomic<buf_hdr *> remote_;
+		std::atomic<bool> orphaned_;
+		// buffers handed out and not yet returned, plus one for the owner
+		std::atomic<int> refs_;
+};
+
+buf_hdr *
+rpc_arena::get(int cls)
+{
+	if (!free_[cls])
+		drain_remote();
+	buf_hdr *h = free_[cls];
+	if (h) {
+		free_[cls] = link(h);
+		nfree_[cls]--;
+		st_.hits.fetch_add(1, std::memory_order_relaxed);
+		st_.cached_bytes.fetch_sub(h->cap, std::memory_order_relaxed);
+	} else {
+		int cap = 1 << (cls + MIN_SHIFT);
+		h = (buf_hdr *) malloc(sizeof(buf_hdr) + cap);
+		VERIFY(h);
+		h->arena = this;
+		h->cap = cap;
+	}
+	refs_.fetch_add(1, std::memory_order_relaxed);
+	return h;
+}
+
+// keep h for reuse if the class is not full; owner only
+void
+rpc_arena::cache(buf_hdr *h)
+{
+	int cls = size_class(h->cap);
+	if (nfree_[cls] < MAX_CACHED) {
+		link(h) = free_[cls];
+		free_[cls] = h;
+		nfree_[cls]++;
+	} else {
+		drop(h);
+	}
+}
+
+void
+rpc_arena::drop(buf_hdr *h)
+{
+	st_.cached_bytes.fetch_sub(h->cap, std::memory_order_relaxed);
+	free(h);
+}
+
+void
+rpc_arena::put(buf_hdr *h)
+{
+	st_.cached_bytes.fetch_add(h->cap, std::memory_order_relaxed);
+	cache(h);
+	unref();
+}
+
+void
+rpc_arena::put_remote(buf_hdr *h)
+{
+	st_.remote_frees.fetch_add(1, std::memory_order_relaxed);
+	if (orphaned_.load()) {
+		free(h);
+	} else {
+		st_.cached_bytes.fetch_add(h->cap, std::memory_order_relaxed);
+		buf_hdr *old = remote_.load();
+		do {
+			link(h) = old;
+		} while (!remote_.compare_exchange_weak(old, h));
+		// the owner may have exited after we looked; if so its final
+		// drain may have missed our push, so clean up ourselves
+		if (orphaned_.load())
+			drain_remote();
+	}
+	unref();
+}
+
+// move everything other threads gave back into the local lists, or
+// free it all once the owner is gone
+void
+rpc_arena::drain_remote()
+{
+	buf_hdr *h = remote_.exchange(NULL);
+	while (h) {
+		buf_hdr *n = link(h);
+		if (orphaned_.load())
+			drop(h);
+		else
+			cache(h);
+		h = n;
+	}
+}
+
+void
+rpc_arena::owner_exit()
+{
+	orphaned_.store(true);
+	for (int c = 0; c < NCLASSES; c++) {
+		while (free_[c]) {
+			buf_hdr *h = free_[c];
+			free_[c] = link(h);
+			drop(h);
+		}
+		nfree_[c] = 0;
+	}
+	drain_remote();
+	unref();
+}
+
+void
+rpc_arena::unref()
+{
+	if (refs_.fetch_sub(1) == 1)
+		delete this;
+}
+
+// the calling thread's arena, created on first use and orphaned when
+// the thread exits
+thread_local rpc_arena *cur_arena = NULL;
+
+struct arena_holder {
+	arena_holder() { cur_arena = new rpc_arena(); }
+	~arena_holder() {
+		rpc_arena *a = cur_arena;
+		cur_arena = NULL;
+		a->owner_exit();
+	}
+};
+
+rpc_arena *
+my_arena()
+{
+	static thread_local arena_holder holder;
+	return cur_arena;
+}
+
+} // namespace
+
+char *
+rpc_buf_alloc(int sz)
+{
+	VERIFY(sz >= 0);
+	rpc_arena *a = my_arena();
+	buf_hdr *h;
+	int cls = size_class(sz);
+
+	// NULL while this thread's own arena is being torn down; such a
+	// buffer is plain malloc, the same as an oversized one
+	if (a)
+		a->st_.allocs.fetch_add(1, std::memory_order_relaxed);
+	if (cls < 0 || !a) {
+		if (a)
+			a->st_.oversized.fetch_add(1, std::memory_order_relaxed);
+		h = (buf_hdr *) malloc(sizeof(buf_hdr) + sz);
+		VERIFY(h);
+		h->arena = NULL;
+		h->cap = sz;
+	} else {
+		h = a->get(cls);
+	}
+	h->refs.store(1, std::memory_order_relaxed);
+	return data(h);
+}
+
+char *
+rpc_buf_realloc(char *b, int sz)
+{
+	if (!b)
+		return rpc_buf_alloc(sz);
+	buf_hdr *h = hdr(b);
+	VERIFY(h->refs.load() == 1);
+	if (sz <= h->cap)
+		return b;
+	if (!h->arena && size_class(sz) < 0) {
+		h = (buf_hdr *) realloc(h, sizeof(buf_hdr) + sz);
+		VERIFY(h);
+		h->cap = sz;
+		return data(h);
+	}
+	char *n = rpc_buf_alloc(sz);
+	memcpy(n, b, h->cap);
+	rpc_buf_unref(b);
+	return n;
+}
+
+int
+rpc_buf_capacity(const char *b)
+{
+	return hdr(b)->cap;
+}
+
+void
+rpc_buf_ref(char *b)
+{
+	hdr(b)->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+rpc_buf_unref(char *b)
+{
+	if (!b)
+		return;
+	buf_hdr *h = hdr(b);
+	if (h->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+
+	// NULL while this thread's own arena is being torn down
+	rpc_arena *a = my_arena();
+	if (a)
+		a->st_.frees.fetch_add(1, std::memory_order_relaxed);
+	if (!h->arena)
+		free(h);
+	else if (h->arena == a)
+		a->put(h);
+	else
+		h->arena->put_remote(h);
+}
+
+void
+rpc_arena_stats(rpc_arena_stats_t *st)
+{
+	*st = rpc_arena_stats_t();
+	ScopedLock rl(&registry_m);
+	std::set<rpc_arena *>::iterator i;
+	for (i = registry.begin(); i != registry.end(); i++)
+		(*i)->st_.add_to(st);
+	st->allocs += retired.allocs;
+	st->hits += retired.hits;
+	st->oversized += retired.oversized;
+	st->frees += retired.frees;
+	st->remote_frees += retired.remote_frees;
+	st->cached_bytes += retired.cached_bytes;
+	st->arenas = registry.size();
+}
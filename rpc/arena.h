@@ -0,0 +1,42 @@
+#ifndef arena_h
+#define arena_h
+
+// per-thread slab arenas for rpc buffers.
+//
+// every marshall/unmarshall/connection buffer comes from rpc_buf_alloc().
+// small buffers are carved from the calling thread's arena in power-of-two
+// size classes and cached there when released, so in steady state encoding
+// a reply, keeping it in the at-most-once window and dropping it on ack
+// never reach malloc. buffers are reference counted: the last
+// rpc_buf_unref() hands the buffer back to the arena of the thread that
+// allocated it, whichever thread it runs on. buffers bigger than the
+// largest class are malloc'd and freed directly.
+
+#include <atomic>
+
+struct rpc_arena_stats_t {
+	rpc_arena_stats_t() : allocs(0), hits(0), oversized(0), frees(0),
+		remote_frees(0), cached_bytes(0), arenas(0) {}
+	unsigned long long allocs;        // rpc_buf_alloc() calls
+	unsigned long long hits;          // ... served from an arena cache
+	unsigned long long oversized;     // ... too big for any size class
+	unsigned long long frees;         // buffers released
+	unsigned long long remote_frees;  // ... by a thread other than the owner
+	unsigned long long cached_bytes;  // bytes sitting in arena caches now
+	unsigned long long arenas;        // arenas alive
+};
+
+// a buffer of at least sz bytes holding one reference
+char *rpc_buf_alloc(int sz);
+// grow b (which must hold the only reference) to at least sz bytes,
+// keeping its contents. b may be NULL.
+char *rpc_buf_realloc(char *b, int sz);
+int rpc_buf_capacity(const char *b);
+void rpc_buf_ref(char *b);
+// drop a reference; the last one releases the buffer. b may be NULL.
+void rpc_buf_unref(char *b);
+
+// totals over all arenas, including those of exited threads
+void rpc_arena_stats(rpc_arena_stats_t *st);
+
+#endif
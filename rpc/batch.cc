@@ -0,0 +1,173 @@
+// batched rpcs, see batch.h
+
+#include <algorithm>
+#include <atomic>
+
+#include "batch.h"
+#include "slock.h"
+#include "jsl_log.h"
+#include "lang/verify.h"
+
+int
+rpc_batch::call(rpcc *cl, rpcc::TO to)
+{
+	reps_.clear();
+	int ret = cl->call(rpc_const::batch, (unsigned int) flags_, calls_,
+			reps_, to);
+	if (ret < 0)
+		return ret;
+	if (reps_.size() != calls_.size())
+		return rpc_const::unmarshal_reply_failure;
+	for (size_t i = 0; i < calls_.size(); i++) {
+		if (reps_[i].ret < 0)
+			continue;
+		unmarshall u(reps_[i].rep);
+		if (!unpack_[i](u)) {
+			fprintf(stderr, "rpc_batch::call: failed to unmarshall the reply "
+					"of RPC 0x%x\n", calls_[i].proc);
+			reps_[i].ret = rpc_const::unmarshal_reply_failure;
+		}
+	}
+	return 0;
+}
+
+// a batch being run. it is answered when its last call is, from
+// whichever thread answers that, and goes once the workers of a
+// parallel batch are done with it too.
+struct batch_run {
+	rpc_reply *reply;
+	std::vector<batch_call> calls;
+	std::vector<batch_reply> reps;
+	bool parallel;
+	size_t next;                // in order: the call to start next
+	std::atomic<int> step;      // in order: holds on the running call
+	std::atomic<size_t> take;   // in parallel: the next call not taken
+	std::atomic<int> left;      // in parallel: calls not yet answered
+	std::atomic<int> refs;      // the answer's, and a parallel worker's each
+};
+
+// run call i of b as dispatch() would, minus the at-most-once
+// bookkeeping, which the batch does for all of its calls. an async
+// handler's call is answered later, and holds no thread meanwhile.
+void
+rpcs::batch1(batch_run *b, size_t i)
+{
+	const batch_call &c = b->calls[i];
+	batch_reply &r = b->reps[i];
+	handler *f = NULL;
+	// the reserved procs make no sense inside a batch
+	if (c.proc > rpc_const::batch)
+		f = proctab_.load(std::memory_order_acquire)->find(c.proc);
+	if (!f) {
+		jsl_log(JSL_DBG_1, "rpcs::batch: bad proc %x\n", c.proc);
+		r.ret = rpc_const::batch_failure;
+		batch_done1(b);
+		return;
+	}
+
+	if (counting_)
+		updatestat(c.proc);
+
+	unmarshall args(c.args);
+	if (async_handler *af = f->async()) {
+		replies_owed_++;
+		af->afn(args, new rpc_reply(this,
+					[this, b, &r](int ret, marshall &rep) {
+						r.ret = ret;
+						r.rep = rep.get_content();
+						batch_done1(b);
+					}));
+		return;
+	}
+	marshall rep;
+	r.ret = f->fn(args, rep);
+	r.rep = rep.get_content();
+	batch_done1(b);
+}
+
+// a call of b has been answered
+void
+rpcs::batch_done1(batch_run *b)
+{
+	if (b->parallel) {
+		if (--b->left == 0) {
+			b->reply->done(0, b->reps);
+			batch_put(b);
+		}
+		return;
+	}
+	// the next call in order starts once this one is answered. the
+	// thread that started it goes on, unless it has given up already;
+	// then the pool does, as this may be any thread at all.
+	if (--b->step == 0)
+		VERIFY(batchpool_->addObjJob(this, &rpcs::batch_seq, b));
+}
+
+// the calls of b in order, from b->next on
+void
+rpcs::batch_seq(batch_run *b)
+{
+	while (b->next < b->calls.size()) {
+		b->step = 2;
+		batch1(b, b->next++);
+		// not answered yet: its answer carries on from here
+		if (--b->step != 0)
+			return;
+	}
+	b->reply->done(0, b->reps);
+	batch_put(b);
+}
+
+// a worker of a parallel batch, taking the next call not yet taken
+// until there are none left
+void
+rpcs::batch_par(batch_run *b)
+{
+	size_t i;
+	while ((i = b->take++) < b->calls.size())
+		batch1(b, i);
+	batch_put(b);
+}
+
+void
+rpcs::batch_put(batch_run *b)
+{
+	if (--b->refs == 0)
+		delete b;
+}
+
+void
+rpcs::batch(rpc_reply *reply, unsigned int flags,
+		std::vector<batch_call> calls)
+{
+	if (calls.size() > BATCH_MAX) {
+		reply->done(rpc_const::batch_failure);
+		return;
+	}
+	jsl_log(JSL_DBG_2, "rpcs::batch: %d calls flags %x\n", (int) calls.size(),
+			flags);
+
+	batch_run *b = new batch_run;
+	b->reply = reply;
+	b->calls.swap(calls);
+	b->reps.resize(b->calls.size());
+	b->parallel = (flags & BATCH_PARALLEL) && b->calls.size() >= 2;
+	b->next = 0;
+	b->step = 0;
+	b->take = 0;
+	b->left = b->calls.size();
+	b->refs = 1;
+
+	if (!b->parallel) {
+		batch_seq(b);
+		return;
+	}
+
+	// this thread and up to BATCH_THREADS - 1 of the batch pool's run
+	// the calls; a call that waits is left to its answer
+	int n = std::min((int) b->calls.size(), (int) BATCH_THREADS);
+	b->refs += n;
+	for (int i = 1; i < n; i++)
+		VERIFY(batchpool_->addObjJob(this, &rpcs::batch_par, b));
+	batch_par(b);
+}
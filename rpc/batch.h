@@ -0,0 +1,98 @@
+#ifndef batch_h
+#define batch_h
+
+// batched rpcs.
+//
+// an rpc_batch carries several calls, to any mix of procs, in one
+// request on the reserved proc rpc_const::batch, and brings all their
+// replies back in one reply. the batch costs one round trip and one
+// entry in the server's reply window, and the server runs it at most
+// once as a whole: a retransmitted batch never runs any of its calls
+// again.
+//
+// by default the server runs the calls one after another, in the order
+// they were added, so a batch that acquires a and then b takes the
+// locks in that order. with BATCH_PARALLEL it runs BATCH_THREADS of
+// them at a time, and a batch of no more calls than that takes as long
+// as the slowest. either way every call gets its own return value, and
+// one failing does not stop the others. a call to an async handler
+// that waits holds no server thread, in a batch as out of one: the
+// batch is answered once its last call is.
+
+#include <string>
+#include <vector>
+#include <functional>
+#include "rpc.h"
+
+enum {
+	BATCH_MAX = 64,   // calls in one batch
+	BATCH_THREADS = 4,   // calls of a parallel batch running at once
+	BATCH_POOL_THREADS = 8,   // shared by all batches, for the rest
+};
+
+// batch flags
+enum {
+	BATCH_PARALLEL = 1,
+};
+
+// one call of a batch on the wire
+struct batch_call {
+	unsigned int proc;
+	std::string args;   // marshalled arguments, no header
+	MARSHALL_FIELDS(proc, args)
+};
+
+// and its reply
+struct batch_reply {
+	batch_reply(): ret(0) {}
+	int ret;
+	std::string rep;
+	MARSHALL_FIELDS(ret, rep)
+};
+
+class rpc_batch {
+	public:
+		rpc_batch(int flags = 0) : flags_(flags) {}
+
+		// queue a call of proc; r receives its reply when the batch is
+		// sent. returns the call's index, for ret().
+		template<class R, class... A>
+			int add(unsigned int proc, R &r, const A &... a);
+
+		// send the batch and wait for all of its replies. 0 if the batch
+		// made it through, whatever its calls returned, or the
+		// rpc_const failure of the batch as a whole.
+		int call(rpcc *cl, rpcc::TO to = rpcc::to_max);
+
+		// what call i returned, once call() has succeeded
+		int ret(int i) { return reps_[i].ret; }
+		int size() { return calls_.size(); }
+
+	private:
+		int flags_;
+		std::vector<batch_call> calls_;
+		std::vector<batch_reply> reps_;
+		// unmarshall a reply into the caller's variable
+		std::vector<std::function<bool(unmarshall &)> > unpack_;
+};
+
+template<class R, class... A> int
+rpc_batch::add(unsigned int proc, R &r, const A &... a)
+{
+	VERIFY(calls_.size() < BATCH_MAX);
+	marshall m;
+	int unused[] = { 0, ((m << a), 0)... };
+	(void) unused;
+	batch_call c;
+	c.proc = proc;
+	c.args = m.get_content();
+	calls_.push_back(c);
+	R *rp = &r;
+	unpack_.push_back([rp](unmarshall &u) {
+		u >> *rp;
+		return u.okdone();
+	});
+	return calls_.size() - 1;
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef calltab_h
+#define calltab_h
+
+// the calls an rpcc has in flight, by xid.
+//
+// a fixed array of slots, open addressed from xid % SLOTS. xids are
+// handed out in order, so a call nearly always lands in its home slot
+// and a reply finds it at the first probe. each slot is one atomic
+// word: the xid of its call, whose tag turns away replies to an
+// earlier call that used the slot, a live bit, and a count of the
+// threads looking at the call. lookups pin the call with a compare
+// and swap instead of taking a lock; remove() clears the live bit
+// and waits for the pins to go before the slot can be reused, so a
+// pinned call stays valid until unpinned.
+
+#include <atomic>
+#include <sched.h>
+#include <stdint.h>
+#include "lang/verify.h"
+
+template<class T>
+class call_table {
+	public:
+		enum {
+			SLOTS = 4096,     // a power of two
+			MAX_PROBE = 32,   // slots tried from a call's home slot
+		};
+
+		call_table() : n_(0) {
+			for (int i = 0; i < SLOTS; i++) {
+				slots_[i].word.store(0, std::memory_order_relaxed);
+				slots_[i].p = NULL;
+			}
+		}
+
+		// add the call xid, which must not be 0; returns its slot, for
+		// remove(), or -1 if MAX_PROBE calls from long ago fill the home
+		// run. waiting for one to go could wait on the very thread that
+		// would finish it.
+		int insert(unsigned int xid, T *p);
+		// the call xid, pinned, or NULL if it is not in flight
+		T *pin(unsigned int xid, int *slot);
+		void unpin(int slot) {
+			slots_[slot].word.fetch_sub(1, std::memory_order_release);
+		}
+		// take the call in slot out, once nobody has it pinned
+		void remove(int slot);
+		// run f on every call in flight, each pinned meanwhile
+		template<class F> void for_each(F f);
+
+		int size() { return n_.load(); }
+
+	private:
+		static const uint64_t LIVE = 1ULL << 31;
+		static const uint64_t PINS = LIVE - 1;
+
+		static uint64_t tag(unsigned int xid) { return (uint64_t) xid << 32; }
+
+		struct slot {
+			// xid << 32 | LIVE | pins; 0 when free. a slot with a tag
+			// but no LIVE bit is being filled or emptied.
+			std::atomic<uint64_t> word;
+			T *p;
+		};
+
+		slot slots_[SLOTS];
+		std::atomic<int> n_;
+};
+
+template<class T> int
+call_table<T>::insert(unsigned int xid, T *p)
+{
+	// tag(0) is a free slot's word
+	VERIFY(xid != 0);
+	for (int i = 0; i < MAX_PROBE; i++) {
+		int s = (xid + i) & (SLOTS - 1);
+		uint64_t w = 0;
+		if (slots_[s].word.compare_exchange_strong(w, tag(xid))) {
+			slots_[s].p = p;
+			n_++;
+			slots_[s].word.store(tag(xid) | LIVE);
+			return s;
+		}
+	}
+	return -1;
+}
+
+template<class T> T *
+call_table<T>::pin(unsigned int xid, int *slot)
+{
+	for (int i = 0; i < MAX_PROBE; i++) {
+		int s = (xid + i) & (SLOTS - 1);
+		uint64_t w = slots_[s].word.load(std::memory_order_acquire);
+		while ((w & ~PINS) == (tag(xid) | LIVE)) {
+			if (slots_[s].word.compare_exchange_weak(w, w + 1,
+						std::memory_order_acquire)) {
+				*slot = s;
+				return slots_[s].p;
+			}
+		}
+	}
+	return NULL;
+}
+
+template<class T> void
+call_table<T>::remove(int s)
+{
+	uint64_t w = slots_[s].word.fetch_and(~LIVE);
+	VERIFY(w & LIVE);
+	// pins last only as long as a reply or timer takes to hand the call
+	// over, so spinning beats sleeping
+	while (slots_[s].word.load(std::memory_order_acquire) & PINS)
+		sched_yield();
+	slots_[s].p = NULL;
+	slots_[s].word.store(0);
+	n_--;
+}
+
+template<class T> template<class F> void
+call_table<T>::for_each(F f)
+{
+	for (int s = 0; s < SLOTS; s++) {
+		uint64_t w = slots_[s].word.load(std::memory_order_acquire);
+		while (w & LIVE) {
+			if (slots_[s].word.compare_exchange_weak(w, w + 1,
+						std::memory_order_acquire)) {
+				f(slots_[s].p);
+				unpin(s);
+				break;
+			}
+		}
+	}
+}
+
+#endif
@@ -12,13 +12,16 @@
 #include "pollmgr.h"
 #include "jsl_log.h"
 #include "gettime.h"
+#include "arena.h"
 #include "lang/verify.h"
 
 #define MAX_PDU (10<<20) //maximum PDF is 10M
+#define WRITEV_MAX 64 //iovec entries handed to one writev
 
 
 connection::connection(chanmgr *m1, int f1, int l1) 
-: mgr_(m1), fd_(f1), dead_(false),waiters_(0), refno_(1),lossy_(l1)
+: mgr_(m1), fd_(f1), dead_(false), wiov_(NULL), wiovcnt_(0),
+	wowned_(false), waiters_(0), refno_(1),lossy_(l1)
 {
 
 	int flags = fcntl(fd_, F_GETFL, NULL);
@@ -43,8 +46,9 @@ connection::~connection()
 	VERIFY(pthread_mutex_destroy(&ref_m_)== 0);
 	VERIFY(pthread_cond_destroy(&send_wait_) == 0);
 	VERIFY(pthread_cond_destroy(&send_complete_) == 0);
-	if (rpdu_.buf)
-		free(rpdu_.buf);
+	rpc_buf_unref(rpdu_.buf);
+	if (wowned_)
+		end_write();
 	VERIFY(!wpdu_.buf);
 	close(fd_);
 }
@@ -123,6 +127,20 @@ connection::compare(connection *another)
 bool
 connection::send(char *b, int sz)
 {
+	struct iovec v;
+	v.iov_base = b;
+	v.iov_len = sz;
+	return sendv(&v, 1);
+}
+
+bool
+connection::sendv(const struct iovec *iov, int n)
+{
+	int sz = 0;
+	for (int i = 0; i < n; i++)
+		sz += iov[i].iov_len;
+	VERIFY(n > 0 && iov[0].iov_len >= sizeof(int));
+
 	ScopedLock ml(&m_);
 	waiters_++;
 	while (!dead_ && wpdu_.buf) {
@@ -132,9 +150,11 @@ connection::send(char *b, int sz)
 	if (dead_) {
 		return false;
 	}
-	wpdu_.buf = b;
+	wpdu_.buf = (char *) iov[0].iov_base;
 	wpdu_.sz = sz;
 	wpdu_.solong = 0;
+	wiov_ = iov;
+	wiovcnt_ = n;
 
 	if (lossy_) {
 		if ((random()%100) < lossy_) {
@@ -148,6 +168,9 @@ connection::send(char *b, int sz)
 		VERIFY(pthread_mutex_unlock(&m_) == 0);
 		PollMgr::Instance()->block_remove_fd(fd_);
 		VERIFY(pthread_mutex_lock(&m_) == 0);
+		// read_cb() will not see the end of the stream now, and the
+		// replies other requests on it wait for are lost
+		mgr_->dead(this);
 	}else{
 		if (wpdu_.solong == wpdu_.sz) {
 		}else{
@@ -159,11 +182,64 @@ connection::send(char *b, int sz)
 		}
 	}
 	bool ret = (!dead_ && wpdu_.solong == wpdu_.sz);
+	end_write();
+	return ret;
+}
+
+bool
+connection::try_send(char *b, int sz)
+{
+	VERIFY(sz >= (int) sizeof(int));
+
+	ScopedLock ml(&m_);
+	if (dead_)
+		return true;
+	if (wpdu_.buf || waiters_)
+		return false;
+	wone_.iov_base = b;
+	wone_.iov_len = sz;
+	wpdu_.buf = b;
+	wpdu_.sz = sz;
+	wpdu_.solong = 0;
+	wiov_ = &wone_;
+	wiovcnt_ = 1;
+
+	if (lossy_) {
+		if ((random()%100) < lossy_) {
+			jsl_log(JSL_DBG_1, "connection::try_send LOSSY TEST shutdown fd_ %d\n", fd_);
+			shutdown(fd_,SHUT_RDWR);
+		}
+	}
+
+	if (!writepdu()) {
+		// as write_cb() would; block_remove_fd() would wait for the
+		// poll thread, which may be this one
+		PollMgr::Instance()->del_callback(fd_, CB_RDWR);
+		dead_ = true;
+		mgr_->dead(this);
+	} else if (wpdu_.solong < wpdu_.sz) {
+		rpc_buf_ref(b);
+		wowned_ = true;
+		PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
+		return true;
+	}
+	end_write();
+	return true;
+}
+
+// the pending pdu is done with, written or not. @pre m_ locked
+void
+connection::end_write()
+{
+	if (wowned_)
+		rpc_buf_unref(wpdu_.buf);
+	wowned_ = false;
 	wpdu_.solong = wpdu_.sz = 0;
 	wpdu_.buf = NULL;
+	wiov_ = NULL;
+	wiovcnt_ = 0;
 	if (waiters_ > 0)
 		pthread_cond_broadcast(&send_wait_);
-	return ret;
 }
 
 //fd_ is ready to be written
@@ -180,12 +256,18 @@ connection::write_cb(int s)
 	if (!writepdu()) {
 		PollMgr::Instance()->del_callback(fd_, CB_RDWR);
 		dead_ = true;
+		mgr_->dead(this);
 	}else{
 		VERIFY(wpdu_.solong >= 0);
 		if (wpdu_.solong < wpdu_.sz) {
 			return;
 		}
 	} 
+	if (wowned_) {
+		// nobody waits for try_send()'s pdu
+		end_write();
+		return;
+	}
 	pthread_cond_signal(&send_complete_);
 }
 
@@ -208,13 +290,26 @@ connection::read_cb(int s)
 		PollMgr::Instance()->del_callback(fd_,CB_RDWR);
 		dead_ = true;
 		pthread_cond_signal(&send_complete_);
+		if (wowned_)
+			end_write();
+		mgr_->dead(this);
 	}
 
 	if (rpdu_.buf && rpdu_.sz == rpdu_.solong) {
-		if (mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz)) {
-			//chanmgr has successfully consumed the pdu
-			rpdu_.buf = NULL;
-			rpdu_.sz = rpdu_.solong = 0;
+		// without m_, so that got_pdu() may reply on this connection.
+		// the pdu is handed off first, so whatever runs meanwhile finds
+		// rpdu_ empty rather than half consumed; the connection lasts
+		// until block_remove_fd(), which waits for this callback.
+		charbuf pdu = rpdu_;
+		rpdu_ = charbuf();
+		VERIFY(pthread_mutex_unlock(&m_) == 0);
+		bool took = mgr_->got_pdu(this, pdu.buf, pdu.sz);
+		VERIFY(pthread_mutex_lock(&m_) == 0);
+		if (!took) {
+			// chanmgr is busy; offered again on the next read_cb(). only
+			// this thread fills rpdu_, so it is still empty.
+			VERIFY(!rpdu_.buf);
+			rpdu_ = pdu;
 		}
 	}
 }
@@ -230,7 +325,22 @@ connection::writepdu()
 		int sz = htonl(wpdu_.sz);
 		bcopy(&sz,wpdu_.buf,sizeof(sz));
 	}
-	int n = write(fd_, wpdu_.buf + wpdu_.solong, (wpdu_.sz-wpdu_.solong));
+
+	// skip what has been written already
+	struct iovec v[WRITEV_MAX];
+	int nv = 0, skip = wpdu_.solong;
+	for (int i = 0; i < wiovcnt_ && nv < WRITEV_MAX; i++) {
+		int len = wiov_[i].iov_len;
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		v[nv].iov_base = (char *) wiov_[i].iov_base + skip;
+		v[nv].iov_len = len - skip;
+		skip = 0;
+		nv++;
+	}
+	int n = writev(fd_, v, nv);
 	if (n < 0) {
 		if (errno != EAGAIN) {
 			jsl_log(JSL_DBG_1, "connection::writepdu fd_ %d failure errno=%d\n", fd_, errno);
@@ -275,8 +385,7 @@ connection::readpdu()
 
 		rpdu_.sz = sz;
 		VERIFY(rpdu_.buf == NULL);
-		rpdu_.buf = (char *)malloc(sz+sizeof(sz));
-		VERIFY(rpdu_.buf);
+		rpdu_.buf = rpc_buf_alloc(sz+sizeof(sz));
 		bcopy(&sz1,rpdu_.buf,sizeof(sz));
 		rpdu_.solong = sizeof(sz);
 	}
@@ -285,8 +394,7 @@ connection::readpdu()
 	if (n <= 0) {
 		if (errno == EAGAIN)
 			return true;
-		if (rpdu_.buf)
-			free(rpdu_.buf);
+		rpc_buf_unref(rpdu_.buf);
 		rpdu_.buf = NULL;
 		rpdu_.sz = rpdu_.solong = 0;
 		return (errno == EAGAIN);
@@ -371,12 +479,14 @@ tcpsconn::process_accept()
 
         // garbage collect all dead connections with refcount of 1
         std::map<int, connection *>::iterator i;
-        for (i = conns_.begin(); i != conns_.end(); i++) {
+        for (i = conns_.begin(); i != conns_.end(); ) {
                 if (i->second->isdead() && i->second->ref() == 1) {
 			jsl_log(JSL_DBG_2, "accept_loop garbage collected fd=%d\n",
 					i->second->channo());
                         i->second->decref();
-                        conns_.erase(i);
+                        conns_.erase(i++);
+                } else {
+                        i++;
                 }
         }
 
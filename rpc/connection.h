@@ -3,6 +3,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
@@ -14,7 +15,12 @@ class connection;
 
 class chanmgr {
 	public:
+		// b is an rpc_buf (see arena.h); returning true hands it over
 		virtual bool got_pdu(connection *c, char *b, int sz) = 0;
+		// c has failed and will carry nothing more. on the poll
+		// thread, or on the thread whose send found it dead, with c
+		// locked; it must not block.
+		virtual void dead(connection *c) {}
 		virtual ~chanmgr() {}
 };
 
@@ -36,6 +42,14 @@ class connection : public aio_callback {
 		void closeconn();
 
 		bool send(char *b, int sz);
+		// send the pdu gathered from iov[0..n), which must start with
+		// the rpc header. like send(), returns once it is all written.
+		bool sendv(const struct iovec *iov, int n);
+		// send b without waiting on the poll thread, as code running
+		// on it must. false, having sent nothing, if another send is
+		// under way; what the socket does not take at once is written
+		// by write_cb(), which holds a reference to b until then.
+		bool try_send(char *b, int sz);
 		void write_cb(int s);
 		void read_cb(int s);
 
@@ -48,12 +62,17 @@ class connection : public aio_callback {
 
 		bool readpdu();
 		bool writepdu();
+		void end_write();
 
 		chanmgr *mgr_;
 		const int fd_;
 		bool dead_;
 
 		charbuf wpdu_;
+		const struct iovec *wiov_; // the pending pdu, wpdu_.sz bytes in all
+		int wiovcnt_;
+		struct iovec wone_;   // try_send()'s pdu
+		bool wowned_;         // wpdu_ is try_send()'s, left to write_cb()
 		charbuf rpdu_;
                 
                 struct timeval create_time_;
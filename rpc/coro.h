@@ -0,0 +1,191 @@
+#ifndef coro_h
+#define coro_h
+
+// c++20 coroutine support.
+//
+// rpcc::co_call() returns an rpc_call, an awaitable over call_async1():
+//
+//   rpc_task<int> f(rpcc *cl) {
+//     rpcc::result<int> r = co_await cl->co_call<int>(23, 7);
+//     co_return r.ret < 0 ? r.ret : r.r;
+//   }
+//
+// the awaiting coroutine is suspended while the call is in flight,
+// without holding a thread, and resumed on the rpc executor once the
+// reply arrives (or the call fails), or on a pool of its own choosing
+// with via(). rpc_task is a coroutine type to write such functions
+// with: it starts right away, and can be co_awaited by another
+// coroutine or waited for with get() from a plain thread.
+
+#include <coroutine>
+#include <atomic>
+#include <exception>
+#include <type_traits>
+#include <stdint.h>
+#include "rpc.h"
+#include "thr_pool.h"
+
+struct coro_resumer {
+	void resume(void *h) { std::coroutine_handle<>::from_address(h).resume(); }
+};
+
+inline void
+coro_resume_on(ThrPool *pool, std::coroutine_handle<> h)
+{
+	static coro_resumer r;
+	VERIFY(pool->addObjJob(&r, &coro_resumer::resume, h.address()));
+}
+
+template<class R>
+class rpc_call {
+	public:
+		// sends req, which rpc_call takes over, when awaited
+		rpc_call(rpcc *cl, unsigned int proc, marshall *req, rpcc::TO to)
+			: cl_(cl), proc_(proc), req_(req), to_(to), pool_(NULL) {}
+		rpc_call(rpc_call &&o)
+			: cl_(o.cl_), proc_(o.proc_), req_(o.req_), to_(o.to_),
+			pool_(o.pool_) { o.req_ = NULL; }
+		rpc_call(const rpc_call &) = delete;
+		~rpc_call() { delete req_; }
+
+		// resume the awaiting coroutine on pool, not the rpc executor
+		rpc_call &&via(ThrPool *pool) && { pool_ = pool; return std::move(*this); }
+
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<> h) {
+			marshall *req = req_;
+			req_ = NULL;
+			// the coroutine may be resumed, and this awaitable gone,
+			// before call_async1() returns
+			rpcc::result<R> *res = &res_;
+			ThrPool *pool = pool_;
+			unsigned int proc = proc_;
+			cl_->call_async1(proc, req, [res, h, pool, proc](int ret, unmarshall &u) {
+				res->ret = unpack_reply(proc, ret, u, res->r);
+				if (pool)
+					coro_resume_on(pool, h);
+				else
+					h.resume();
+			}, to_);
+		}
+		rpcc::result<R> await_resume() { return std::move(res_); }
+
+	private:
+		rpcc *cl_;
+		unsigned int proc_;
+		marshall *req_;
+		rpcc::TO to_;
+		ThrPool *pool_;
+		rpcc::result<R> res_;
+};
+
+template<class R, class... A> rpc_call<R>
+rpcc::co_call(unsigned int proc, TO to, const A &... a)
+{
+	marshall *m = new marshall;
+	int unused[] = { 0, ((*m << a), 0)... };
+	(void) unused;
+	return rpc_call<R>(this, proc, m, to);
+}
+
+template<class R, class... A> rpc_call<R>
+rpcc::co_call(unsigned int proc, const A &... a)
+{
+	return co_call<R>(proc, to_max, a...);
+}
+
+// what a coroutine returning rpc_task<T> hands back
+template<class T>
+struct rpc_task_result {
+	T value;
+	void return_value(T v) { value = std::move(v); }
+	T take() { return std::move(value); }
+};
+
+template<>
+struct rpc_task_result<void> {
+	void return_void() {}
+	void take() {}
+};
+
+template<class T = void>
+class rpc_task {
+	public:
+		struct promise_type : public rpc_task_result<T> {
+			// 0 running, 1 finished, 2 abandoned by its rpc_task, or
+			// the coroutine waiting for it
+			std::atomic<uintptr_t> state;
+			pthread_mutex_t m;
+			pthread_cond_t c;
+
+			promise_type() : state(0) {
+				VERIFY(pthread_mutex_init(&m, 0) == 0);
+				VERIFY(pthread_cond_init(&c, 0) == 0);
+			}
+			~promise_type() {
+				VERIFY(pthread_mutex_destroy(&m) == 0);
+				VERIFY(pthread_cond_destroy(&c) == 0);
+			}
+
+			rpc_task get_return_object() {
+				return rpc_task(std::coroutine_handle<promise_type>::from_promise(*this));
+			}
+			std::suspend_never initial_suspend() { return std::suspend_never(); }
+			void unhandled_exception() { std::terminate(); }
+
+			struct final_awaiter {
+				bool await_ready() noexcept { return false; }
+				std::coroutine_handle<> await_suspend(
+						std::coroutine_handle<promise_type> h) noexcept {
+					promise_type &p = h.promise();
+					VERIFY(pthread_mutex_lock(&p.m) == 0);
+					uintptr_t old = p.state.exchange(1);
+					VERIFY(pthread_cond_broadcast(&p.c) == 0);
+					VERIFY(pthread_mutex_unlock(&p.m) == 0);
+					if (old == 2) {
+						h.destroy();
+						return std::noop_coroutine();
+					}
+					if (old)
+						return std::coroutine_handle<>::from_address((void *) old);
+					return std::noop_coroutine();
+				}
+				void await_resume() noexcept {}
+			};
+			final_awaiter final_suspend() noexcept { return final_awaiter(); }
+		};
+
+		rpc_task(rpc_task &&o) : h_(o.h_) { o.h_ = NULL; }
+		rpc_task(const rpc_task &) = delete;
+		// a task dropped before it finishes cleans up after itself
+		~rpc_task() {
+			if (h_ && h_.promise().state.exchange(2) == 1)
+				h_.destroy();
+		}
+
+		bool done() { return h_.promise().state.load() == 1; }
+
+		// wait for the task from a thread that is not a coroutine
+		T get() {
+			promise_type &p = h_.promise();
+			VERIFY(pthread_mutex_lock(&p.m) == 0);
+			while (p.state.load() != 1)
+				VERIFY(pthread_cond_wait(&p.c, &p.m) == 0);
+			VERIFY(pthread_mutex_unlock(&p.m) == 0);
+			return p.take();
+		}
+
+		bool await_ready() { return done(); }
+		bool await_suspend(std::coroutine_handle<> waiter) {
+			uintptr_t running = 0;
+			return h_.promise().state.compare_exchange_strong(running,
+					(uintptr_t) waiter.address());
+		}
+		T await_resume() { return h_.promise().take(); }
+
+	private:
+		explicit rpc_task(std::coroutine_handle<promise_type> h) : h_(h) {}
+		std::coroutine_handle<promise_type> h_;
+};
+
+#endif
@@ -1,30 +1,54 @@
 #ifndef marshall_h
 #define marshall_h
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <vector>
+#include <list>
+#include <deque>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <array>
+#include <tuple>
+#include <utility>
+#include <type_traits>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include "lang/verify.h"
 #include "lang/algorithm.h"
+#include "arena.h"
 
 struct req_header {
-	req_header(int x=0, int p=0, int c = 0, int s = 0, int xi = 0):
-		xid(x), proc(p), clt_nonce(c), srv_nonce(s), xid_rep(xi) {}
+	req_header(int x=0, int p=0, int c = 0, int s = 0, int xi = 0,
+			int d = 0):
+		xid(x), proc(p), clt_nonce(c), srv_nonce(s), xid_rep(xi),
+		deadline(d) {}
 	int xid;
 	int proc;
 	unsigned int clt_nonce;
 	unsigned int srv_nonce;
 	int xid_rep;
+	// ms the caller will still wait for the reply when this copy of
+	// the request goes out, 0 for no limit. relative, because the two
+	// ends' clocks need not agree.
+	int deadline;
 };
 
 struct reply_header {
-	reply_header(int x=0, int r=0): xid(x), ret(r) {}
+	reply_header(int x=0, int r=0, unsigned int c=0, unsigned int s=0):
+		xid(x), ret(r), clt_nonce(c), srv_nonce(s) {}
 	int xid;
 	int ret;
+	// of the request, which picks the rpcc on a shared connection
+	unsigned int clt_nonce;
+	// of the server instance that replied, which binds a client
+	// without a bind call of its own
+	unsigned int srv_nonce;
 };
 
 typedef uint64_t rpc_checksum_t;
@@ -33,6 +57,8 @@ typedef int rpc_sz_t;
 enum {
 	//size of initial buffer allocation 
 	DEFAULT_RPC_SZ = 1024,
+	//refbytes() copies anything shorter than this
+	MIN_REF_SZ = 4096,
 #if RPC_CHECKSUMMING
 	//size of rpc_header includes a 4-byte int to be filled by tcpchan and uint64_t checksum
 	RPC_HEADER_SZ = static_max<sizeof(req_header), sizeof(reply_header)>::value + sizeof(rpc_sz_t) + sizeof(rpc_checksum_t)
@@ -43,31 +69,65 @@ enum {
 
 class marshall {
 	private:
+		// n bytes of caller memory at p, sent after _buf[0, off)
+		struct bufref {
+			bufref(int o, const char *b, int l): off(o), p(b), n(l) {}
+			int off;
+			const char *p;
+			int n;
+		};
+
 		char *_buf;     // Base of the raw bytes buffer (dynamically readjusted)
 		int _capa;      // Capacity of the buffer
 		int _ind;       // Read/write head position
+		std::vector<bufref> _refs;
+		int _refsz;     // total bytes in _refs
+		std::vector<struct iovec> _iov;
 
 	public:
 		marshall() {
-			_buf = (char *) malloc(sizeof(char)*DEFAULT_RPC_SZ);
-			VERIFY(_buf);
+			_buf = rpc_buf_alloc(DEFAULT_RPC_SZ);
 			_capa = DEFAULT_RPC_SZ;
 			_ind = RPC_HEADER_SZ;
+			_refsz = 0;
 		}
 
 		~marshall() { 
-			if (_buf) 
-				free(_buf); 
+			rpc_buf_unref(_buf);
 		}
 
-		int size() { return _ind;}
-		char *cstr() { return _buf;}
+		// size of the pdu, including referenced bytes
+		int size() { return _ind + _refsz;}
+		char *cstr() { flatten(); return _buf;}
 
 		void rawbyte(unsigned char);
 		void rawbytes(const char *, int);
+		// like rawbytes(), but a run of at least MIN_REF_SZ bytes is
+		// referenced rather than copied: p must stay valid until the
+		// marshall has been sent or flattened.
+		void refbytes(const char *p, int n);
+		// copy the referenced bytes in, leaving one contiguous buffer
+		void flatten();
+		// the pdu as a gather list for writev(): runs of the buffer
+		// interleaved with referenced memory. the first entry starts at
+		// the buffer. valid until the marshall is next changed.
+		const std::vector<struct iovec> &iov();
+		int nrefs() { return _refs.size(); }
+		// make room for n more bytes so that a run of small
+		// writes does not have to grow the buffer piecemeal
+		void reserve(int n);
+		// append n bytes and return where they start, for encoders
+		// that fill a fixed layout with marshall_put()
+		char *extend(int n) {
+			reserve(n);
+			char *p = _buf + _ind;
+			_ind += n;
+			return p;
+		}
 
 		// Return the current content (excluding header) as a string
 		std::string get_content() { 
+			flatten();
 			return std::string(_buf+RPC_HEADER_SZ,_ind-RPC_HEADER_SZ);
 		}
 
@@ -90,6 +150,30 @@ class marshall {
 			pack((int)h.clt_nonce);
 			pack((int)h.srv_nonce);
 			pack(h.xid_rep);
+			pack(h.deadline);
+			_ind = saved_sz;
+		}
+
+		// rewrite just the deadline of a packed request header, before
+		// a retransmission
+		void pack_req_deadline(int ms) {
+			int saved_sz = _ind;
+			_ind = sizeof(rpc_sz_t) + 5 * sizeof(int);
+#if RPC_CHECKSUMMING
+			_ind += sizeof(rpc_checksum_t);
+#endif
+			pack(ms);
+			_ind = saved_sz;
+		}
+
+		// likewise the server nonce, once the client has learnt it
+		void pack_req_srv_nonce(unsigned int n) {
+			int saved_sz = _ind;
+			_ind = sizeof(rpc_sz_t) + 3 * sizeof(int);
+#if RPC_CHECKSUMMING
+			_ind += sizeof(rpc_checksum_t);
+#endif
+			pack((int)n);
 			_ind = saved_sz;
 		}
 
@@ -102,10 +186,14 @@ class marshall {
 #endif
 			pack(h.xid);
 			pack(h.ret);
+			pack((int)h.clt_nonce);
+			pack((int)h.srv_nonce);
 			_ind = saved_sz;
 		}
 
+		// hand over the buffer, an rpc_buf released with rpc_buf_unref()
 		void take_buf(char **b, int *s) {
+			flatten();
 			*b = _buf;
 			*s = _ind;
 			_buf = NULL;
@@ -123,6 +211,19 @@ marshall& operator<<(marshall &, short);
 marshall& operator<<(marshall &, unsigned long long);
 marshall& operator<<(marshall &, const std::string &);
 
+// bytes that marshall exactly like a std::string, so the receiver
+// unmarshalls a string, but which are sent straight from the caller's
+// memory when large instead of being copied into the request. the
+// memory must outlive the send; rpcc::call() is done with it once it
+// returns. the async calls copy it in.
+struct rpc_blob {
+	rpc_blob(const char *b, int l): p(b), n(l) {}
+	rpc_blob(const std::string &s): p(s.data()), n(s.size()) {}
+	const char *p;
+	int n;
+};
+marshall& operator<<(marshall &, const rpc_blob &);
+
 class unmarshall {
 	private:
 		char *_buf;
@@ -138,17 +239,19 @@ class unmarshall {
 			take_content(s);
 		}
 		~unmarshall() {
-			if (_buf) free(_buf);
+			rpc_buf_unref(_buf);
 		}
 
 		//take contents from another unmarshall object
 		void take_in(unmarshall &another);
+		// read the reply pdu b from the start, sharing it with whoever
+		// else holds a reference
+		void share(char *b, int sz);
 
 		//take the content which does not exclude a RPC header from a string
 		void take_content(const std::string &s) {
 			_sz = s.size()+RPC_HEADER_SZ;
-			_buf = (char *)realloc(_buf,_sz);
-			VERIFY(_buf);
+			_buf = rpc_buf_realloc(_buf,_sz);
 			_ind = RPC_HEADER_SZ;
 			memcpy(_buf+_ind, s.data(), s.size());
 			_ok = true;
@@ -159,9 +262,21 @@ class unmarshall {
 		bool okdone();
 		unsigned int rawbyte();
 		void rawbytes(std::string &s, unsigned int n);
+		void rawbytes(char *p, unsigned int n);
 
 		int ind() { return _ind;}
 		int size() { return _sz;}
+		unsigned int remaining() { return _ind < _sz ? _sz - _ind : 0; }
+		// consume n bytes of a fixed layout; NULL if the packet is short
+		const char *fetch(unsigned int n) {
+			if (n > remaining()) {
+				_ok = false;
+				return NULL;
+			}
+			const char *p = _buf + _ind;
+			_ind += n;
+			return p;
+		}
 		void unpack(int *); //non-const ref
 		void take_buf(char **b, int *sz) {
 			*b = _buf;
@@ -181,9 +296,18 @@ class unmarshall {
 			unpack((int *)&h->clt_nonce);
 			unpack((int *)&h->srv_nonce);
 			unpack(&h->xid_rep);
+			unpack(&h->deadline);
 			_ind = RPC_HEADER_SZ;
 		}
 
+		// the header of the request pdu b, which stays the caller's
+		static bool peek_req_header(char *b, int sz, req_header *h) {
+			unmarshall u(b, sz);
+			u.unpack_req_header(h);
+			u._buf = NULL;
+			return u.ok();
+		}
+
 		void unpack_reply_header(reply_header *h) {
 			//the first 4-byte is for channel to fill size of pdu
 			_ind = sizeof(rpc_sz_t); 
@@ -192,8 +316,17 @@ class unmarshall {
 #endif
 			unpack(&h->xid);
 			unpack(&h->ret);
+			unpack((int *)&h->clt_nonce);
+			unpack((int *)&h->srv_nonce);
 			_ind = RPC_HEADER_SZ;
 		}
+
+		static bool peek_reply_header(char *b, int sz, reply_header *h) {
+			unmarshall u(b, sz);
+			u.unpack_reply_header(h);
+			u._buf = NULL;
+			return u.ok();
+		}
 };
 
 unmarshall& operator>>(unmarshall &, bool &);
@@ -206,54 +339,416 @@ unmarshall& operator>>(unmarshall &, int &);
 unmarshall& operator>>(unmarshall &, unsigned long long &);
 unmarshall& operator>>(unmarshall &, std::string &);
 
+// fixed-layout access to the big-endian wire format, used by the
+// encoders rpcgen generates. the caller has already checked the bounds.
+inline void marshall_put(char *p, unsigned char x) { p[0] = x; }
+inline void marshall_put(char *p, char x) { p[0] = x; }
+inline void marshall_put(char *p, bool x) { p[0] = x; }
+inline void
+marshall_put(char *p, unsigned short x)
+{
+	p[0] = (x >> 8) & 0xff;
+	p[1] = x & 0xff;
+}
+inline void marshall_put(char *p, short x) { marshall_put(p, (unsigned short) x); }
+inline void
+marshall_put(char *p, unsigned int x)
+{
+	p[0] = (x >> 24) & 0xff;
+	p[1] = (x >> 16) & 0xff;
+	p[2] = (x >> 8) & 0xff;
+	p[3] = x & 0xff;
+}
+inline void marshall_put(char *p, int x) { marshall_put(p, (unsigned int) x); }
+inline void
+marshall_put(char *p, unsigned long long x)
+{
+	marshall_put(p, (unsigned int) (x >> 32));
+	marshall_put(p + 4, (unsigned int) x);
+}
+
+inline void marshall_get(const char *p, unsigned char *x) { *x = p[0]; }
+inline void marshall_get(const char *p, char *x) { *x = p[0]; }
+inline void marshall_get(const char *p, bool *x) { *x = p[0]; }
+inline void
+marshall_get(const char *p, unsigned short *x)
+{
+	*x = ((p[0] & 0xff) << 8) | (p[1] & 0xff);
+}
+inline void marshall_get(const char *p, short *x) { marshall_get(p, (unsigned short *) x); }
+inline void
+marshall_get(const char *p, unsigned int *x)
+{
+	*x = ((unsigned int) (p[0] & 0xff) << 24) | ((p[1] & 0xff) << 16) |
+		((p[2] & 0xff) << 8) | (p[3] & 0xff);
+}
+inline void marshall_get(const char *p, int *x) { marshall_get(p, (unsigned int *) x); }
+inline void
+marshall_get(const char *p, unsigned long long *x)
+{
+	unsigned int h, l;
+	marshall_get(p, &h);
+	marshall_get(p + 4, &l);
+	*x = l | ((unsigned long long) h << 32);
+}
+
+// wire width of the types that have a fixed-size encoding, 0 otherwise.
+// containers of fixed-size elements reserve their whole encoding up front.
+template <class T, class Enable = void>
+struct marshall_fixed_size { static const int value = 0; };
+template <> struct marshall_fixed_size<bool> { static const int value = 1; };
+template <> struct marshall_fixed_size<char> { static const int value = 1; };
+template <> struct marshall_fixed_size<unsigned char> { static const int value = 1; };
+template <> struct marshall_fixed_size<short> { static const int value = 2; };
+template <> struct marshall_fixed_size<unsigned short> { static const int value = 2; };
+template <> struct marshall_fixed_size<int> { static const int value = 4; };
+template <> struct marshall_fixed_size<unsigned int> { static const int value = 4; };
+template <> struct marshall_fixed_size<unsigned long long> { static const int value = 8; };
+template <class E>
+struct marshall_fixed_size<E, typename std::enable_if<std::is_enum<E>::value>::type> {
+	static const int value = sizeof(E);
+};
+
+// element types whose encoding is the raw byte itself. the wire format
+// is big-endian, so only single-byte types can be copied in bulk.
+template <class T>
+struct marshall_bytewise {
+	static const bool value = std::is_same<T, char>::value ||
+		std::is_same<T, unsigned char>::value;
+};
+
+// enums travel as the unsigned integer of the same width
+template <int N> struct marshall_uint;
+template <> struct marshall_uint<1> { typedef unsigned char type; };
+template <> struct marshall_uint<2> { typedef unsigned short type; };
+template <> struct marshall_uint<4> { typedef unsigned int type; };
+template <> struct marshall_uint<8> { typedef unsigned long long type; };
+
+template <class E> typename std::enable_if<std::is_enum<E>::value, marshall &>::type
+operator<<(marshall &m, E e)
+{
+	return m << (typename marshall_uint<sizeof(E)>::type) e;
+}
+
+template <class E> typename std::enable_if<std::is_enum<E>::value, unmarshall &>::type
+operator>>(unmarshall &u, E &e)
+{
+	typename marshall_uint<sizeof(E)>::type x;
+	u >> x;
+	e = (E) x;
+	return u;
+}
+
+// element count of a container. a count larger than the bytes left in
+// the buffer is a corrupt packet, so the result is also a safe bound for
+// reserve().
+inline unsigned int
+unmarshall_count(unmarshall &u)
+{
+	unsigned int n = 0;
+	u >> n;
+	return u.ok() ? n : 0;
+}
+
 template <class C> marshall &
-operator<<(marshall &m, std::vector<C> v)
+marshall_seq(marshall &m, const C &c)
 {
-	m << (unsigned int) v.size();
-	for(unsigned i = 0; i < v.size(); i++)
-		m << v[i];
+	typedef typename C::value_type T;
+	m << (unsigned int) c.size();
+	if (marshall_fixed_size<T>::value)
+		m.reserve(c.size() * marshall_fixed_size<T>::value);
+	for (typename C::const_iterator i = c.begin(); i != c.end(); i++)
+		m << *i;
 	return m;
 }
 
+// sequences keep their order; sets and maps rely on the receiver's
+// ordering and are rebuilt by insertion.
 template <class C> unmarshall &
+unmarshall_seq(unmarshall &u, C &c)
+{
+	unsigned int n = unmarshall_count(u);
+	c.clear();
+	for (unsigned int i = 0; i < n && u.ok(); i++) {
+		typename C::value_type z;
+		u >> z;
+		c.insert(c.end(), z);
+	}
+	return u;
+}
+
+template <class C> unmarshall &
+unmarshall_map(unmarshall &u, C &d)
+{
+	unsigned int n = unmarshall_count(u);
+	d.clear();
+	for (unsigned int i = 0; i < n && u.ok(); i++) {
+		typename C::key_type a;
+		typename C::mapped_type b;
+		u >> a >> b;
+		d.insert(d.end(), typename C::value_type(a, b));
+	}
+	return u;
+}
+
+template <class C> typename std::enable_if<marshall_bytewise<C>::value, marshall &>::type
+operator<<(marshall &m, const std::vector<C> &v)
+{
+	m << (unsigned int) v.size();
+	m.rawbytes((const char *) v.data(), v.size());
+	return m;
+}
+
+template <class C> typename std::enable_if<!marshall_bytewise<C>::value, marshall &>::type
+operator<<(marshall &m, const std::vector<C> &v)
+{
+	return marshall_seq(m, v);
+}
+
+template <class C> typename std::enable_if<marshall_bytewise<C>::value, unmarshall &>::type
 operator>>(unmarshall &u, std::vector<C> &v)
 {
-	unsigned n;
-	u >> n;
-	for(unsigned i = 0; i < n; i++){
+	unsigned int n = unmarshall_count(u);
+	if (n > u.remaining()) {
+		// let rawbytes() flag the short packet
+		u.rawbytes(NULL, n);
+		return u;
+	}
+	v.resize(n);
+	u.rawbytes((char *) v.data(), n);
+	return u;
+}
+
+template <class C> typename std::enable_if<!marshall_bytewise<C>::value, unmarshall &>::type
+operator>>(unmarshall &u, std::vector<C> &v)
+{
+	unsigned int n = unmarshall_count(u);
+	v.clear();
+	v.reserve(std::min(n, u.remaining()));
+	for (unsigned int i = 0; i < n && u.ok(); i++) {
+		v.push_back(C());
+		u >> v.back();
+	}
+	return u;
+}
+
+template <class C> marshall &
+operator<<(marshall &m, const std::list<C> &l)
+{
+	return marshall_seq(m, l);
+}
+
+template <class C> unmarshall &
+operator>>(unmarshall &u, std::list<C> &l)
+{
+	return unmarshall_seq(u, l);
+}
+
+template <class C> marshall &
+operator<<(marshall &m, const std::deque<C> &d)
+{
+	return marshall_seq(m, d);
+}
+
+template <class C> unmarshall &
+operator>>(unmarshall &u, std::deque<C> &d)
+{
+	return unmarshall_seq(u, d);
+}
+
+template <class C> marshall &
+operator<<(marshall &m, const std::set<C> &s)
+{
+	return marshall_seq(m, s);
+}
+
+template <class C> unmarshall &
+operator>>(unmarshall &u, std::set<C> &s)
+{
+	return unmarshall_seq(u, s);
+}
+
+template <class C> marshall &
+operator<<(marshall &m, const std::multiset<C> &s)
+{
+	return marshall_seq(m, s);
+}
+
+template <class C> unmarshall &
+operator>>(unmarshall &u, std::multiset<C> &s)
+{
+	return unmarshall_seq(u, s);
+}
+
+template <class C> marshall &
+operator<<(marshall &m, const std::unordered_set<C> &s)
+{
+	return marshall_seq(m, s);
+}
+
+template <class C> unmarshall &
+operator>>(unmarshall &u, std::unordered_set<C> &s)
+{
+	unsigned int n = unmarshall_count(u);
+	s.clear();
+	s.reserve(std::min(n, u.remaining()));
+	for (unsigned int i = 0; i < n && u.ok(); i++) {
 		C z;
 		u >> z;
-		v.push_back(z);
+		s.insert(z);
 	}
 	return u;
 }
 
 template <class A, class B> marshall &
-operator<<(marshall &m, const std::map<A,B> &d) {
-	typename std::map<A,B>::const_iterator i;
+operator<<(marshall &m, const std::pair<A,B> &p)
+{
+	return m << p.first << p.second;
+}
 
-	m << (unsigned int) d.size();
+template <class A, class B> unmarshall &
+operator>>(unmarshall &u, std::pair<A,B> &p)
+{
+	return u >> p.first >> p.second;
+}
 
-	for (i = d.begin(); i != d.end(); i++) {
-		m << i->first << i->second;
-	}
-	return m;
+template <class A, class B> marshall &
+operator<<(marshall &m, const std::map<A,B> &d)
+{
+	return marshall_seq(m, d);
 }
 
 template <class A, class B> unmarshall &
-operator>>(unmarshall &u, std::map<A,B> &d) {
-	unsigned int n;
-	u >> n;
+operator>>(unmarshall &u, std::map<A,B> &d)
+{
+	return unmarshall_map(u, d);
+}
 
-	d.clear();
+template <class A, class B> marshall &
+operator<<(marshall &m, const std::multimap<A,B> &d)
+{
+	return marshall_seq(m, d);
+}
 
-	for (unsigned int lcv = 0; lcv < n; lcv++) {
+template <class A, class B> unmarshall &
+operator>>(unmarshall &u, std::multimap<A,B> &d)
+{
+	return unmarshall_map(u, d);
+}
+
+template <class A, class B> marshall &
+operator<<(marshall &m, const std::unordered_map<A,B> &d)
+{
+	return marshall_seq(m, d);
+}
+
+template <class A, class B> unmarshall &
+operator>>(unmarshall &u, std::unordered_map<A,B> &d)
+{
+	unsigned int n = unmarshall_count(u);
+	d.clear();
+	d.reserve(std::min(n, u.remaining()));
+	for (unsigned int i = 0; i < n && u.ok(); i++) {
 		A a;
 		B b;
 		u >> a >> b;
-		d[a] = b;
+		d.insert(std::make_pair(a, b));
 	}
 	return u;
 }
 
+// std::array has no length on the wire, both ends know it
+template <class C, size_t N> typename std::enable_if<marshall_bytewise<C>::value, marshall &>::type
+operator<<(marshall &m, const std::array<C,N> &a)
+{
+	m.rawbytes((const char *) a.data(), N);
+	return m;
+}
+
+template <class C, size_t N> typename std::enable_if<!marshall_bytewise<C>::value, marshall &>::type
+operator<<(marshall &m, const std::array<C,N> &a)
+{
+	if (marshall_fixed_size<C>::value)
+		m.reserve(N * marshall_fixed_size<C>::value);
+	for (size_t i = 0; i < N; i++)
+		m << a[i];
+	return m;
+}
+
+template <class C, size_t N> typename std::enable_if<marshall_bytewise<C>::value, unmarshall &>::type
+operator>>(unmarshall &u, std::array<C,N> &a)
+{
+	u.rawbytes((char *) a.data(), N);
+	return u;
+}
+
+template <class C, size_t N> typename std::enable_if<!marshall_bytewise<C>::value, unmarshall &>::type
+operator>>(unmarshall &u, std::array<C,N> &a)
+{
+	for (size_t i = 0; i < N; i++)
+		u >> a[i];
+	return u;
+}
+
+// tuples are encoded element by element with no length prefix
+template <size_t I, size_t N>
+struct marshall_tuple {
+	template <class T> static void put(marshall &m, const T &t) {
+		m << std::get<I>(t);
+		marshall_tuple<I+1, N>::put(m, t);
+	}
+	template <class T> static void get(unmarshall &u, T &t) {
+		u >> std::get<I>(t);
+		marshall_tuple<I+1, N>::get(u, t);
+	}
+};
+
+template <size_t N>
+struct marshall_tuple<N, N> {
+	template <class T> static void put(marshall &, const T &) {}
+	template <class T> static void get(unmarshall &, T &) {}
+};
+
+template <class... T> marshall &
+operator<<(marshall &m, const std::tuple<T...> &t)
+{
+	marshall_tuple<0, sizeof...(T)>::put(m, t);
+	return m;
+}
+
+template <class... T> unmarshall &
+operator>>(unmarshall &u, std::tuple<T...> &t)
+{
+	marshall_tuple<0, sizeof...(T)>::get(u, t);
+	return u;
+}
+
+// MARSHALL_FIELDS(a, b, ...) at the end of a struct definition makes the
+// struct marshallable: the listed members are sent in the listed order.
+//
+//   struct extent_attr {
+//     unsigned int size, mtime;
+//     std::string name;
+//     MARSHALL_FIELDS(size, mtime, name)
+//   };
+#define MARSHALL_FIELDS(...) \
+	auto marshall_tie() -> decltype(std::tie(__VA_ARGS__)) \
+		{ return std::tie(__VA_ARGS__); } \
+	auto marshall_tie() const -> decltype(std::tie(__VA_ARGS__)) \
+		{ return std::tie(__VA_ARGS__); }
+
+template <class S> auto
+operator<<(marshall &m, const S &s) -> decltype((void) s.marshall_tie(), m)
+{
+	return m << s.marshall_tie();
+}
+
+template <class S> auto
+operator>>(unmarshall &u, S &s) -> decltype((void) s.marshall_tie(), u)
+{
+	auto t = s.marshall_tie();
+	marshall_tuple<0, std::tuple_size<decltype(t)>::value>::get(u, t);
+	return u;
+}
+
 #endif
@@ -0,0 +1,45 @@
+#ifndef park_h
+#define park_h
+
+// parking threads on an atomic word, with linux futexes.
+//
+// a futex needs no setup or teardown, so any std::atomic<int> can be
+// waited on; the kernel only hears about it while a thread is parked.
+// unlike std::atomic::wait(), park() takes a deadline.
+
+#include <atomic>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "lang/verify.h"
+
+static_assert(sizeof(std::atomic<int>) == sizeof(int),
+		"futexes need a plain int");
+
+// sleep while *w is val, until unpark() or the CLOCK_MONOTONIC deadline
+// (NULL for none). may return early; false only once the deadline has
+// passed.
+inline bool
+park(std::atomic<int> *w, int val, const struct timespec *deadline)
+{
+	int r = syscall(SYS_futex, (int *) w,
+			FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG,
+			val, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+	if (r == 0)
+		return true;
+	VERIFY(errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT);
+	return errno != ETIMEDOUT;
+}
+
+// wake everyone parked on w
+inline void
+unpark(std::atomic<int> *w)
+{
+	syscall(SYS_futex, (int *) w, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX,
+			NULL, NULL, 0);
+}
+
+#endif
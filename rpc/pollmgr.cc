@@ -1,4 +1,5 @@
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -25,7 +26,7 @@ PollMgr::Instance()
 	return instance;
 }
 
-PollMgr::PollMgr() : pending_change_(false)
+PollMgr::PollMgr() : pending_change_(false), next_timer_(1), running_timer_(0)
 {
 	bzero(callbacks_, MAX_POLL_FDS*sizeof(void *));
 	aio_ = new SelectAIO();
@@ -33,6 +34,7 @@ PollMgr::PollMgr() : pending_change_(false)
 
 	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
 	VERIFY(pthread_cond_init(&changedone_c_, NULL) == 0);
+	VERIFY(pthread_cond_init(&timer_done_c_, NULL) == 0);
 	VERIFY((th_ = method_thread(this, false, &PollMgr::wait_loop)) != 0);
 }
 
@@ -86,9 +88,82 @@ PollMgr::has_callback(int fd, poll_flag flag, aio_callback *c)
 	return aio_->is_watched(fd, flag);
 }
 
+static long long
+monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+unsigned long
+PollMgr::add_timer(int ms, std::function<void()> fn)
+{
+	ScopedLock ml(&m_);
+	unsigned long id = next_timer_++;
+	long long when = monotonic_ns() + ms * 1000000LL;
+	bool first = timers_.empty() || when < timers_.begin()->first.first;
+	timers_[timer_key(when, id)] = fn;
+	timer_when_[id] = when;
+	if (first)
+		aio_->wakeup();
+	return id;
+}
+
+void
+PollMgr::del_timer(unsigned long id)
+{
+	ScopedLock ml(&m_);
+	std::map<unsigned long, long long>::iterator i = timer_when_.find(id);
+	if (i != timer_when_.end()) {
+		timers_.erase(timer_key(i->second, id));
+		timer_when_.erase(i);
+		return;
+	}
+	if (pthread_equal(pthread_self(), th_))
+		return;
+	while (running_timer_ == id)
+		VERIFY(pthread_cond_wait(&timer_done_c_, &m_) == 0);
+}
+
+int
+PollMgr::run_timers()
+{
+	ScopedLock ml(&m_);
+	while (!timers_.empty()) {
+		long long now = monotonic_ns();
+		std::map<timer_key, std::function<void()> >::iterator i = timers_.begin();
+		if (i->first.first > now)
+			return (i->first.first - now + 999999) / 1000000;
+		unsigned long id = i->first.second;
+		std::function<void()> fn;
+		fn.swap(i->second);
+		timers_.erase(i);
+		timer_when_.erase(id);
+
+		running_timer_ = id;
+		VERIFY(pthread_mutex_unlock(&m_) == 0);
+		fn();
+		VERIFY(pthread_mutex_lock(&m_) == 0);
+		running_timer_ = 0;
+		VERIFY(pthread_cond_broadcast(&timer_done_c_) == 0);
+	}
+	return -1;
+}
+
+// set on the thread running wait_loop()
+static thread_local bool in_wait_loop;
+
+bool
+PollMgr::on_poll_thread()
+{
+	return in_wait_loop;
+}
+
 void
 PollMgr::wait_loop()
 {
+	in_wait_loop = true;
 
 	std::vector<int> readable;
 	std::vector<int> writable;
@@ -101,9 +176,10 @@ PollMgr::wait_loop()
 				VERIFY(pthread_cond_broadcast(&changedone_c_)==0);
 			}
 		}
+		int timeout = run_timers();
 		readable.clear();
 		writable.clear();
-		aio_->wait_ready(&readable,&writable);
+		aio_->wait_ready(&readable,&writable,timeout);
 
 		if (!readable.size() && !writable.size()) {
 			continue;
@@ -215,10 +291,25 @@ SelectAIO::unwatch_fd(int fd, poll_flag flag)
 }
 
 void
-SelectAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
+SelectAIO::wakeup()
+{
+	char tmp = 1;
+	VERIFY(write(pipefd_[1], &tmp, sizeof(tmp))==1);
+}
+
+void
+SelectAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+		int timeout)
 {
 	fd_set trfds, twfds;
 	int high;
+	struct timeval tv, *tvp = NULL;
+
+	if (timeout >= 0) {
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		tvp = &tv;
+	}
 
 	{
 		ScopedLock ml(&m_);
@@ -228,7 +319,7 @@ SelectAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
 
 	}
 
-	int ret = select(high+1, &trfds, &twfds, NULL, NULL);
+	int ret = select(high+1, &trfds, &twfds, NULL, tvp);
 
 	if (ret < 0) {
 		if (errno == EINTR) {
@@ -263,11 +354,29 @@ EPollAIO::EPollAIO()
 	pollfd_ = epoll_create(MAX_POLL_FDS);
 	VERIFY(pollfd_ >= 0);
 	bzero(fdstatus_, sizeof(int)*MAX_POLL_FDS);
+
+	VERIFY(pipe(pipefd_) == 0);
+	int flags = fcntl(pipefd_[0], F_GETFL, NULL);
+	flags |= O_NONBLOCK;
+	fcntl(pipefd_[0], F_SETFL, flags);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = pipefd_[0];
+	VERIFY(epoll_ctl(pollfd_, EPOLL_CTL_ADD, pipefd_[0], &ev) == 0);
 }
 
 EPollAIO::~EPollAIO()
 {
 	close(pollfd_);
+	close(pipefd_[0]);
+	close(pipefd_[1]);
+}
+
+void
+EPollAIO::wakeup()
+{
+	char tmp = 1;
+	VERIFY(write(pipefd_[1], &tmp, sizeof(tmp))==1);
 }
 
 static inline
@@ -344,10 +453,17 @@ EPollAIO::is_watched(int fd, poll_flag flag)
 }
 
 void
-EPollAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
+EPollAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+		int timeout)
 {
-	int nfds = epoll_wait(pollfd_, ready_,	MAX_POLL_FDS, -1);
+	int nfds = epoll_wait(pollfd_, ready_,	MAX_POLL_FDS, timeout);
 	for (int i = 0; i < nfds; i++) {
+		if (ready_[i].data.fd == pipefd_[0]) {
+			char tmp[64];
+			while (read(pipefd_[0], tmp, sizeof(tmp)) > 0)
+				;
+			continue;
+		}
 		if (ready_[i].events & EPOLLIN) {
 			readable->push_back(ready_[i].data.fd);
 		}
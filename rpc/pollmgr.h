@@ -3,6 +3,8 @@
 
 #include <sys/select.h>
 #include <vector>
+#include <map>
+#include <functional>
 
 #ifdef __linux__
 #include <sys/epoll.h>
@@ -23,7 +25,11 @@ class aio_mgr {
 		virtual void watch_fd(int fd, poll_flag flag) = 0;
 		virtual bool unwatch_fd(int fd, poll_flag flag) = 0;
 		virtual bool is_watched(int fd, poll_flag flag) = 0;
-		virtual void wait_ready(std::vector<int> *readable, std::vector<int> *writable) = 0;
+		// wait at most timeout ms, forever if it is negative
+		virtual void wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+				int timeout) = 0;
+		// make a wait_ready() in progress return
+		virtual void wakeup() = 0;
 		virtual ~aio_mgr() {}
 };
 
@@ -48,6 +54,16 @@ class PollMgr {
 		void block_remove_fd(int fd);
 		void wait_loop();
 
+		// run fn on the poll thread once ms milliseconds have passed.
+		// fn must not block. returns a timer id, never 0.
+		unsigned long add_timer(int ms, std::function<void()> fn);
+		// cancel a timer. once this returns fn is not running and will
+		// not run, unless del_timer() is called from fn itself.
+		void del_timer(unsigned long id);
+		// whether the caller is the poll thread, in a callback or a
+		// timer, which must not wait on a socket
+		static bool on_poll_thread();
+
 
 		static PollMgr *instance;
 		static int useful;
@@ -62,6 +78,17 @@ class PollMgr {
 		aio_mgr *aio_;
 		bool pending_change_;
 
+		// pending timers by (deadline in CLOCK_MONOTONIC ns, id)
+		typedef std::pair<long long, unsigned long> timer_key;
+		std::map<timer_key, std::function<void()> > timers_;
+		std::map<unsigned long, long long> timer_when_;
+		unsigned long next_timer_;
+		unsigned long running_timer_;
+		pthread_cond_t timer_done_c_;
+
+		// run the timers that are due; returns ms until the next one, or -1
+		int run_timers();
+
 };
 
 class SelectAIO : public aio_mgr {
@@ -72,7 +99,9 @@ class SelectAIO : public aio_mgr {
 		void watch_fd(int fd, poll_flag flag);
 		bool unwatch_fd(int fd, poll_flag flag);
 		bool is_watched(int fd, poll_flag flag);
-		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
+		void wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+				int timeout);
+		void wakeup();
 
 	private:
 
@@ -93,10 +122,13 @@ class EPollAIO : public aio_mgr {
 		void watch_fd(int fd, poll_flag flag);
 		bool unwatch_fd(int fd, poll_flag flag);
 		bool is_watched(int fd, poll_flag flag);
-		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
+		void wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+				int timeout);
+		void wakeup();
 
 	private:
 		int pollfd_;
+		int pipefd_[2];
 		struct epoll_event ready_[MAX_POLL_FDS];
 		int fdstatus_[MAX_POLL_FDS];
 
@@ -0,0 +1,87 @@
+#ifndef proctab_h
+#define proctab_h
+
+// an rpcs's handlers by proc number, for dispatch to look up without a
+// lock.
+//
+// a table is built whole and never changes; registering a handler
+// builds a new one, which the server publishes with an atomic pointer.
+// there are a power of two slots, and a proc's home slot is the top
+// bits of its Fibonacci hash. build() adds slots until no two procs
+// share a home, so that a lookup is one probe; past MAX_SLOTS it
+// settles for a proc going to the next free slot after its home.
+
+#include <vector>
+#include <stdint.h>
+
+template<class T>
+class proc_table {
+	public:
+		enum { MAX_SLOTS = 4096 };   // a power of two
+
+		// a table of procs, a map from proc number to T *
+		template<class M> static proc_table *build(const M &procs);
+
+		// proc's handler, or NULL
+		T *find(unsigned int proc) const {
+			for (size_t i = home(proc, shift_); ; i = (i + 1) & mask_) {
+				const slot &s = slots_[i];
+				if (!s.h || s.proc == proc)
+					return s.h;
+			}
+		}
+
+	private:
+		struct slot {
+			unsigned int proc;
+			T *h;   // NULL for an empty slot
+		};
+
+		static size_t home(unsigned int proc, int shift) {
+			return (uint32_t) (proc * 2654435769u) >> shift;
+		}
+		template<class M> static bool collides(const M &procs, int bits);
+
+		int shift_;      // 32 less the bits of a slot number
+		size_t mask_;
+		std::vector<slot> slots_;
+};
+
+template<class T> template<class M> bool
+proc_table<T>::collides(const M &procs, int bits)
+{
+	std::vector<bool> used(1 << bits);
+	for (const auto &p : procs) {
+		size_t i = home(p.first, 32 - bits);
+		if (used[i])
+			return true;
+		used[i] = true;
+	}
+	return false;
+}
+
+template<class T> template<class M> proc_table<T> *
+proc_table<T>::build(const M &procs)
+{
+	// at least one slot stays empty, which ends every probe
+	int bits = 1;
+	while ((1u << bits) < 2 * procs.size())
+		bits++;
+	while ((1 << bits) < MAX_SLOTS && collides(procs, bits))
+		bits++;
+
+	proc_table *t = new proc_table;
+	t->shift_ = 32 - bits;
+	t->mask_ = (1 << bits) - 1;
+	t->slots_.resize(1 << bits, slot());
+	for (const auto &p : procs) {
+		size_t i = home(p.first, t->shift_);
+		while (t->slots_[i].h)
+			i = (i + 1) & t->mask_;
+		t->slots_[i].proc = p.first;
+		t->slots_[i].h = p.second;
+	}
+	return t;
+}
+
+#endif
@@ -61,6 +61,8 @@
  */
 
 #include "rpc.h"
+#include "stream.h"
+#include "batch.h"
 #include "method_thread.h"
 #include "slock.h"
 
@@ -70,6 +72,7 @@
 #include <time.h>
 #include <netdb.h>
 #include <algorithm>
+#include <tuple>
 
 #include "jsl_log.h"
 #include "gettime.h"
@@ -79,16 +82,78 @@ const rpcc::TO rpcc::to_max = { 120000 };
 const rpcc::TO rpcc::to_min = { 1000 };
 
 rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
-: xid(xxid), un(xun), done(false)
+: xid(xxid), slot(-1), un(xun), intret(0), async(false), sent_us(0),
+	ambiguous(false), lastch(NULL), state(0)
 {
-	VERIFY(pthread_mutex_init(&m,0) == 0);
-	VERIFY(pthread_cond_init(&c, 0) == 0);
 }
 
-rpcc::caller::~caller()
+static long long
+now_us()
 {
-	VERIFY(pthread_mutex_destroy(&m) == 0);
-	VERIFY(pthread_cond_destroy(&c) == 0);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static bool
+passed(const struct timespec &deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return cmp_timespec(now, deadline) >= 0;
+}
+
+// for req_header's deadline: ms until deadline, -1 once it has passed.
+// diff_timespec() must not see a deadline in the past.
+static int
+ms_left(const struct timespec &deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (cmp_timespec(deadline, now) <= 0)
+		return -1;
+	int ms = diff_timespec(deadline, now);
+	return ms > 0 ? ms : -1;
+}
+
+bool
+rpcc::caller::claim()
+{
+	int s = state.load();
+	while (!(s & (CLAIMED | DONE))) {
+		if (state.compare_exchange_weak(s, s | CLAIMED))
+			return true;
+	}
+	return false;
+}
+
+void
+rpcc::caller::finish()
+{
+	if (state.fetch_or(DONE, std::memory_order_acq_rel) & WAITING)
+		unpark(&state);
+}
+
+bool
+rpcc::caller::wait(const struct timespec &deadline)
+{
+	int s = state.load(std::memory_order_acquire);
+	while (!(s & (DONE | KICKED))) {
+		if (!(s & WAITING) &&
+				!state.compare_exchange_weak(s, s | WAITING))
+			continue;
+		if (!park(&state, s | WAITING, &deadline))
+			return done();
+		s = state.load(std::memory_order_acquire);
+	}
+	return done();
+}
+
+void
+rpcc::caller::kick()
+{
+	if (state.fetch_or(KICKED) & WAITING)
+		unpark(&state);
 }
 
 inline
@@ -99,12 +164,156 @@ void set_rand_seed()
 	srandom((int)ts.tv_nsec^((int)getpid()));
 }
 
+// the shared rpc_dests, by address, port and lossiness
+typedef std::tuple<in_addr_t, in_port_t, int> dest_key;
+static std::map<dest_key, rpc_dest *> dests;
+static pthread_mutex_t dests_m = PTHREAD_MUTEX_INITIALIZER;
+
+rpc_dest::rpc_dest(const sockaddr_in &d, int lossy, bool shared) :
+	dst_(d), lossy_(lossy), shared_(shared), refs_(1), chan_(NULL),
+	hedge_chan_(NULL)
+{
+	VERIFY(pthread_mutex_init(&chan_m_, 0) == 0);
+	VERIFY(pthread_mutex_init(&clients_m_, 0) == 0);
+}
+
+rpc_dest::~rpc_dest()
+{
+	jsl_log(JSL_DBG_2, "rpc_dest::~rpc_dest channo=%d\n",
+			chan_?chan_->channo():-1);
+	VERIFY(clients_.size() == 0);
+	if(chan_){
+		chan_->closeconn();
+		chan_->decref();
+	}
+	if(hedge_chan_){
+		hedge_chan_->closeconn();
+		hedge_chan_->decref();
+	}
+	VERIFY(pthread_mutex_destroy(&chan_m_) == 0);
+	VERIFY(pthread_mutex_destroy(&clients_m_) == 0);
+}
+
+rpc_dest *
+rpc_dest::get(const sockaddr_in &d, int lossy, bool shared)
+{
+	if(!shared)
+		return new rpc_dest(d, lossy, false);
+	ScopedLock ml(&dests_m);
+	rpc_dest *&rd = dests[dest_key(d.sin_addr.s_addr, d.sin_port, lossy)];
+	if(rd)
+		rd->refs_++;
+	else
+		rd = new rpc_dest(d, lossy, true);
+	return rd;
+}
+
+void
+rpc_dest::put()
+{
+	if(shared_){
+		ScopedLock ml(&dests_m);
+		if(--refs_ > 0)
+			return;
+		dests.erase(dest_key(dst_.sin_addr.s_addr, dst_.sin_port, lossy_));
+	}
+	delete this;
+}
+
+bool
+rpc_dest::add(unsigned int nonce, rpcc *c)
+{
+	ScopedLock ml(&clients_m_);
+	return clients_.insert(std::make_pair(nonce, c)).second;
+}
+
+void
+rpc_dest::remove(unsigned int nonce)
+{
+	// got_pdu() and dead() hold clients_m_ while in the rpcc
+	ScopedLock ml(&clients_m_);
+	VERIFY(clients_.erase(nonce) == 1);
+}
+
+void
+rpc_dest::get_refconn(connection **ch, bool hedge)
+{
+	ScopedLock ml(&chan_m_);
+	connection *&c = hedge ? hedge_chan_ : chan_;
+	if(!c || c->isdead()){
+		if(c)
+			c->decref();
+		c = connect_to_dst(dst_, this, lossy_);
+	}
+	if(ch && c){
+		if(*ch){
+			(*ch)->decref();
+		}
+		*ch = c;
+		(*ch)->incref();
+	}
+}
+
+connection *
+rpc_dest::live_conn()
+{
+	// chan_m_ is held across a connect
+	if (pthread_mutex_trylock(&chan_m_) != 0)
+		return NULL;
+	connection *c = chan_ && !chan_->isdead() ? chan_ : NULL;
+	if (c)
+		c->incref();
+	VERIFY(pthread_mutex_unlock(&chan_m_) == 0);
+	return c;
+}
+
+int
+rpc_dest::channo()
+{
+	ScopedLock ml(&chan_m_);
+	return chan_ ? chan_->channo() : -1;
+}
+
+// on the poll thread; must not block
+bool
+rpc_dest::got_pdu(connection *c, char *b, int sz)
+{
+	reply_header h;
+	if(!unmarshall::peek_reply_header(b, sz, &h)){
+		jsl_log(JSL_DBG_1, "rpc_dest::got_pdu unmarshall header failed!!!\n");
+		rpc_buf_unref(b);
+		return true;
+	}
+	ScopedLock ml(&clients_m_);
+	std::map<unsigned int, rpcc *>::iterator i = clients_.find(h.clt_nonce);
+	if(i == clients_.end()){
+		jsl_log(JSL_DBG_2, "rpc_dest::got_pdu xid %d for gone clt %u\n",
+				h.xid, h.clt_nonce);
+		rpc_buf_unref(b);
+		return true;
+	}
+	return i->second->got_pdu(c, b, sz);
+}
+
+void
+rpc_dest::dead(connection *c)
+{
+	ScopedLock ml(&clients_m_);
+	for (auto &cl : clients_)
+		cl.second->dead(c);
+}
+
 rpcc::rpcc(sockaddr_in d, bool retrans) :
-	dst_(d), srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0),
-	retrans_(retrans), reachable_(true), chan_(NULL), destroy_wait_ (false)
+	dst_(d), srv_nonce_(0), bind_done_(false), bind_state_(BIND_NONE),
+	xid_(1), lossytest_(0),
+	retrans_(retrans), reachable_(true), dest_(NULL),
+	destroy_wait_ (false), async_jobs_(0), proc_opts_(false)
 {
 	VERIFY(pthread_mutex_init(&m_, 0) == 0);
-	VERIFY(pthread_mutex_init(&chan_m_, 0) == 0);
+	VERIFY(pthread_mutex_init(&xid_rep_m_, 0) == 0);
+	VERIFY(pthread_mutex_init(&proc_opts_m_, 0) == 0);
+	VERIFY(pthread_mutex_init(&flights_m_, 0) == 0);
+	VERIFY(pthread_mutex_init(&bind_m_, 0) == 0);
 	VERIFY(pthread_cond_init(&destroy_wait_c_, 0) == 0);
 
 	if(retrans){
@@ -122,8 +331,10 @@ rpcc::rpcc(sockaddr_in d, bool retrans) :
 		lossytest_ = atoi(loss_env);
 	}
 
-	// xid starts with 1 and latest received reply starts with 0
-	xid_rep_window_.push_back(0);
+	// a client that never retransmits has nonce 0, so it cannot share
+	dest_ = rpc_dest::get(dst_, lossytest_, retrans);
+	while(!dest_->add(clt_nonce_, this))
+		clt_nonce_ = random();
 
 	jsl_log(JSL_DBG_2, "rpcc::rpcc cltn_nonce is %d lossy %d\n",
 			clt_nonce_, lossytest_);
@@ -134,25 +345,42 @@ rpcc::rpcc(sockaddr_in d, bool retrans) :
 rpcc::~rpcc()
 {
 	jsl_log(JSL_DBG_2, "rpcc::~rpcc delete nonce %d channo=%d\n",
-			clt_nonce_, chan_?chan_->channo():-1);
-	if(chan_){
-		chan_->closeconn();
-		chan_->decref();
+			clt_nonce_, dest_->channo());
+	{
+		// executor jobs of finished async calls may still be running
+		destroy_wait_ = true;
+		// and a bind the first call started may still be out
+		bind_tok_.cancel();
+		ScopedLock ml(&m_);
+		while (async_jobs_ > 0)
+			VERIFY(pthread_cond_wait(&destroy_wait_c_, &m_) == 0);
 	}
+	dest_->remove(clt_nonce_);
+	dest_->put();
 	VERIFY(calls_.size() == 0);
+	for (auto &hp : hedged_)
+		delete hp.second;
 	VERIFY(pthread_mutex_destroy(&m_) == 0);
-	VERIFY(pthread_mutex_destroy(&chan_m_) == 0);
+	VERIFY(pthread_mutex_destroy(&xid_rep_m_) == 0);
+	VERIFY(pthread_mutex_destroy(&proc_opts_m_) == 0);
+	VERIFY(pthread_mutex_destroy(&flights_m_) == 0);
+	VERIFY(pthread_mutex_destroy(&bind_m_) == 0);
 }
 
 int
 rpcc::bind(TO to)
 {
+	if (bind_done_)
+		return 0;
 	int r;
 	int ret = call(rpc_const::bind, 0, r, to);
 	if(ret == 0){
-		ScopedLock ml(&m_);
-		bind_done_ = true;
 		srv_nonce_ = r;
+		bind_done_ = true;
+		bind_release(BIND_DONE);
+	} else if (bind_done_) {
+		// by the reply to another call meanwhile
+		ret = 0;
 	} else {
 		jsl_log(JSL_DBG_2, "rpcc::bind %s failed %d\n",
 				inet_ntoa(dst_.sin_addr), ret);
@@ -160,27 +388,72 @@ rpcc::bind(TO to)
 	return ret;
 };
 
+void
+rpcc::hedge(unsigned int proc, int pct)
+{
+	VERIFY(pct > 0 && pct <= 100);
+	ScopedLock pl(&proc_opts_m_);
+	if (hedged_.count(proc))
+		hedged_[proc]->pct = pct;
+	else
+		hedged_[proc] = new hedged_proc(pct);
+	proc_opts_ = true;
+}
+
+void
+rpcc::coalesce(unsigned int proc)
+{
+	ScopedLock pl(&proc_opts_m_);
+	coalesced_.insert(proc);
+	proc_opts_ = true;
+}
+
+int
+rpcc::hedges(unsigned int proc)
+{
+	hedged_proc *hp = hedged(proc);
+	return hp ? hp->hedges.load() : 0;
+}
+
+// entries are never removed, so the pointer stays good
+rpcc::hedged_proc *
+rpcc::hedged(unsigned int proc)
+{
+	if (!proc_opts_)
+		return NULL;
+	ScopedLock pl(&proc_opts_m_);
+	auto i = hedged_.find(proc);
+	return i == hedged_.end() ? NULL : i->second;
+}
+
+bool
+rpcc::coalesced(unsigned int proc)
+{
+	if (!proc_opts_)
+		return false;
+	ScopedLock pl(&proc_opts_m_);
+	return coalesced_.count(proc) > 0;
+}
+
 // Cancel all outstanding calls
 void
 rpcc::cancel(void)
 {
-  ScopedLock ml(&m_);
   printf("rpcc::cancel: force callers to fail\n");
-  std::map<int,caller*>::iterator iter;
-  for(iter = calls_.begin(); iter != calls_.end(); iter++){
-    caller *ca = iter->second;
-
+  // calls starting from now on see this and back out
+  destroy_wait_ = true;
+  calls_.for_each([this](caller *ca) {
     jsl_log(JSL_DBG_2, "rpcc::cancel: force caller to fail\n");
-    {
-      ScopedLock cl(&ca->m);
-      ca->done = true;
+    if (ca->claim()) {
       ca->intret = rpc_const::cancel_failure;
-      VERIFY(pthread_cond_signal(&ca->c) == 0);
+      ca->finish();
+      if (ca->async)
+        async_done((async_caller *) ca);
     }
-  }
+  });
 
-  while (calls_.size () > 0){
-    destroy_wait_ = true;
+  ScopedLock ml(&m_);
+  while (calls_.size () > 0 || async_jobs_ > 0){
     VERIFY(pthread_cond_wait(&destroy_wait_c_,&m_) == 0);
   }
   printf("rpcc::cancel: done\n");
@@ -190,42 +463,157 @@ int
 rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 		TO to)
 {
+	// a follower's cancel would have to reach the flight's leader
+	if (coalesced(proc) && !to.cancel)
+		return call_shared(proc, req, rep, to);
+	return call_wire(proc, req, rep, to);
+}
 
-	caller ca(0, &rep);
+// join the call in flight with the same proc and arguments, or make
+// it and let later ones join
+int
+rpcc::call_shared(unsigned int proc, marshall &req, unmarshall &rep,
+		TO to)
+{
+	std::string key((char *) &proc, sizeof(proc));
+	const std::vector<struct iovec> &iov = req.iov();
+	for (size_t i = 0; i < iov.size(); i++) {
+		size_t off = i == 0 ? RPC_HEADER_SZ : 0;
+		key.append((char *) iov[i].iov_base + off, iov[i].iov_len - off);
+	}
+
+	flight *f;
+	bool leader;
 	{
-		ScopedLock ml(&m_);
+		ScopedLock fl(&flights_m_);
+		auto i = flights_.find(key);
+		leader = (i == flights_.end());
+		if (leader) {
+			f = new flight;
+			flights_[key] = f;
+		} else {
+			f = i->second;
+			f->refs++;
+		}
+	}
 
-		if((proc != rpc_const::bind && !bind_done_) ||
-				(proc == rpc_const::bind && bind_done_)){
-			jsl_log(JSL_DBG_1, "rpcc::call1 rpcc has not been bound to dst or binding twice\n");
+	int ret;
+	if (leader) {
+		ret = call_wire(proc, req, rep, to);
+		{
+			// calls from now on see the server afresh
+			ScopedLock fl(&flights_m_);
+			flights_.erase(key);
+		}
+		f->ret = ret;
+		if (ret >= 0 && rep.cstr()) {
+			f->buf = rep.cstr();
+			f->sz = rep.size();
+			rpc_buf_ref(f->buf);
+		}
+		f->done.store(1, std::memory_order_release);
+		unpark(&f->done);
+	} else {
+		jsl_log(JSL_DBG_2, "rpcc::call_shared %u joined a call to proc %x\n",
+				clt_nonce_, proc);
+		// as long as our own timeout allows
+		struct timespec now, deadline;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		add_timespec(now, to.to, &deadline);
+		while (!f->done.load(std::memory_order_acquire) &&
+				park(&f->done, 0, &deadline))
+			;
+		if (!f->done.load(std::memory_order_acquire)) {
+			ret = rpc_const::timeout_failure;
+		} else {
+			ret = f->ret;
+			if (f->buf)
+				rep.share(f->buf, f->sz);
+		}
+	}
+
+	if (--f->refs == 0) {
+		rpc_buf_unref(f->buf);
+		delete f;
+	}
+	return ret;
+}
+
+// send the request and wait for its reply
+int
+rpcc::call_wire(unsigned int proc, marshall &req, unmarshall &rep,
+		TO to)
+{
+
+	caller ca(0, &rep);
+	{
+		if(proc == rpc_const::bind && bind_done_){
+			jsl_log(JSL_DBG_1, "rpcc::call1 rpcc binding twice\n");
 			return rpc_const::bind_failure;
 		}
 
+		ca.xid = next_xid();
+		ca.slot = calls_.insert(ca.xid, &ca);
+		if (ca.slot < 0) {
+			jsl_log(JSL_DBG_1, "rpcc::call1 %u too many calls for xid %u\n",
+					clt_nonce_, ca.xid);
+			update_xid_rep(ca.xid);
+			return rpc_const::busy_failure;
+		}
+
+		// checked after the insert, so that cancel() either sees the
+		// call or is seen here
 		if(destroy_wait_){
+		  calls_.remove(ca.slot);
+		  call_gone();
 		  return rpc_const::cancel_failure;
 		}
+		if(to.cancel && !to.cancel->attach(this, ca.xid)){
+			calls_.remove(ca.slot);
+			update_xid_rep(ca.xid);
+			call_gone();
+			return rpc_const::cancel_failure;
+		}
 
-		ca.xid = xid_++;
-		calls_[ca.xid] = &ca;
-
-		req_header h(ca.xid, proc, clt_nonce_, srv_nonce_, xid_rep_window_.front());
+		req_header h(ca.xid, proc, clt_nonce_, srv_nonce_, xid_rep());
 		req.pack_req_header(h);
 	}
 
 	TO curr_to;
-	struct timespec now, nextdeadline, finaldeadline;
+	struct timespec now, nextdeadline, finaldeadline, hedgedeadline;
 
-	clock_gettime(CLOCK_REALTIME, &now);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long long start = now_us();
 	add_timespec(now, to.to, &finaldeadline);
-	curr_to.to = to_min.to;
+	curr_to.to = dest_->rtt().rto();
+	// a send that failed never reached the server, so there is nothing
+	// to wait for but a new connection; try again soon
+	int retry_to = rtt_estimator::RTO_MIN_MS;
+
+	// false if the call was held, waiting for a bind, until its deadline
+	bool go = proc == rpc_const::bind || bind_wait(to, finaldeadline);
+
+	// a hedge goes out once the call has taken longer than most do
+	hedged_proc *hp = hedged(proc);
+	long long hedge_us = hp ? hp->lat.percentile(hp->pct) : -1;
+	if (hedge_us >= 0)
+		add_timespec(now, (hedge_us + 999) / 1000, &hedgedeadline);
+	unsigned int hxid = 0;
+	int hslot = -1;
 
 	connection *ch = NULL;
+	connection *hch = NULL;
 
-	while (finaldeadline.tv_sec) {
+	while (go) {
         VERIFY(reachable_);
 
         get_refconn(&ch);
-        const auto sent = ch && ch->send(req.cstr(), req.size());
+        // the server drops the request if it cannot start on it in time
+        req.pack_req_deadline(ms_left(finaldeadline));
+        req.pack_req_srv_nonce(srv_nonce_);
+        // large rpc_blob arguments go out straight from the caller's
+        // memory; it stays valid until we return
+        const auto sent = send_req(&ca, ch, req.iov());
         if (sent) {
             jsl_log(JSL_DBG_2,
                 "rpcc::call1 %u just sent req proc %x xid %u clt_nonce %d\n",
@@ -236,152 +624,686 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
                     clt_nonce_, proc, ca.xid, clt_nonce_);
         }
 
-		clock_gettime(CLOCK_REALTIME, &now);
-		add_timespec(now, curr_to.to, &nextdeadline);
-		if (cmp_timespec(nextdeadline, finaldeadline) > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		add_timespec(now, sent ? curr_to.to : retry_to, &nextdeadline);
+		if (cmp_timespec(nextdeadline, finaldeadline) > 0)
 			nextdeadline = finaldeadline;
-			finaldeadline.tv_sec = 0;
-		}
 
-		{
-			ScopedLock cal(&ca.m);
-			while (!ca.done){
-				if (pthread_cond_timedwait(&ca.c, &ca.m, &nextdeadline) == ETIMEDOUT) {
-				  	jsl_log(JSL_DBG_2, "rpcc::call1: timeout\n");
+		if (hedge_us >= 0 && !hxid &&
+				cmp_timespec(hedgedeadline, nextdeadline) < 0) {
+			if (ca.wait(hedgedeadline)) {
+				jsl_log(JSL_DBG_2, "rpcc::call1: reply received\n");
+				break;
+			}
+			if (ca.kicked()) {
+				if (passed(finaldeadline))
 					break;
-				}
+				continue;
+			}
+			// the hedge is a call of its own to the server, under a new
+			// xid, whose reply completes ca just as well. retransmissions
+			// from here on carry its xid, which is as good.
+			hxid = next_xid();
+			hslot = calls_.insert(hxid, &ca);
+			if (hslot < 0) {
+				// no room for it; the call goes on without
+				update_xid_rep(hxid);
+				hxid = 0;
+				hedge_us = -1;
+			} else {
+				ca.ambiguous = true;
+				req_header h(hxid, proc, clt_nonce_, srv_nonce_, xid_rep(),
+						ms_left(finaldeadline));
+				req.pack_req_header(h);
+				get_refconn(&hch, true);
+				if (hch && hch->sendv(&req.iov()[0], req.iov().size()))
+					jsl_log(JSL_DBG_2, "rpcc::call1 %u hedged xid %u with xid %u\n",
+							clt_nonce_, ca.xid, hxid);
+				hp->hedges++;
 			}
+		}
 
-			if (ca.done) {
-			    jsl_log(JSL_DBG_2, "rpcc::call1: reply received\n");
+		if (ca.wait(nextdeadline)) {
+			jsl_log(JSL_DBG_2, "rpcc::call1: reply received\n");
+			break;
+		}
+		if (ca.kicked()) {
+			// no need to wait out the interval for a reply that cannot
+			// come; it was no sign of congestion either
+			jsl_log(JSL_DBG_2, "rpcc::call1: connection died\n");
+			if (passed(finaldeadline))
 				break;
-			}
+			continue;
 		}
+		jsl_log(JSL_DBG_2, "rpcc::call1: timeout\n");
 
-		curr_to.to <<= 1;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (cmp_timespec(now, finaldeadline) >= 0)
+			break;
+		if (sent)
+			curr_to.to = rtt_estimator::backoff(curr_to.to);
+		else
+			retry_to = rtt_estimator::backoff(retry_to);
 	}
 
 	{
-        // no locking of ca.m since only this thread changes ca.xid
-		ScopedLock ml(&m_);
-		calls_.erase(ca.xid);
+		// waits for got_pdu() to be done with ca
+		calls_.remove(ca.slot);
+		if (hxid)
+			calls_.remove(hslot);
 		// may need to update the xid again here, in case the
 		// packet times out before it's even sent by the channel.
 		// I don't think there's any harm in maybe doing it twice
 		update_xid_rep(ca.xid);
-
-		if(destroy_wait_){
-		  VERIFY(pthread_cond_signal(&destroy_wait_c_) == 0);
-		}
+		if (hxid)
+			update_xid_rep(hxid);
+		call_gone();
 	}
+	if (to.cancel)
+		to.cancel->detach(this, ca.xid);
 
-	ScopedLock cal(&ca.m);
+	if (hp && ca.done() && ca.intret >= 0)
+		hp->lat.sample(now_us() - start);
 
+	// nobody can claim ca any more, and a claim made earlier has been
+	// finished
 	jsl_log(JSL_DBG_2,
 			"rpcc::call1 %u call done for req proc %x xid %u %s:%d done? %d ret %d \n",
 			clt_nonce_, proc, ca.xid, inet_ntoa(dst_.sin_addr),
-			ntohs(dst_.sin_port), ca.done, ca.intret);
+			ntohs(dst_.sin_port), ca.done(), ca.intret);
 
 	if(ch)
 		ch->decref();
+	if(hch)
+		hch->decref();
 
 	// destruction of req automatically frees its buffer
-	return (ca.done? ca.intret : rpc_const::timeout_failure);
+	return (ca.done()? ca.intret : rpc_const::timeout_failure);
+}
+
+// the threads that retransmit async calls and run their callbacks
+static ThrPool *async_pool;
+static pthread_once_t async_pool_once = PTHREAD_ONCE_INIT;
+
+static void
+async_pool_init()
+{
+	// never blocks the poll thread, which queues completions
+	async_pool = new ThrPool(4, false, 0);
+}
+
+static ThrPool *
+async_executor()
+{
+	pthread_once(&async_pool_once, async_pool_init);
+	return async_pool;
+}
+
+rpcc::async_caller::async_caller(marshall *xreq, callback xcb, TO to)
+: caller(0, &rep), req(xreq), cb(xcb), curr_to(to_min.to),
+	retry_to(rtt_estimator::RTO_MIN_MS), timer(0), tok(to.cancel), refs(1)
+{
+	struct timespec now;
+	async = true;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	add_timespec(now, to.to, &finaldeadline);
+	VERIFY(pthread_mutex_init(&m, 0) == 0);
+}
+
+rpcc::async_caller::~async_caller()
+{
+	delete req;
+	VERIFY(pthread_mutex_destroy(&m) == 0);
+}
+
+void
+rpcc::call_async1(unsigned int proc, marshall *req, callback cb, TO to)
+{
+	// retransmits outlive the caller's rpc_blobs
+	req->flatten();
+	async_caller *ca = new async_caller(req, cb, to);
+	if(proc == rpc_const::bind && bind_done_){
+		jsl_log(JSL_DBG_1, "rpcc::call_async1 rpcc binding twice\n");
+		ca->intret = rpc_const::bind_failure;
+	} else if(destroy_wait_){
+		ca->intret = rpc_const::cancel_failure;
+	}
+	if (ca->intret < 0) {
+		VERIFY(ca->claim());
+		ca->finish();
+		async_done(ca);
+		return;
+	}
+
+	ca->curr_to = dest_->rtt().rto();
+	// the reply may complete ca before async_send() is done with it
+	ca->refs++;
+	async_jobs_++;
+	ca->xid = next_xid();
+	req_header h(ca->xid, proc, clt_nonce_, srv_nonce_, xid_rep());
+	req->pack_req_header(h);
+	ca->slot = calls_.insert(ca->xid, ca);
+
+	if (ca->slot < 0) {
+		jsl_log(JSL_DBG_1, "rpcc::call_async1 %u too many calls for xid %u\n",
+				clt_nonce_, ca->xid);
+		update_xid_rep(ca->xid);
+		VERIFY(ca->claim());
+		ca->intret = rpc_const::busy_failure;
+		ca->finish();
+		async_done(ca);
+	} else if (destroy_wait_ || (ca->tok && !ca->tok->attach(this, ca->xid))) {
+		// cancel() may have missed the call
+		if (ca->claim()) {
+			ca->intret = rpc_const::cancel_failure;
+			ca->finish();
+			async_done(ca);
+		}
+	} else if (proc == rpc_const::bind || !bind_hold(ca, to)) {
+		async_send(ca);
+	}
+	async_release(ca, false);
+}
+
+// send, or resend, ca and arm the timer for the next try
+void
+rpcc::async_send(async_caller *ca)
+{
+	connection *ch = NULL;
+	get_refconn(&ch);
+	ca->req->pack_req_deadline(ms_left(ca->finaldeadline));
+	ca->req->pack_req_srv_nonce(srv_nonce_);
+	bool sent = send_req(ca, ch, ca->req->iov());
+	if (sent) {
+		jsl_log(JSL_DBG_2, "rpcc::async_send %u just sent req xid %u\n",
+				clt_nonce_, ca->xid);
+	} else {
+		jsl_log(JSL_DBG_2, "rpcc::async_send %u failed to send req xid %u\n",
+				clt_nonce_, ca->xid);
+	}
+	if (ch)
+		ch->decref();
+
+	struct timespec now, next;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int &to = sent ? ca->curr_to : ca->retry_to;
+	add_timespec(now, to, &next);
+	if (cmp_timespec(next, ca->finaldeadline) > 0)
+		next = ca->finaldeadline;
+	// a slow get_refconn() may have taken us past the deadline
+	int ms = std::max(ms_left(next), 0);
+	to = rtt_estimator::backoff(to);
+
+	unsigned int xid = ca->xid;
+	// async_complete() looks for the timer under m once ca is done
+	ScopedLock cl(&ca->m);
+	if (!ca->done()) {
+		ca->timer = PollMgr::Instance()->add_timer(ms,
+				[this, xid]() { async_timeout(xid); });
+	}
+}
+
+// PollMgr's thread runs this when an async call has waited its
+// current interval; it must not block, so the executor takes over.
+void
+rpcc::async_timeout(unsigned int xid)
+{
+	int slot;
+	caller *c = calls_.pin(xid, &slot);
+	if (!c)
+		return;
+	if (c->async) {
+		async_caller *ca = (async_caller *) c;
+		ScopedLock cl(&ca->m);
+		ca->timer = 0;
+		if (!ca->done()) {
+			ca->refs++;
+			async_jobs_++;
+			async_executor()->addObjJob(this, &rpcc::async_retransmit, ca);
+		}
+	}
+	calls_.unpin(slot);
+}
+
+void
+rpcc::async_retransmit(async_caller *ca)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (cmp_timespec(now, ca->finaldeadline) >= 0) {
+		if (ca->claim()) {
+			jsl_log(JSL_DBG_2, "rpcc::async_retransmit: xid %u timeout\n", ca->xid);
+			ca->intret = rpc_const::timeout_failure;
+			ca->finish();
+			async_done(ca);
+		}
+	} else if (!ca->done()) {
+		async_send(ca);
+	}
+	async_release(ca, false);
+}
+
+// ca has just been marked done; hand it to the executor to complete
+void
+rpcc::async_done(async_caller *ca)
+{
+	ca->refs++;
+	async_jobs_++;
+	async_executor()->addObjJob(this, &rpcc::async_complete, ca);
+}
+
+void
+rpcc::async_complete(async_caller *ca)
+{
+	if (ca->slot >= 0) {
+		calls_.remove(ca->slot);
+		update_xid_rep(ca->xid);
+		call_gone();
+	}
+	// before the callback, which may start another call on the token
+	if (ca->tok)
+		ca->tok->detach(this, ca->xid);
+
+	unsigned long t;
+	{
+		ScopedLock cl(&ca->m);
+		t = ca->timer;
+		ca->timer = 0;
+	}
+	if (t)
+		PollMgr::Instance()->del_timer(t);
+
+	jsl_log(JSL_DBG_2, "rpcc::async_complete %u xid %u ret %d\n",
+			clt_nonce_, ca->xid, ca->intret);
+	ca->cb(ca->intret, ca->rep);
+	async_release(ca, true);
+}
+
+// drop a job's hold on ca, and with last the call's own
+void
+rpcc::async_release(async_caller *ca, bool last)
+{
+	int n = last ? 2 : 1;
+	bool gone = (ca->refs.fetch_sub(n) == n);
+	{
+		// under m_, so that ~rpcc() cannot see the count drop and go
+		// away before we are done here
+		ScopedLock ml(&m_);
+		async_jobs_--;
+		if (destroy_wait_)
+			VERIFY(pthread_cond_broadcast(&destroy_wait_c_) == 0);
+	}
+	if (gone)
+		delete ca;
+}
+
+// before a call goes out: wait while another call of the unbound
+// client is getting the server's nonce, or, for the first, start a
+// bind. false if the deadline passed first.
+bool
+rpcc::bind_wait(TO to, const struct timespec &deadline)
+{
+	for (;;) {
+		int s = bind_state_.load();
+		if (s == BIND_DONE)
+			return true;
+		if (s == BIND_NONE) {
+			if (bind_state_.compare_exchange_strong(s, BIND_BUSY)) {
+				start_bind(to);
+				return true;
+			}
+			continue;
+		}
+		if (!park(&bind_state_, BIND_BUSY, &deadline))
+			return false;
+	}
+}
+
+// the same for an async call, which cannot wait: true if ca is held,
+// to be sent once the bind is over
+bool
+rpcc::bind_hold(async_caller *ca, TO to)
+{
+	for (;;) {
+		int s = bind_state_.load();
+		if (s == BIND_DONE)
+			return false;
+		if (s == BIND_NONE) {
+			if (bind_state_.compare_exchange_strong(s, BIND_BUSY)) {
+				start_bind(to);
+				return false;
+			}
+			continue;
+		}
+		ScopedLock bl(&bind_m_);
+		if (bind_state_ != BIND_BUSY)
+			continue;
+		// a job, as async_retransmit() will send it
+		ca->refs++;
+		async_jobs_++;
+		bind_held_.push_back(ca);
+		return true;
+	}
+}
+
+// ask for the server's nonce without waiting. the reply's header binds
+// the client, in got_pdu(); if there is none, the bind is over anyway.
+void
+rpcc::start_bind(TO to)
+{
+	jsl_log(JSL_DBG_2, "rpcc::start_bind %u\n", clt_nonce_);
+	// the caller's token is for its own call, not the bind that others
+	// may be held for. the last bind, if any, is done with ours.
+	bind_tok_.reset();
+	to.cancel = &bind_tok_;
+	marshall *m = new marshall;
+	*m << 0;
+	call_async1(rpc_const::bind, m, [this](int ret, unmarshall &) {
+			if (ret < 0)
+				bind_release(BIND_NONE);
+			}, to);
+}
+
+// the bind is over, and the client bound if state is BIND_DONE: let
+// the calls held go. must not block, as got_pdu() calls it.
+void
+rpcc::bind_release(int state)
+{
+	std::vector<async_caller *> held;
+	{
+		ScopedLock bl(&bind_m_);
+		if (bind_state_ == BIND_DONE)
+			return;
+		bind_state_ = state;
+		held.swap(bind_held_);
+	}
+	unpark(&bind_state_);
+	for (size_t i = 0; i < held.size(); i++)
+		async_executor()->addObjJob(this, &rpcc::async_retransmit, held[i]);
+}
+
+void
+rpcc::get_refconn(connection **ch, bool hedge)
+{
+	dest_->get_refconn(ch, hedge);
+}
+
+// PollMgr's thread is being used to
+// make this upcall from connection object, through dest_, to rpcc.
+// this funtion must not block.
+//
+// this function keeps no reference for connection *c
+bool
+rpcc::got_pdu(connection *c, char *b, int sz)
+{
+	unmarshall rep(b, sz);
+	reply_header h;
+	rep.unpack_reply_header(&h);
+
+	if(!rep.ok()){
+		jsl_log(JSL_DBG_1, "rpcc:got_pdu unmarshall header failed!!!\n");
+		return true;
+	}
+
+	update_xid_rep(h.xid);
+
+	// the first reply binds us, if bind() has not. a call sent unbound
+	// may yet reach another instance of the server, if it restarted.
+	bool oldsrv = false;
+	if(h.srv_nonce){
+		unsigned int n = 0;
+		if(srv_nonce_.compare_exchange_strong(n, h.srv_nonce)) {
+			bind_done_ = true;
+			bind_release(BIND_DONE);
+		} else
+			oldsrv = n != h.srv_nonce;
+	}
+
+	// the pin keeps the caller from returning, and ca from going away,
+	// until we are done with it
+	int slot;
+	caller *ca = calls_.pin(h.xid, &slot);
+	if(!ca){
+		jsl_log(JSL_DBG_2, "rpcc::got_pdu xid %d no pending request\n", h.xid);
+		return true;
+	}
+
+	if(ca->claim()){
+		long long sent = ca->sent_us.load();
+		if (sent && !ca->ambiguous)
+			dest_->rtt().sample(now_us() - sent);
+		if(oldsrv){
+			ca->intret = rpc_const::oldsrv_failure;
+		} else {
+			ca->un->take_in(rep);
+			ca->intret = h.ret;
+		}
+		if(ca->intret < 0){
+			jsl_log(JSL_DBG_2, "rpcc::got_pdu: RPC reply error for xid %d intret %d\n",
+					h.xid, ca->intret);
+		}
+		// one store, and a wake if the caller is parked
+		ca->finish();
+		if (ca->async)
+			async_done((async_caller *) ca);
+	}
+	calls_.unpin(slot);
+	return true;
+}
+
+// PollMgr's thread, or a thread whose send failed, tells us c is dead.
+// calls whose request went out on it would otherwise sit out their
+// retransmission interval, though the reply is gone with it; hurry
+// them along. must not block: the connection's lock may be held.
+void
+rpcc::dead(connection *c)
+{
+	calls_.for_each([this, c](caller *ca) {
+		if (ca->lastch.load() != c || ca->done())
+			return;
+		if (!ca->async) {
+			ca->kick();
+			return;
+		}
+		// an async call's retransmission is on a timer, which only the
+		// poll thread can move without waiting for it
+		async_caller *aca = (async_caller *) ca;
+		aca->refs++;
+		async_jobs_++;
+		PollMgr::Instance()->add_timer(0, [this, aca]() { async_hurry(aca); });
+	});
+}
+
+// PollMgr's thread, soon after dead(): retransmit ca now rather than
+// when its timer goes off
+void
+rpcc::async_hurry(async_caller *ca)
+{
+	{
+		ScopedLock cl(&ca->m);
+		// no timer: a send is under way and will arm one
+		if (ca->timer && !ca->done()) {
+			// not running, as this is, so this does not wait
+			PollMgr::Instance()->del_timer(ca->timer);
+			ca->timer = 0;
+			ca->refs++;
+			async_jobs_++;
+			async_executor()->addObjJob(this, &rpcc::async_retransmit, ca);
+		}
+	}
+	async_release(ca, false);
+}
+
+// cancel the call xid, if it is still in flight
+connection *
+rpcc::cancel_call(unsigned int xid, marshall &m)
+{
+	int slot;
+	caller *ca = calls_.pin(xid, &slot);
+	if (!ca)
+		return NULL;
+	if (ca->claim()) {
+		ca->intret = rpc_const::cancel_failure;
+		ca->finish();
+		if (ca->async)
+			async_done((async_caller *) ca);
+	}
+	calls_.unpin(slot);
+	jsl_log(JSL_DBG_2, "rpcc::cancel_call %u cancelled xid %u\n",
+			clt_nonce_, xid);
+
+	// the server keeps no state for nonce 0 to cancel anything in
+	if (!clt_nonce_)
+		return NULL;
+	req_header h(xid, rpc_const::cancel, clt_nonce_, srv_nonce_, xid_rep());
+	m.pack_req_header(h);
+	return dest_->live_conn();
+}
+
+cancel_token::cancel_token() : cancelled_(false), cl_(NULL), xid_(0)
+{
+	VERIFY(pthread_mutex_init(&m_, 0) == 0);
+}
+
+cancel_token::~cancel_token()
+{
+	VERIFY(cl_ == NULL);
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
+}
+
+void
+cancel_token::cancel()
+{
+	marshall m;
+	connection *ch = NULL;
+	{
+		// holding m_ keeps the call, and so its rpcc, from going away
+		ScopedLock ml(&m_);
+		if (cancelled_)
+			return;
+		cancelled_ = true;
+		if (cl_)
+			ch = cl_->cancel_call(xid_, m);
+	}
+	if (!ch)
+		return;
+	// the server only saves itself some work, so on the poll thread a
+	// cancel that cannot go out at once is dropped
+	if (PollMgr::on_poll_thread())
+		ch->try_send(m.cstr(), m.size());
+	else
+		ch->send(m.cstr(), m.size());
+	ch->decref();
+}
+
+bool
+cancel_token::cancelled()
+{
+	ScopedLock ml(&m_);
+	return cancelled_;
+}
+
+void
+cancel_token::reset()
+{
+	ScopedLock ml(&m_);
+	VERIFY(cl_ == NULL);
+	cancelled_ = false;
+}
+
+bool
+cancel_token::attach(rpcc *cl, unsigned int xid)
+{
+	ScopedLock ml(&m_);
+	if (cancelled_)
+		return false;
+	VERIFY(cl_ == NULL);
+	cl_ = cl;
+	xid_ = xid;
+	return true;
+}
+
+void
+cancel_token::detach(rpcc *cl, unsigned int xid)
+{
+	ScopedLock ml(&m_);
+	if (cl_ == cl && xid_ == xid)
+		cl_ = NULL;
+}
+
+// send a copy of ca's request on ch, keeping track of what an rtt
+// sample from its reply would mean
+bool
+rpcc::send_req(caller *ca, connection *ch, const std::vector<struct iovec> &iov)
+{
+	if (!ch)
+		return false;
+	// stamped before sending: the reply may beat sendv() back
+	bool first = (ca->sent_us.load() == 0);
+	if (first)
+		ca->sent_us = now_us();
+	if (ca->lastch.exchange(ch) != ch && !first)
+		ca->ambiguous = true;
+	bool ok = ch->sendv(&iov[0], iov.size());
+	if (!ok && first)
+		ca->sent_us = 0;
+	return ok;
 }
 
+// a call has left calls_; wake up cancel() if it is waiting for that
 void
-rpcc::get_refconn(connection **ch)
+rpcc::call_gone()
 {
-	ScopedLock ml(&chan_m_);
-	if(!chan_ || chan_->isdead()){
-		if(chan_)
-			chan_->decref();
-		chan_ = connect_to_dst(dst_, this, lossytest_);
-	}
-	if(ch && chan_){
-		if(*ch){
-			(*ch)->decref();
-		}
-		*ch = chan_;
-		(*ch)->incref();
+	if (destroy_wait_) {
+		ScopedLock ml(&m_);
+		VERIFY(pthread_cond_broadcast(&destroy_wait_c_) == 0);
 	}
 }
 
-// PollMgr's thread is being used to
-// make this upcall from connection object to rpcc.
-// this funtion must not block.
-//
-// this function keeps no reference for connection *c
-bool
-rpcc::got_pdu(connection *c, char *b, int sz)
+// the highest xid up to which the client has all its replies.
+// xid starts with 1 and latest received reply starts with 0.
+unsigned int
+rpcc::xid_rep()
 {
-	unmarshall rep(b, sz);
-	reply_header h;
-	rep.unpack_reply_header(&h);
-
-	if(!rep.ok()){
-		jsl_log(JSL_DBG_1, "rpcc:got_pdu unmarshall header failed!!!\n");
-		return true;
-	}
-
-	ScopedLock ml(&m_);
-
-	update_xid_rep(h.xid);
-
-	if(calls_.find(h.xid) == calls_.end()){
-		jsl_log(JSL_DBG_2, "rpcc::got_pdu xid %d no pending request\n", h.xid);
-		return true;
-	}
-	caller *ca = calls_[h.xid];
+	return xid_rep_window_.base();
+}
 
-	ScopedLock cl(&ca->m);
-	if(!ca->done){
-		ca->un->take_in(rep);
-		ca->intret = h.ret;
-		if(ca->intret < 0){
-			jsl_log(JSL_DBG_2, "rpcc::got_pdu: RPC reply error for xid %d intret %d\n",
-					h.xid, ca->intret);
-		}
-		ca->done = 1;
+unsigned int
+rpcc::next_xid()
+{
+	unsigned int xid = xid_++;
+	if (xid == 0) {
+		// wrapped around
+		update_xid_rep(0);
+		xid = xid_++;
 	}
-	VERIFY(pthread_cond_broadcast(&ca->c) == 0);
-	return true;
+	return xid;
 }
 
-// assumes thread holds mutex m
 void
 rpcc::update_xid_rep(unsigned int xid)
 {
-	std::list<unsigned int>::iterator it;
-
-	if(xid <= xid_rep_window_.front()){
+	// never sent; a reply to it can only be garbage
+	if (xid >= xid_)
 		return;
-	}
-
-	for (it = xid_rep_window_.begin(); it != xid_rep_window_.end(); it++){
-		if(*it > xid){
-			xid_rep_window_.insert(it, xid);
-			goto compress;
-		}
-	}
-	xid_rep_window_.push_back(xid);
-
-compress:
-	it = xid_rep_window_.begin();
-	for (it++; it != xid_rep_window_.end(); it++){
-		while (xid_rep_window_.front() + 1 == *it)
-			xid_rep_window_.pop_front();
-	}
+	ScopedLock xl(&xid_rep_m_);
+	xid_rep_window_.mark(xid);
 }
 
 
-rpcs::rpcs(unsigned int p1, int count)
-  : port_(p1), counting_(count), curr_counts_(count), lossytest_(0), reachable_ (true)
+rpcs::rpcs(unsigned int p1, int count, const char *amo_log_path)
+  : port_(p1), nclients_(0), reply_budget_(REPLY_BUDGET), retained_(0),
+	evicted_(0), retain_seq_(0), trimming_(false), log_(NULL), replies_owed_(0), counting_(count), curr_counts_(count), lossytest_(0), reachable_ (true),
+	next_stream_(1), expired_(0)
 {
 	VERIFY(pthread_mutex_init(&procs_m_, 0) == 0);
+	proctab_ = proc_table<handler>::build(procs_);
 	VERIFY(pthread_mutex_init(&count_m_, 0) == 0);
-	VERIFY(pthread_mutex_init(&reply_window_m_, 0) == 0);
-	VERIFY(pthread_mutex_init(&conss_m_, 0) == 0);
+	for (int i = 0; i < CLIENT_SHARDS; i++) {
+		VERIFY(pthread_mutex_init(&clients_[i].m, 0) == 0);
+		VERIFY(pthread_mutex_init(&clients_[i].lru_m, 0) == 0);
+	}
+	VERIFY(pthread_mutex_init(&streams_m_, 0) == 0);
 
 	set_rand_seed();
 	nonce_ = random();
@@ -393,7 +1315,27 @@ rpcs::rpcs(unsigned int p1, int count)
 	}
 
 	reg(rpc_const::bind, this, &rpcs::rpcbind);
+	reg(rpc_const::stream_open, this, &rpcs::stream_open);
+	reg_async(rpc_const::stream_push, this, &rpcs::stream_push);
+	reg_async(rpc_const::stream_pull, this, &rpcs::stream_pull);
+	reg_async(rpc_const::batch, this, &rpcs::batch);
 	dispatchpool_ = new ThrPool(6,false);
+	// jobs here are never turned away: each carries on a batch
+	batchpool_ = new ThrPool(BATCH_POOL_THREADS, false, 0);
+	streampool_ = new ThrPool(STREAM_THREADS, false);
+
+	if (amo_log_path) {
+		amo_log *l = new amo_log();
+		if (l->open(amo_log_path, &nonce_,
+					[this](const amo_log::rec &e) { replay(e); })) {
+			jsl_log(JSL_DBG_2, "rpcs::rpcs: %d clients from %s, nonce %u\n",
+					nclients_.load(), amo_log_path, nonce_);
+			log_ = l;
+			snapshot_log();
+		} else {
+			delete l;
+		}
+	}
 
 	listener_ = new tcpsconn(this, port_, lossytest_);
 }
@@ -402,8 +1344,20 @@ rpcs::~rpcs()
 {
 	// must delete listener before dispatchpool
 	delete listener_;
+	// answers the pushes and pulls held, while there is a pool to
+	// send them from
+	abort_streams();
 	delete dispatchpool_;
+	delete batchpool_;
+	// and any opened meanwhile
+	abort_streams();
+	delete streampool_;
+	VERIFY(replies_owed_ == 0);
 	free_reply_window();
+	delete log_;
+	delete proctab_.load();
+	for (const proc_table<handler> *t : old_proctabs_)
+		delete t;
 }
 
 bool
@@ -411,10 +1365,41 @@ rpcs::got_pdu(connection *c, char *b, int sz)
 {
         if(!reachable_){
             jsl_log(JSL_DBG_1, "rpcss::got_pdu: not reachable\n");
+            rpc_buf_unref(b);
             return true;
         }
 
-	djob_t *j = new djob_t(c, b, sz);
+	// a request whose caller has given up by the time it gets here
+	// would only hold up a dispatch thread
+	req_header h;
+	long long deadline = 0;
+	bool peeked = unmarshall::peek_req_header(b, sz, &h);
+	if (peeked && h.proc == rpc_const::cancel) {
+		cancel_req(h.clt_nonce, h.xid);
+		rpc_buf_unref(b);
+		return true;
+	}
+	if (peeked && h.deadline) {
+		if (h.deadline < 0) {
+			jsl_log(JSL_DBG_1, "rpcs::got_pdu: rpc %u from clt %u expired\n",
+					h.xid, h.clt_nonce);
+			expired_++;
+			rpc_buf_unref(b);
+			return true;
+		}
+		deadline = now_us() + h.deadline * 1000LL;
+	}
+
+	if (peeked) {
+		handler *f = proctab_.load(std::memory_order_acquire)->find(h.proc);
+		if (f && f->inline_ok.load(std::memory_order_relaxed)) {
+			c->incref();
+			serve(c, b, sz, deadline);
+			return true;
+		}
+	}
+
+	djob_t *j = new djob_t(c, b, sz, deadline);
 	c->incref();
 	bool succ = dispatchpool_->addObjJob(this, &rpcs::dispatch, j);
 	if(!succ || !reachable_){
@@ -430,7 +1415,26 @@ rpcs::reg1(unsigned int proc, handler *h)
 	ScopedLock pl(&procs_m_);
 	VERIFY(procs_.count(proc) == 0);
 	procs_[proc] = h;
-	VERIFY(procs_.count(proc) >= 1);
+	old_proctabs_.push_back(
+			proctab_.exchange(proc_table<handler>::build(procs_)));
+}
+
+void
+rpcs::set_inline(unsigned int proc)
+{
+	// not the reserved procs; a batch, say, may wait
+	VERIFY(proc > rpc_const::cancel);
+	handler *f = proctab_.load(std::memory_order_acquire)->find(proc);
+	VERIFY(f);
+	f->inline_slow = 0;
+	f->inline_ok = true;
+}
+
+bool
+rpcs::is_inline(unsigned int proc)
+{
+	handler *f = proctab_.load(std::memory_order_acquire)->find(proc);
+	return f && f->inline_ok;
 }
 
 void
@@ -447,17 +1451,26 @@ rpcs::updatestat(unsigned int proc)
 		}
 		printf("\n");
 
-		ScopedLock rwl(&reply_window_m_);
-		std::map<unsigned int,std::list<reply_t> >::iterator clt;
-
 		unsigned int totalrep = 0, maxrep = 0;
-		for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
-			totalrep += clt->second.size();
-			if(clt->second.size() > maxrep)
-				maxrep = clt->second.size();
+		for (int i = 0; i < CLIENT_SHARDS; i++) {
+			ScopedLock sl(&clients_[i].m);
+			for (auto &ci : clients_[i].clients) {
+				ScopedLock cml(&ci.second->m);
+				unsigned int n = ci.second->nreplies;
+				totalrep += n;
+				if(n > maxrep)
+					maxrep = n;
+			}
 		}
-		jsl_log(JSL_DBG_1, "REPLY WINDOW: clients %d total reply %d max per client %d\n",
-                        (int) reply_window_.size(), totalrep, maxrep);
+		jsl_log(JSL_DBG_1, "REPLY WINDOW: clients %d total reply %d max per client %d "
+				"bytes %lld evicted %d\n", nclients_.load(), totalrep, maxrep,
+				retained_.load(), evicted_.load());
+
+		rpc_arena_stats_t as;
+		rpc_arena_stats(&as);
+		jsl_log(JSL_DBG_1, "BUFFERS: allocs %llu cached %llu oversized %llu frees %llu "
+				"remote %llu cached bytes %llu arenas %llu\n", as.allocs, as.hits,
+				as.oversized, as.frees, as.remote_frees, as.cached_bytes, as.arenas);
 		curr_counts_ = counting_;
 	}
 }
@@ -466,9 +1479,19 @@ void
 rpcs::dispatch(djob_t *j)
 {
 	connection *c = j->conn;
-	unmarshall req(j->buf, j->sz);
+	char *b = j->buf;
+	int sz = j->sz;
+	long long deadline = j->deadline_us;
 	delete j;
+	serve(c, b, sz, deadline);
+}
 
+// run the request in b, on a dispatch thread or, for an inline proc,
+// on the poll thread; takes over c's reference and b
+void
+rpcs::serve(connection *c, char *b, int sz, long long deadline)
+{
+	unmarshall req(b, sz);
 	req_header h;
 	req.unpack_req_header(&h);
 	int proc = h.proc;
@@ -484,7 +1507,7 @@ rpcs::dispatch(djob_t *j)
 			h.xid, proc, h.xid_rep, h.clt_nonce, h.srv_nonce);
 
 	marshall rep;
-	reply_header rh(h.xid,0);
+	reply_header rh(h.xid, 0, h.clt_nonce, nonce_);
 
 	// is client sending to an old instance of server?
 	if(h.srv_nonce != 0 && h.srv_nonce != nonce_){
@@ -493,56 +1516,42 @@ rpcs::dispatch(djob_t *j)
 				h.srv_nonce, nonce_, h.proc);
 		rh.ret = rpc_const::oldsrv_failure;
 		rep.pack_reply_header(rh);
-		c->send(rep.cstr(),rep.size());
+		send_pdu(c, rep.cstr(), rep.size());
 		return;
 	}
 
-	handler *f;
 	// is RPC proc a registered procedure?
-	{
-		ScopedLock pl(&procs_m_);
-		if(procs_.count(proc) < 1){
-			fprintf(stderr, "rpcs::dispatch: unknown proc %x.\n",
-				proc);
-			c->decref();
-                        VERIFY(0);
-			return;
-		}
-
-		f = procs_[proc];
+	handler *f = proctab_.load(std::memory_order_acquire)->find(proc);
+	if(!f){
+		fprintf(stderr, "rpcs::dispatch: unknown proc %x.\n",
+			proc);
+		c->decref();
+                VERIFY(0);
+		return;
 	}
 
 	rpcs::rpcstate_t stat;
 	char *b1;
 	int sz1;
 
+	client_t *cl = NULL;
 	if(h.clt_nonce){
-		// have i seen this client before?
-		{
-			ScopedLock rwl(&reply_window_m_);
-			// if we don't know about this clt_nonce, create a cleanup object
-			if(reply_window_.find(h.clt_nonce) == reply_window_.end()){
-				VERIFY (reply_window_[h.clt_nonce].size() == 0); // create
-				jsl_log(JSL_DBG_2,
-						"rpcs::dispatch: new client %u xid %d chan %d, total clients %d\n",
-						h.clt_nonce, h.xid, c->channo(), (int)reply_window_.size());
-			}
-		}
+		cl = find_client(h.clt_nonce, true);
 
 		// save the latest good connection to the client
 		{
-			ScopedLock rwl(&conss_m_);
-			if(conns_.find(h.clt_nonce) == conns_.end()){
+			ScopedLock cml(&cl->m);
+			if(!cl->conn){
 				c->incref();
-				conns_[h.clt_nonce] = c;
-			} else if(conns_[h.clt_nonce]->compare(c) < 0){
-				conns_[h.clt_nonce]->decref();
+				cl->conn = c;
+			} else if(cl->conn->compare(c) < 0){
+				cl->conn->decref();
 				c->incref();
-				conns_[h.clt_nonce] = c;
+				cl->conn = c;
 			}
 		}
 
-		stat = checkduplicate_and_update(h.clt_nonce, h.xid,
+		stat = checkduplicate_and_update(cl, h.xid,
                                                  h.xid_rep, &b1, &sz1);
 	} else {
 		// this client does not require at most once logic
@@ -550,195 +1559,556 @@ rpcs::dispatch(djob_t *j)
 	}
 
 	switch (stat){
+		case CANCELLED:
 		case NEW: // new request
 			if(counting_){
 				updatestat(proc);
 			}
 
-			rh.ret = f->fn(req, rep);
+			if (stat == CANCELLED) {
+				// as with an expired one, a late duplicate must find
+				// the reply
+				jsl_log(JSL_DBG_1,
+						"rpcs::dispatch: rpc %u (proc %x) from clt %u cancelled in the queue\n",
+						h.xid, proc, h.clt_nonce);
+				rh.ret = rpc_const::cancel_failure;
+			} else if (deadline && now_us() >= deadline) {
+				// it waited in the queue for longer than its caller
+				// would; the caller will not see this reply, but a
+				// late duplicate will, and must not run it either
+				jsl_log(JSL_DBG_1,
+						"rpcs::dispatch: rpc %u (proc %x) from clt %u expired in the queue\n",
+						h.xid, proc, h.clt_nonce);
+				expired_++;
+				rh.ret = rpc_const::deadline_failure;
+			} else {
+				long long start = PollMgr::on_poll_thread() ? now_us() : 0;
+				if (async_handler *af = f->async()) {
+					// answered when the handler is done with the rpc_reply
+					replies_owed_++;
+					af->afn(req, new rpc_reply(this, c, cl, rh));
+				} else {
+					rh.ret = f->fn(req, rep);
+				}
+				if (PollMgr::on_poll_thread()) {
+					long long took = now_us() - start;
+					if (took <= INLINE_BUDGET_US) {
+						int s = f->inline_slow.load(std::memory_order_relaxed);
+						while (s > 0 && !f->inline_slow.compare_exchange_weak(s, s - 1))
+							;
+					} else if (f->inline_slow.fetch_add(1) + 1 >= INLINE_SLOW_CALLS) {
+						jsl_log(JSL_DBG_1,
+								"rpcs::dispatch: proc %x took %lld us, no longer inline\n",
+								proc, took);
+						f->inline_ok = false;
+					}
+				}
+				if (f->async())
+					break;
+			}
 
 			rep.pack_reply_header(rh);
-			rep.take_buf(&b1,&sz1);
 
 			jsl_log(JSL_DBG_2,
 					"rpcs::dispatch: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
-					sz1, h.xid, proc, rh.ret, h.clt_nonce);
-
-			if(h.clt_nonce > 0){
-				// only record replies for clients that require at-most-once logic
-				add_reply(h.clt_nonce, h.xid, b1, sz1);
-			}
+					rep.size(), h.xid, proc, rh.ret, h.clt_nonce);
 
-			// get the latest connection to the client
-			{
-				ScopedLock rwl(&conss_m_);
-				if(c->isdead() && c != conns_[h.clt_nonce]){
-					c->decref();
-					c = conns_[h.clt_nonce];
-					c->incref();
-				}
-			}
-
-			c->send(b1, sz1);
-			if(h.clt_nonce == 0){
-				// reply is not added to at-most-once window, free it
-				free(b1);
-			}
+			send_reply(c, cl, h.xid, rep);
 			break;
 		case INPROGRESS: // server is working on this request
 			break;
 		case DONE: // duplicate and we still have the response
-			c->send(b1, sz1);
+			send_pdu(c, b1, sz1);
+			rpc_buf_unref(b1);
 			break;
 		case FORGOTTEN: // very old request and we don't have the response anymore
 			jsl_log(JSL_DBG_2, "rpcs::dispatch: very old request %u from %u\n",
 					h.xid, h.clt_nonce);
 			rh.ret = rpc_const::atmostonce_failure;
 			rep.pack_reply_header(rh);
-			c->send(rep.cstr(),rep.size());
+			send_pdu(c, rep.cstr(), rep.size());
 			break;
 	}
 	c->decref();
 }
 
+// send the reply in rep, whose header is packed, and keep it in cl's
+// window if the client wants at-most-once
+void
+rpcs::send_reply(connection *c, client_t *cl, unsigned int xid,
+		marshall &rep)
+{
+	char *b;
+	int sz;
+	rep.take_buf(&b, &sz);
+	c->incref();
+	if(cl){
+		// the window holds its own reference, ours covers the send below
+		rpc_buf_ref(b);
+		add_reply(cl, xid, b, sz);
+
+		// get the latest connection to the client
+		ScopedLock cml(&cl->m);
+		if(c->isdead() && c != cl->conn){
+			c->decref();
+			c = cl->conn;
+			c->incref();
+		}
+	}
+	send_pdu(c, b, sz);
+	rpc_buf_unref(b);
+	c->decref();
+}
+
+void
+rpcs::send_pdu(connection *c, char *b, int sz)
+{
+	if (!PollMgr::on_poll_thread()) {
+		c->send(b, sz);
+		return;
+	}
+	if (c->try_send(b, sz))
+		return;
+	// another send is under way, which a dispatch thread can wait out.
+	// if the pool is full, the client asks again.
+	send_job_t *j = new send_job_t;
+	c->incref();
+	rpc_buf_ref(b);
+	j->c = c;
+	j->b = b;
+	j->sz = sz;
+	if (!dispatchpool_->addObjJob(this, &rpcs::send_later, j)) {
+		rpc_buf_unref(b);
+		c->decref();
+		delete j;
+	}
+}
+
+void
+rpcs::send_later(send_job_t *j)
+{
+	j->c->send(j->b, j->sz);
+	rpc_buf_unref(j->b);
+	j->c->decref();
+	delete j;
+}
+
+void
+rpcs::finish_reply(rpc_reply *t, int ret, marshall &rep)
+{
+	if (t->to_) {
+		t->to_(ret, rep);
+		delete t;
+		replies_owed_--;
+		return;
+	}
+	t->rh_.ret = ret;
+	rep.pack_reply_header(t->rh_);
+	jsl_log(JSL_DBG_2,
+			"rpcs::finish_reply: sending and saving reply of size %d for rpc %u ret %d, clt %u\n",
+			rep.size(), t->rh_.xid, ret, t->rh_.clt_nonce);
+	send_reply(t->c_, t->cl_, t->rh_.xid, rep);
+	t->c_->decref();
+	delete t;
+	replies_owed_--;
+}
+
 // rpcs::dispatch calls this when an RPC request arrives.
 // checks to see if an RPC with xid from clt_nonce has already been received.
 // if not, remembers the request.
 // returns one of:
 //   NEW: never seen this xid before.
 //   INPROGRESS: seen this xid, and still processing it.
-//   DONE: seen this xid, previous reply returned in *b and *sz.
+//   DONE: seen this xid, previous reply returned in *b and *sz, with a
+//         reference the caller must drop.
 //   FORGOTTEN: might have seen this xid, but deleted previous reply.
 rpcs::rpcstate_t
-rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
+rpcs::checkduplicate_and_update(client_t *cl, unsigned int xid,
 		unsigned int xid_rep, char **b, int *sz)
 {
-	ScopedLock rwl(&reply_window_m_);
+	ScopedLock cml(&cl->m);
 
-    remove_received_reply(clt_nonce, xid_rep);
+    remove_received_reply(cl, xid_rep);
 
-    const auto state = try_retrieve_old(clt_nonce, xid, b, sz);
+    const auto state = try_retrieve_old(cl, xid, b, sz);
     if (state != NEW) {
         return state;
     }
 
-    append_new_call(clt_nonce, xid);
+    if (xid - cl->begin >= WINDOW_MAX) {
+        jsl_log(JSL_DBG_1, "rpcs::checkduplicate_and_update: xid %u from clt %u"
+                " too far past %u\n", xid, cl->nonce, cl->begin);
+        return FORGOTTEN;
+    }
+    append_new_call(cl, xid);
 
+	if (cl->cancelled.erase(xid))
+		return CANCELLED;
 	return NEW;
 }
 
-// @pre reply_window_m_ locked
-void rpcs::remove_received_reply(unsigned int clt_nonce, unsigned int xid_rep)
+// the state for clt_nonce, added if create and there is none. the
+// shard's lock is held just for the lookup.
+rpcs::client_t *
+rpcs::find_client(unsigned int clt_nonce, bool create)
 {
-    if (xid_rep < reply_window_begin_[clt_nonce]) {
-        return;
-    }
+	client_shard &s = clients_[clt_nonce % CLIENT_SHARDS];
+	ScopedLock sl(&s.m);
+	std::unordered_map<unsigned int, client_t *>::iterator i =
+		s.clients.find(clt_nonce);
+	if (i != s.clients.end())
+		return i->second;
+	if (!create)
+		return NULL;
+	client_t *cl = new client_t(clt_nonce);
+	s.clients[clt_nonce] = cl;
+	jsl_log(JSL_DBG_2, "rpcs::find_client: new client %u, total clients %d\n",
+			clt_nonce, ++nclients_);
+	return cl;
+}
 
-    reply_window_begin_[clt_nonce] = xid_rep + 1;
-    reply_window_end_[clt_nonce] = std::max(reply_window_end_[clt_nonce], xid_rep + 1);
+// a cancel frame. a request that dispatch has got to is running or
+// done, and there is nothing to save; otherwise it is still queued,
+// or yet to arrive, and need not run.
+void
+rpcs::cancel_req(unsigned int clt_nonce, unsigned int xid)
+{
+	if (!clt_nonce)
+		return;
+	client_t *cl = find_client(clt_nonce, true);
+	ScopedLock cml(&cl->m);
+	if (xid < cl->begin)
+		return;
+	if (cl->find(xid))
+		return;
+	jsl_log(JSL_DBG_2, "rpcs::cancel_req: client: %u, xid: %u\n",
+			clt_nonce, xid);
+	cl->cancelled.insert(xid);
+}
 
-    auto iter = reply_window_.find(clt_nonce);
-    if (iter == reply_window_.end()) {
+// @pre cl->m locked
+void rpcs::remove_received_reply(client_t *cl, unsigned int xid_rep)
+{
+    if (xid_rep < cl->begin) {
         return;
     }
 
-    auto& replies = iter->second;
-    while (!replies.empty()) {
-        if (replies.begin()->xid > xid_rep) {
-            return;
-        }
+    cl->cancelled.erase(cl->cancelled.begin(),
+            cl->cancelled.upper_bound(xid_rep));
 
-        // FIXME: there may be pending send
-        free(replies.begin()->buf);
-        replies.pop_front();
+    // every slot, at most, between the old begin and the new
+    unsigned int n = std::min((size_t) (xid_rep + 1 - cl->begin),
+            cl->window.size());
+    for (unsigned int x = xid_rep + 1 - n; x != xid_rep + 1; x++) {
+        reply_t *r = cl->slot(x);
+        if (!r->used || r->xid > xid_rep) {
+            continue;
+        }
+        // a concurrent resend of this reply holds its own reference
+        release(cl, r);
+        *r = reply_t();
+        cl->nreplies--;
+    }
+    cl->begin = xid_rep + 1;
+    if (log_) {
+        log_->ack(cl->nonce, xid_rep);
     }
 }
 
-// @pre reply_window_m_ locked
-rpcs::rpcstate_t rpcs::try_retrieve_old(const unsigned clt, const unsigned xid, char** bf, int* sz)
+// @pre cl->m locked
+rpcs::rpcstate_t rpcs::try_retrieve_old(client_t *cl, const unsigned xid, char** bf, int* sz)
 {
-    if (xid < reply_window_begin_[clt]) {
+    if (xid < cl->begin) {
         return FORGOTTEN;
     }
 
-    auto iter = reply_window_.find(clt);
-    if (iter == reply_window_.end() || iter->second.empty()) {
-        return NEW;
-    }
-
-    auto replies = iter->second;
-    auto reply_iter = std::find_if(replies.begin(), replies.end(), [xid](reply_t& r){
-        return r.xid == xid;
-    });
-
-    if (reply_iter == replies.end()) {
-        jsl_log(JSL_DBG_2, "newXid(client: %u, xid: %u)\n", clt, xid);
+    reply_t *r = cl->find(xid);
+    if (!r) {
+        jsl_log(JSL_DBG_2, "newXid(xid: %u)\n", xid);
         return NEW;
-    } else if (reply_iter->cb_present) {
-        jsl_log(JSL_DBG_2, "retrieveOld(client: %u, xid: %u): done\n", clt, xid);
-        if (bf) {
-            *bf = reply_iter->buf;
-        }
+    } else if (r->cb_present && !r->buf) {
+        jsl_log(JSL_DBG_2, "retrieveOld(xid: %u): done, reply evicted\n", xid);
+        return FORGOTTEN;
+    } else if (r->cb_present) {
+        jsl_log(JSL_DBG_2, "retrieveOld(xid: %u): done\n", xid);
+        rpc_buf_ref(r->buf);
+        *bf = r->buf;
         if (sz) {
-            *sz = reply_iter->sz;
+            *sz = r->sz;
         }
         return DONE;
     } else {
-        jsl_log(JSL_DBG_2, "retrieveOld(client: %u, xid: %u): inprogress\n", clt, xid);
+        jsl_log(JSL_DBG_2, "retrieveOld(xid: %u): inprogress\n", xid);
         return INPROGRESS;
     }
 }
 
-// @pre reply_window_m_ locked
-void rpcs::append_new_call(const unsigned clt, const unsigned xid)
+// @pre cl->m locked
+void rpcs::append_new_call(client_t *cl, const unsigned xid)
 {
-    if (xid >= reply_window_end_[clt]) {
-        reply_window_end_[clt] = xid + 1;
+    if (xid - cl->begin >= cl->window.size()) {
+        size_t n = cl->window.size();
+        while (xid - cl->begin >= n) {
+            n *= 2;
+        }
+        std::vector<reply_t> w(n);
+        for (const reply_t &r : cl->window) {
+            if (r.used) {
+                w[r.xid & (n - 1)] = r;
+            }
+        }
+        cl->window.swap(w);
     }
 
-    reply_window_[clt].emplace_back(xid);
+    reply_t *r = cl->slot(xid);
+    VERIFY(!r->used);
+    r->xid = xid;
+    r->used = true;
+    cl->nreplies++;
 }
 
 // rpcs::dispatch calls add_reply when it is sending a reply to an RPC,
 // and passes the return value in b and sz.
-// add_reply() should remember b and sz.
+// add_reply() should remember b and sz, taking over one reference to b.
 // free_reply_window() and checkduplicate_and_update is responsible for
-// calling free(b).
+// dropping it.
+void
+rpcs::add_reply(client_t *cl, unsigned int xid, char *b, int sz)
+{
+    {
+        ScopedLock cml(&cl->m);
+
+        reply_t *r = cl->find(xid);
+        if (!r) {
+            // the client gave up on xid, e.g. a hedged call that the hedge
+            // answered, and has moved its xid_rep past it meanwhile
+            jsl_log(JSL_DBG_2, "rpcs::add_reply: xid: %u forgotten\n", xid);
+            rpc_buf_unref(b);
+            return;
+        }
+
+        r->cb_present = true;
+        r->sz = sz;
+        if (sz >= reply_budget_ / 4) {
+            jsl_log(JSL_DBG_1, "rpcs::add_reply: xid: %u reply of %d too big to keep\n",
+                    xid, sz);
+            rpc_buf_unref(b);
+            evicted_++;
+            b = NULL;
+        } else {
+            r->buf = b;
+            retain(cl, r);
+            jsl_log(JSL_DBG_2, "rpcs::add_reply: xid: %u\n", xid);
+        }
+        // before the reply is sent, so a client never sees one the log
+        // has not got
+        if (log_) {
+            log_->reply(cl->nonce, xid, b, sz);
+        }
+    }
+    if (retained_ <= reply_budget_ && !(log_ && log_->full())) {
+        return;
+    }
+    if (!PollMgr::on_poll_thread()) {
+        trim();
+    } else if (!trimming_.exchange(true) &&
+            !dispatchpool_->addObjJob(this, &rpcs::trim_later, 0)) {
+        // the next reply tries again
+        trimming_ = false;
+    }
+}
+
+void
+rpcs::trim()
+{
+	if (retained_ > reply_budget_)
+		evict();
+	if (log_ && log_->full())
+		compact_log();
+}
+
 void
-rpcs::add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz)
+rpcs::trim_later(int)
 {
-	ScopedLock rwl(&reply_window_m_);
+	// first, so a reply added meanwhile queues another
+	trimming_ = false;
+	trim();
+}
 
-    auto iter = reply_window_.find(clt_nonce);
-    VERIFY(iter != reply_window_.end());
+// @pre cl->m locked
+void
+rpcs::retain(client_t *cl, reply_t *r)
+{
+	client_shard &s = clients_[cl->shard];
+	ScopedLock ll(&s.lru_m);
+	retained_t e = { cl, r->xid, retain_seq_++ };
+	r->lru = s.lru.insert(s.lru.end(), e);
+	cl->retained += r->sz;
+	retained_ += r->sz;
+}
 
-    auto& replies = iter->second;
-    auto reply_iter = std::find_if(replies.begin(), replies.end(), [xid](reply_t& r){
-        return r.xid == xid;
-    });
-    VERIFY(reply_iter != replies.end());
+// drop r's buffer, if it still has one. @pre cl->m locked
+void
+rpcs::release(client_t *cl, reply_t *r)
+{
+	if (!r->buf)
+		return;
+	{
+		client_shard &s = clients_[cl->shard];
+		ScopedLock ll(&s.lru_m);
+		s.lru.erase(r->lru);
+		cl->retained -= r->sz;
+		retained_ -= r->sz;
+	}
+	rpc_buf_unref(r->buf);
+	r->buf = NULL;
+}
 
-    reply_iter->cb_present = true;
-    reply_iter->buf = b;
-    reply_iter->sz = sz;
+// drop the oldest replies until under the budget. the shard's lru_m
+// comes before a client's lock here, so the client's is only tried; a
+// busy client is passed over.
+void
+rpcs::evict()
+{
+	int idle = 0;
+	while (retained_ > reply_budget_ && idle < CLIENT_SHARDS) {
+		// the shard whose oldest reply is the oldest of all
+		int oldest = -1;
+		unsigned long long seq = 0;
+		for (int i = 0; i < CLIENT_SHARDS; i++) {
+			ScopedLock ll(&clients_[i].lru_m);
+			if (!clients_[i].lru.empty() &&
+					(oldest < 0 || clients_[i].lru.front().seq < seq)) {
+				oldest = i;
+				seq = clients_[i].lru.front().seq;
+			}
+		}
+		if (oldest < 0)
+			break;
+		client_shard &s = clients_[oldest];
+		char *b = NULL;
+		{
+			ScopedLock ll(&s.lru_m);
+			for (auto i = s.lru.begin(); i != s.lru.end(); ++i) {
+				client_t *cl = i->cl;
+				if (pthread_mutex_trylock(&cl->m) != 0)
+					continue;
+				reply_t *r = cl->find(i->xid);
+				VERIFY(r && r->buf && r->lru == i);
+				jsl_log(JSL_DBG_2, "rpcs::evict: xid: %u, %d bytes\n",
+						r->xid, r->sz);
+				b = r->buf;
+				r->buf = NULL;
+				cl->retained -= r->sz;
+				retained_ -= r->sz;
+				s.lru.erase(i);
+				VERIFY(pthread_mutex_unlock(&cl->m) == 0);
+				break;
+			}
+		}
+		if (b) {
+			rpc_buf_unref(b);
+			evicted_++;
+			idle = 0;
+		} else {
+			idle++;
+		}
+	}
+}
 
-    jsl_log(JSL_DBG_2, "rpcs::add_reply: client: %u, xid: %u\n", clt_nonce, xid);
+long long
+rpcs::retained_bytes(unsigned int clt_nonce)
+{
+	client_t *cl = find_client(clt_nonce, false);
+	if (!cl)
+		return 0;
+	ScopedLock cml(&cl->m);
+	return cl->retained;
 }
 
+// a record of the at-most-once log, as the server that wrote it
+// changed its state. nothing is logged meanwhile.
 void
-rpcs::free_reply_window(void)
+rpcs::replay(const amo_log::rec &e)
+{
+	client_t *cl = find_client(e.clt_nonce, true);
+	ScopedLock cml(&cl->m);
+	switch (e.type) {
+	case amo_log::CLIENT:
+		for (reply_t &r : cl->window)
+			release(cl, &r);
+		cl->window.assign(WINDOW_INIT, reply_t());
+		cl->nreplies = 0;
+		cl->begin = e.xid;
+		break;
+	case amo_log::ACK:
+		remove_received_reply(cl, e.xid);
+		break;
+	case amo_log::REPLY: {
+		if (e.xid < cl->begin)
+			break;
+		reply_t *r = cl->find(e.xid);
+		if (!r) {
+			append_new_call(cl, e.xid);
+			r = cl->find(e.xid);
+		}
+		if (r->cb_present)
+			break;
+		r->cb_present = true;
+		r->sz = e.sz;
+		if (e.buf) {
+			r->buf = rpc_buf_alloc(e.sz);
+			memcpy(r->buf, e.buf, e.sz);
+			retain(cl, r);
+		}
+		break;
+	}
+	}
+}
+
+// every client's window, into the file compaction started. calls
+// still running are logged when they reply.
+void
+rpcs::snapshot_log()
+{
+	for (int i = 0; i < CLIENT_SHARDS; i++) {
+		ScopedLock sl(&clients_[i].m);
+		for (auto &ci : clients_[i].clients) {
+			client_t *cl = ci.second;
+			ScopedLock cml(&cl->m);
+			log_->client(cl->nonce, cl->begin);
+			for (reply_t &r : cl->window) {
+				if (r.used && r.cb_present)
+					log_->reply(cl->nonce, r.xid, r.buf, r.sz);
+			}
+		}
+	}
+	log_->compact_end();
+}
+
+void
+rpcs::compact_log()
 {
-	std::map<unsigned int,std::list<reply_t> >::iterator clt;
-	std::list<reply_t>::iterator it;
+	if (log_ && log_->compact_start())
+		snapshot_log();
+}
 
-	ScopedLock rwl(&reply_window_m_);
-	for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
-		for (it = clt->second.begin(); it != clt->second.end(); it++){
-			free((*it).buf);
+void
+rpcs::free_reply_window(void)
+{
+	for (int i = 0; i < CLIENT_SHARDS; i++) {
+		ScopedLock sl(&clients_[i].m);
+		for (auto &ci : clients_[i].clients) {
+			client_t *cl = ci.second;
+			for (reply_t &r : cl->window)
+				release(cl, &r);
+			if (cl->conn)
+				cl->conn->decref();
+			delete cl;
 		}
-		clt->second.clear();
+		clients_[i].clients.clear();
 	}
-	reply_window_.clear();
+	nclients_ = 0;
 }
 
 // rpc handler
@@ -756,8 +2126,7 @@ marshall::rawbyte(unsigned char x)
 	if(_ind >= _capa){
 		_capa *= 2;
 		VERIFY (_buf != NULL);
-		_buf = (char *)realloc(_buf, _capa);
-		VERIFY(_buf);
+		_buf = rpc_buf_realloc(_buf, _capa);
 	}
 	_buf[_ind++] = x;
 }
@@ -768,13 +2137,83 @@ marshall::rawbytes(const char *p, int n)
 	if((_ind+n) > _capa){
 		_capa = _capa > n? 2*_capa:(_capa+n);
 		VERIFY (_buf != NULL);
-		_buf = (char *)realloc(_buf, _capa);
-		VERIFY(_buf);
+		_buf = rpc_buf_realloc(_buf, _capa);
 	}
 	memcpy(_buf+_ind, p, n);
 	_ind += n;
 }
 
+void
+marshall::reserve(int n)
+{
+	if((_ind+n) > _capa){
+		while ((_ind+n) > _capa)
+			_capa *= 2;
+		VERIFY (_buf != NULL);
+		_buf = rpc_buf_realloc(_buf, _capa);
+	}
+}
+
+void
+marshall::refbytes(const char *p, int n)
+{
+	if (n < MIN_REF_SZ) {
+		rawbytes(p, n);
+		return;
+	}
+	_refs.push_back(bufref(_ind, p, n));
+	_refsz += n;
+}
+
+void
+marshall::flatten()
+{
+	if (_refs.empty())
+		return;
+	int sz = size();
+	char *nb = rpc_buf_alloc(sz);
+	int from = 0, to = 0;
+	for (unsigned i = 0; i < _refs.size(); i++) {
+		memcpy(nb + to, _buf + from, _refs[i].off - from);
+		to += _refs[i].off - from;
+		from = _refs[i].off;
+		memcpy(nb + to, _refs[i].p, _refs[i].n);
+		to += _refs[i].n;
+	}
+	memcpy(nb + to, _buf + from, _ind - from);
+	rpc_buf_unref(_buf);
+	_buf = nb;
+	_capa = rpc_buf_capacity(nb);
+	_ind = sz;
+	_refs.clear();
+	_refsz = 0;
+}
+
+const std::vector<struct iovec> &
+marshall::iov()
+{
+	_iov.clear();
+	struct iovec v;
+	int from = 0;
+	for (unsigned i = 0; i < _refs.size(); i++) {
+		if (_refs[i].off > from) {
+			v.iov_base = _buf + from;
+			v.iov_len = _refs[i].off - from;
+			_iov.push_back(v);
+			from = _refs[i].off;
+		}
+		v.iov_base = (void *) _refs[i].p;
+		v.iov_len = _refs[i].n;
+		_iov.push_back(v);
+	}
+	if (_ind > from) {
+		v.iov_base = _buf + from;
+		v.iov_len = _ind - from;
+		_iov.push_back(v);
+	}
+	return _iov;
+}
+
 marshall &
 operator<<(marshall &m, bool x)
 {
@@ -838,6 +2277,14 @@ operator<<(marshall &m, const std::string &s)
 	return m;
 }
 
+marshall &
+operator<<(marshall &m, const rpc_blob &b)
+{
+	m << (unsigned int) b.n;
+	m.refbytes(b.p, b.n);
+	return m;
+}
+
 marshall &
 operator<<(marshall &m, unsigned long long x)
 {
@@ -868,13 +2315,23 @@ unmarshall::unpack(int *x)
 void
 unmarshall::take_in(unmarshall &another)
 {
-	if(_buf)
-		free(_buf);
+	rpc_buf_unref(_buf);
 	another.take_buf(&_buf, &_sz);
 	_ind = RPC_HEADER_SZ;
 	_ok = _sz >= RPC_HEADER_SZ?true:false;
 }
 
+void
+unmarshall::share(char *b, int sz)
+{
+	rpc_buf_ref(b);
+	rpc_buf_unref(_buf);
+	_buf = b;
+	_sz = sz;
+	_ind = RPC_HEADER_SZ;
+	_ok = _sz >= RPC_HEADER_SZ?true:false;
+}
+
 bool
 unmarshall::okdone()
 {
@@ -987,6 +2444,17 @@ unmarshall::rawbytes(std::string &ss, unsigned int n)
 	}
 }
 
+void
+unmarshall::rawbytes(char *p, unsigned int n)
+{
+	if(n > remaining()){
+		_ok = false;
+	} else {
+		memcpy(p, _buf+_ind, n);
+		_ind += n;
+	}
+}
+
 bool operator<(const sockaddr_in &a, const sockaddr_in &b){
 	return ((a.sin_addr.s_addr < b.sin_addr.s_addr) ||
 			((a.sin_addr.s_addr == b.sin_addr.s_addr) &&
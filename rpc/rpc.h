@@ -7,11 +7,22 @@
 #include <netinet/in.h>
 #include <list>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <future>
 #include <stdio.h>
 
 #include "thr_pool.h"
 #include "marshall.h"
 #include "connection.h"
+#include "calltab.h"
+#include "xidwin.h"
+#include "park.h"
+#include "rtt.h"
+#include "amolog.h"
+#include "proctab.h"
 
 #ifdef DMALLOC
 #include "dmalloc.h"
@@ -20,6 +31,15 @@
 class rpc_const {
 	public:
 		static const unsigned int bind = 1;   // handler number reserved for bind
+		// handler numbers reserved for streaming calls, see stream.h
+		static const unsigned int stream_open = 2;
+		static const unsigned int stream_push = 3;
+		static const unsigned int stream_pull = 4;
+		// handler number reserved for batches, see batch.h
+		static const unsigned int batch = 5;
+		// requests the client has cancelled, see cancel_token. they
+		// carry just a header, and have no reply.
+		static const unsigned int cancel = 6;
 		static const int timeout_failure = -1;
 		static const int unmarshal_args_failure = -2;
 		static const int unmarshal_reply_failure = -3;
@@ -27,70 +47,319 @@ class rpc_const {
 		static const int oldsrv_failure = -5;
 		static const int bind_failure = -6;
 		static const int cancel_failure = -7;
+		static const int stream_failure = -8;
+		static const int batch_failure = -9;
+		static const int deadline_failure = -10;
+		// the client has too many calls in flight to start another
+		static const int busy_failure = -11;
+};
+
+template<class R> class rpc_call;
+class rpcc;
+
+// the connections from this process to one destination. every rpcc
+// that retransmits shares its destination's, so a process with many
+// clients of a server holds a socket or two instead of one each; the
+// clients keep their own nonces, and so their own at-most-once state
+// at the server. replies carry the nonce of their request, which
+// picks the rpcc to hand them to.
+class rpc_dest : public chanmgr {
+	public:
+		// a reference to the rpc_dest for d, or to one of its own
+		// when not shared
+		static rpc_dest *get(const sockaddr_in &d, int lossy, bool shared);
+		void put();
+
+		// send replies for nonce to c; false if another rpcc has it
+		bool add(unsigned int nonce, rpcc *c);
+		// once this returns, no more go to the rpcc that had nonce
+		void remove(unsigned int nonce);
+
+		void get_refconn(connection **ch, bool hedge);
+		// the live connection, with a reference, or NULL: without
+		// connecting, or waiting on a connect under way
+		connection *live_conn();
+		int channo();
+
+		bool got_pdu(connection *c, char *b, int sz);
+		void dead(connection *c);
+
+		// round trips to the destination, sampled by all its rpccs, so
+		// that a new one starts out with their estimate
+		rtt_estimator &rtt() { return rtt_; }
+
+	private:
+		rpc_dest(const sockaddr_in &d, int lossy, bool shared);
+		~rpc_dest();
+
+		sockaddr_in dst_;
+		int lossy_;
+		bool shared_;
+		int refs_;   // under the registry's lock
+
+		connection *chan_;
+		connection *hedge_chan_;   // a second connection, for hedges
+		pthread_mutex_t chan_m_;
+
+		pthread_mutex_t clients_m_;
+		std::map<unsigned int, rpcc *> clients_;
+
+		rtt_estimator rtt_;
+};
+
+// cancels one call, from another thread or a timer: pass it in the
+// call's TO, as in cl->call(proc, a, r, rpcc::to(5000, &tok)). cancel()
+// completes the call with cancel_failure at once, without touching any
+// other, and tells the server, which skips the handler if it has not
+// started it yet. a cancel before the call starts cancels it on sight.
+// a token serves one call at a time; reset() readies it for another.
+// coalesced procs do not coalesce calls that have a token.
+class cancel_token {
+	public:
+		cancel_token();
+		~cancel_token();
+
+		void cancel();
+		bool cancelled();
+		void reset();
+
+	private:
+		friend class rpcc;
+		// the call under way, which cancel() reaches through cl_; false
+		// if cancelled already
+		bool attach(rpcc *cl, unsigned int xid);
+		void detach(rpcc *cl, unsigned int xid);
+
+		pthread_mutex_t m_;
+		bool cancelled_;
+		rpcc *cl_;   // while a call is attached
+		unsigned int xid_;
 };
 
 // rpc client endpoint.
-// manages a xid space per destination socket
+// manages a xid space per destination
 // threaded: multiple threads can be sending RPCs,
-class rpcc : public chanmgr {
+class rpcc {
+
+	private:
+
+	public:
+		struct TO {
+			int to;
+			cancel_token *cancel = NULL;
+		};
+		// completion of call_async1(): the return value and the reply
+		typedef std::function<void(int, unmarshall &)> callback;
 
 	private:
 
 		//manages per rpc info
 		struct caller {
 			caller(unsigned int xxid, unmarshall *un);
-			~caller();
+			virtual ~caller() {}
+
+			// whoever completes the call, with a reply, a timeout or a
+			// cancel, first claims it; only one claim succeeds. the
+			// winner fills in un and intret, then finish()es.
+			bool claim();
+			void finish();
+			bool done() { return state.load(std::memory_order_acquire) & DONE; }
+			// park until done, kicked or the deadline; false unless done
+			bool wait(const struct timespec &deadline);
+			// the connection the request last went out on has died, so
+			// there will be no reply on it: resend now
+			void kick();
+			// whether kick()ed since the last call, which resets it
+			bool kicked() {
+				return state.fetch_and(~KICKED) & KICKED;
+			}
 
 			unsigned int xid;
+			int slot;       // in calls_
 			unmarshall *un;
 			int intret;
-			bool done;
+			bool async;     // an async_caller
+
+			// for rtt samples: when the request first went out, and
+			// whether a copy went out on another connection since, so
+			// that a reply might answer either (Karn's rule)
+			std::atomic<long long> sent_us;
+			std::atomic<bool> ambiguous;
+			// where the request last went out; compared, never
+			// dereferenced
+			std::atomic<connection *> lastch;
+
+			enum { CLAIMED = 1, DONE = 2, WAITING = 4, KICKED = 8 };
+			std::atomic<int> state;
+		};
+
+		// a call_async1() in flight. timers on the poll thread drive its
+		// retransmissions and the rpc executor runs its callback.
+		struct async_caller : public caller {
+			async_caller(marshall *req, callback cb, TO to);
+			~async_caller();
+
+			marshall *req;
+			unmarshall rep;
+			callback cb;
+			struct timespec finaldeadline;
+			int curr_to;           // next retransmission interval
+			int retry_to;          // next interval after a failed send
+			unsigned long timer;   // pending retransmission, under m
+			cancel_token *tok;
 			pthread_mutex_t m;
-			pthread_cond_t c;
+			std::atomic<int> refs;
+		};
+
+		// a proc registered with hedge()
+		struct hedged_proc {
+			hedged_proc(int p) : pct(p), hedges(0) {}
+			int pct;
+			latency_hist lat;   // of whole calls, hedged or not
+			std::atomic<int> hedges;
+		};
+
+		// a call to a coalesced proc, which later identical calls wait
+		// on instead of sending their own
+		struct flight {
+			flight() : done(0), refs(1), ret(0), buf(NULL), sz(0) {}
+			std::atomic<int> done;
+			std::atomic<int> refs;
+			int ret;
+			char *buf;   // the reply, an rpc_buf the waiters share
+			int sz;
 		};
 
-		void get_refconn(connection **ch);
+		int call_wire(unsigned int proc, marshall &req, unmarshall &rep,
+				TO to);
+		int call_shared(unsigned int proc, marshall &req, unmarshall &rep,
+				TO to);
+
+		void get_refconn(connection **ch, bool hedge = false);
 		void update_xid_rep(unsigned int xid);
+		// xid_++, but never 0, which calls_ cannot hold
+		unsigned int next_xid();
+		friend class cancel_token;
+		// complete call xid with cancel_failure. the server is told by
+		// the frame in m, on the connection returned with a reference,
+		// if any, which the caller sends once it holds no lock. there is
+		// none unless one is up already; a cancel never connects.
+		connection *cancel_call(unsigned int xid, marshall &m);
+		bool send_req(caller *ca, connection *ch,
+				const std::vector<struct iovec> &iov);
+
+		void async_send(async_caller *ca);
+		void async_timeout(unsigned int xid);
+		void async_hurry(async_caller *ca);
+		void async_retransmit(async_caller *ca);
+		void async_done(async_caller *ca);
+		void async_complete(async_caller *ca);
+		void async_release(async_caller *ca, bool last);
 
 
 		sockaddr_in dst_;
 		unsigned int clt_nonce_;
-		unsigned int srv_nonce_;
-		bool bind_done_;
-		unsigned int xid_;
+		// from bind() or the first reply, whichever is first; set
+		// before bind_done_
+		std::atomic<unsigned int> srv_nonce_;
+		std::atomic<bool> bind_done_;
+		// an unbound client's first call goes out at once, behind a
+		// bind request that does not wait; calls after it are held
+		// until the bind's reply, so as to carry the server's nonce.
+		// bind_state_ is BIND_BUSY while that bind is out, and callers
+		// park on it; async calls wait in bind_held_.
+		enum { BIND_NONE, BIND_BUSY, BIND_DONE };
+		std::atomic<int> bind_state_;
+		pthread_mutex_t bind_m_;   // protects bind_held_, and BIND_BUSY ending
+		std::vector<async_caller *> bind_held_;
+		// on that bind, which no caller waits out, so that ~rpcc()
+		// can end it
+		cancel_token bind_tok_;
+		bool bind_wait(TO to, const struct timespec &deadline);
+		bool bind_hold(async_caller *ca, TO to);
+		void start_bind(TO to);
+		void bind_release(int state);
+		std::atomic<unsigned int> xid_;
 		int lossytest_;
 		bool retrans_;
 		bool reachable_;
 
-		connection *chan_;
+		rpc_dest *dest_;
 
-		pthread_mutex_t m_; // protect insert/delete to calls[]
-		pthread_mutex_t chan_m_;
+		pthread_mutex_t m_; // for waiting on destroy_wait_c_
+		pthread_mutex_t xid_rep_m_; // serialize xid_rep_window_.mark()
 
-		bool destroy_wait_;
+		std::atomic<bool> destroy_wait_;
 		pthread_cond_t destroy_wait_c_;
 
-		std::map<int, caller *> calls_;
-		std::list<unsigned int> xid_rep_window_;
+		call_table<caller> calls_;
+		xid_window xid_rep_window_;
+		// jobs holding an async_caller, see async_release(). goes down
+		// only under m_.
+		std::atomic<int> async_jobs_;
+
+		// procs given to hedge() and coalesce(); lookups skip the lock
+		// until there are any
+		pthread_mutex_t proc_opts_m_;
+		std::atomic<bool> proc_opts_;
+		std::map<unsigned int, hedged_proc *> hedged_;
+		std::set<unsigned int> coalesced_;
+		hedged_proc *hedged(unsigned int proc);
+		bool coalesced(unsigned int proc);
+
+		pthread_mutex_t flights_m_;
+		std::map<std::string, flight *> flights_;  // by proc and args
+
+		unsigned int xid_rep();
+		void call_gone();
 
 	public:
 
 		rpcc(sockaddr_in d, bool retrans=true);
 		~rpcc();
 
-		struct TO {
-			int to;
-		};
 		static const TO to_max;
 		static const TO to_min;
 		static TO to(int x) { TO t; t.to = x; return t;}
+		static TO to(int x, cancel_token *c) {
+			TO t; t.to = x; t.cancel = c; return t;
+		}
 
 		unsigned int id() { return clt_nonce_; }
+		// the descriptor of the connection calls go out on, -1 if none
+		int channo() { return dest_->channo(); }
 
+		// the current first retransmission timeout, in ms
+		int rto() { return dest_->rtt().rto(); }
+
+		// learn the server's nonce; 0 if the client is bound already.
+		// optional: the first call goes out at once, with a bind request
+		// of its own, and calls after it wait for that. but the first
+		// call, like bind itself, carries no nonce, and a server that
+		// restarts meanwhile will run its retransmissions again.
 		int bind(TO to = to_max);
 
+		// hedge calls to proc, which must be idempotent: if a call has
+		// no reply after the pct'th percentile of proc's latencies, a
+		// second copy goes out on a connection of its own, and the
+		// first reply to either copy completes the call. for procs
+		// such as reads, whose slow calls are mostly slow for reasons
+		// the next attempt will not share. only call() and call1()
+		// hedge.
+		void hedge(unsigned int proc, int pct = 95);
+		// the hedges sent for proc so far
+		int hedges(unsigned int proc);
+
+		// coalesce calls to proc, which must be idempotent: a call made
+		// while one with the same arguments is in flight sends nothing,
+		// and shares that one's result and reply. for reads many
+		// threads make at once. only call() and call1() coalesce.
+		void coalesce(unsigned int proc);
+
 		void set_reachable(bool r) { reachable_ = r; }
 
+		// fail every call, and wait for them to go; see cancel_token
+		// for cancelling just one
 		void cancel();
 
                 int islossy() { return lossytest_ > 0; }
@@ -98,7 +367,48 @@ class rpcc : public chanmgr {
 		int call1(unsigned int proc,
 				marshall &req, unmarshall &rep, TO to);
 
+		// from dest_, for replies to this client and its connections
+		// failing
 		bool got_pdu(connection *c, char *b, int sz);
+		void dead(connection *c);
+
+		// start a call without waiting for it. rpcc takes req, copying in
+		// any referenced bytes, as the caller need not keep an rpc_blob
+		// past the return; it sends req now and retransmits it from
+		// timers. cb runs on the rpc executor
+		// with the return value and the reply once it arrives, the call
+		// times out, or it is cancelled. callbacks share a few threads
+		// and should not block for long.
+		void call_async1(unsigned int proc, marshall *req, callback cb,
+				TO to = to_max);
+
+		template<class R>
+			struct result {
+				result(): ret(0) {}
+				int ret;
+				R r;
+			};
+
+		// typed asynchronous calls, e.g.
+		//   std::future<rpcc::result<int> > f = cl->call_async<int>(23, 7);
+		//   cl->call_async_cb<int>(23, [](int ret, int &r) { ... }, 7);
+		template<class R, class... A>
+			std::future<result<R> > call_async(unsigned int proc, const A &... a);
+		template<class R, class... A>
+			std::future<result<R> > call_async(unsigned int proc, TO to,
+					const A &... a);
+		template<class R, class... A>
+			void call_async_cb(unsigned int proc,
+					std::function<void(int, R &)> cb, const A &... a);
+		template<class R, class... A>
+			void call_async_cb(unsigned int proc, TO to,
+					std::function<void(int, R &)> cb, const A &... a);
+
+		// awaitable calls for coroutines, see coro.h
+		template<class R, class... A>
+			rpc_call<R> co_call(unsigned int proc, const A &... a);
+		template<class R, class... A>
+			rpc_call<R> co_call(unsigned int proc, TO to, const A &... a);
 
 
 		template<class R>
@@ -150,6 +460,61 @@ rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to)
 	return intret;
 }
 
+// unmarshall r from the reply to a successful asynchronous call
+template<class R> int
+unpack_reply(unsigned int proc, int ret, unmarshall &u, R &r)
+{
+	if (ret < 0)
+		return ret;
+	u >> r;
+	if (!u.okdone()) {
+		fprintf(stderr, "rpcc: failed to unmarshall the reply of RPC 0x%x\n",
+				proc);
+		return rpc_const::unmarshal_reply_failure;
+	}
+	return ret;
+}
+
+template<class R, class... A> void
+rpcc::call_async_cb(unsigned int proc, TO to, std::function<void(int, R &)> cb,
+		const A &... a)
+{
+	marshall *m = new marshall;
+	int unused[] = { 0, ((*m << a), 0)... };
+	(void) unused;
+	call_async1(proc, m, [cb, proc](int ret, unmarshall &u) {
+		R r;
+		ret = unpack_reply(proc, ret, u, r);
+		cb(ret, r);
+	}, to);
+}
+
+template<class R, class... A> void
+rpcc::call_async_cb(unsigned int proc, std::function<void(int, R &)> cb,
+		const A &... a)
+{
+	call_async_cb<R>(proc, to_max, cb, a...);
+}
+
+template<class R, class... A> std::future<rpcc::result<R> >
+rpcc::call_async(unsigned int proc, TO to, const A &... a)
+{
+	std::shared_ptr<std::promise<result<R> > > p(new std::promise<result<R> >);
+	call_async_cb<R>(proc, to, [p](int ret, R &r) {
+		result<R> res;
+		res.ret = ret;
+		std::swap(res.r, r);
+		p->set_value(res);
+	}, a...);
+	return p->get_future();
+}
+
+template<class R, class... A> std::future<rpcc::result<R> >
+rpcc::call_async(unsigned int proc, const A &... a)
+{
+	return call_async<R>(proc, to_max, a...);
+}
+
 template<class R> int
 rpcc::call(unsigned int proc, R & r, TO to)
 {
@@ -247,11 +612,37 @@ rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
 
 bool operator<(const sockaddr_in &a, const sockaddr_in &b);
 
+class rpc_stream;
+struct stream_chunk;
+struct stream_job;
+struct batch_call;
+struct batch_reply;
+struct batch_run;
+
+class async_handler;
+class rpc_reply;
+
 class handler {
 	public:
-		handler() { }
+		handler() : inline_ok(false), inline_slow(0) { }
 		virtual ~handler() { }
 		virtual int fn(unmarshall &, marshall &) = 0;
+		virtual async_handler *async() { return NULL; }
+
+		// run on the poll thread; see rpcs::set_inline()
+		std::atomic<bool> inline_ok;
+		// slow inline runs, less fast ones; see INLINE_SLOW_CALLS
+		std::atomic<int> inline_slow;
+};
+
+// a handler that need not answer on the dispatch thread. afn() gets
+// the call's rpc_reply, and the call is answered when that is done,
+// from whatever thread; a call waiting on something holds no thread.
+class async_handler : public handler {
+	public:
+		int fn(unmarshall &, marshall &) { VERIFY(0); return 0; }
+		virtual void afn(unmarshall &args, rpc_reply *reply) = 0;
+		async_handler *async() { return this; }
 };
 
 // rpc server endpoint.
@@ -262,21 +653,34 @@ class rpcs : public chanmgr {
 		INPROGRESS, // duplicate of an RPC we're still processing
 		DONE, // duplicate of an RPC we already replied to (have reply)
 		FORGOTTEN,  // duplicate of an old RPC whose reply we've forgotten
+		CANCELLED,  // new RPC, but the client cancelled it meanwhile
 	} rpcstate_t;
 
 	private:
 
+	struct client_t;
+	// a reply the window holds the buffer of, in its shard's eviction
+	// order
+	struct retained_t {
+		client_t *cl;
+		unsigned int xid;
+		unsigned long long seq;   // order of retaining, across shards
+	};
+
 	struct reply_t {
-		reply_t (unsigned int _xid) {
-			xid = _xid;
+		reply_t () {
+			xid = 0;
+			used = false;
 			cb_present = false;
 			buf = NULL;
 			sz = 0;
 		}
 		unsigned int xid;
+		bool used;       // whether xid is in the window
 		bool cb_present; // whether the reply buffer is valid
-		char *buf;      // the reply buffer
+		char *buf;      // the reply buffer; NULL if evicted
 		int sz;         // the size of reply buffer
+		std::list<retained_t>::iterator lru;   // while buf is set
 	};
 
 	int port_;
@@ -284,25 +688,120 @@ class rpcs : public chanmgr {
 
 	// provide at most once semantics by maintaining a window of replies
 	// per client that that client hasn't acknowledged receiving yet.
-	std::map<unsigned int, std::list<reply_t> > reply_window_;
-    std::map<unsigned int, unsigned> reply_window_begin_;
-    std::map<unsigned int, unsigned> reply_window_end_;
+	// each client's state has a lock of its own, so that requests from
+	// different clients do not contend; it lives as long as rpcs.
+	//
+	// the window is a ring of slots, a power of two of them, with xid's
+	// in slot xid % size. every xid in the window is in [begin, begin +
+	// size), so a lookup is one probe; the ring doubles when a new xid
+	// lands past its end, and so only grows as large as the client's
+	// outstanding calls spread, up to WINDOW_MAX; a request further than
+	// that past begin, which only a corrupt or runaway client sends,
+	// gets atmostonce_failure rather than a slot.
+	enum { WINDOW_INIT = 16, WINDOW_MAX = 1 << 16 };
+	struct client_t {
+		client_t(unsigned int n) : nonce(n), window(WINDOW_INIT), begin(0),
+			nreplies(0), retained(0), shard(n % CLIENT_SHARDS), conn(NULL) {
+			VERIFY(pthread_mutex_init(&m, 0) == 0);
+		}
+		~client_t() { VERIFY(pthread_mutex_destroy(&m) == 0); }
+
+		reply_t *slot(unsigned int xid) {
+			return &window[xid & (window.size() - 1)];
+		}
+		// xid's slot, if xid is in the window
+		reply_t *find(unsigned int xid) {
+			if (xid < begin || xid - begin >= window.size())
+				return NULL;
+			reply_t *r = slot(xid);
+			return r->used && r->xid == xid ? r : NULL;
+		}
+
+		const unsigned int nonce;
+		pthread_mutex_t m;   // protects the rest
+		std::vector<reply_t> window;
+		unsigned int begin;   // xids below have been forgotten
+		int nreplies;         // slots in use
+		long long retained;   // bytes of reply buffers held
+		int shard;
+		// xids cancelled before dispatch got to them, until the
+		// client's xid_rep passes them
+		std::set<unsigned int> cancelled;
+		connection *conn;   // latest connection to the client
+	};
+
+	// clients by nonce, in shards with a lock each, held only to look
+	// a client up
+	enum { CLIENT_SHARDS = 64 };
+	struct client_shard {
+		pthread_mutex_t m;
+		std::unordered_map<unsigned int, client_t *> clients;
+		// the shard's retained replies, oldest first. taken after a
+		// client's lock, or with a trylock of it.
+		pthread_mutex_t lru_m;
+		std::list<retained_t> lru;
+	};
+	client_shard clients_[CLIENT_SHARDS];
+	std::atomic<int> nclients_;
+	client_t *find_client(unsigned int clt_nonce, bool create);
+
+	// the reply buffers all windows hold come to at most about
+	// reply_budget_ bytes. past it, the oldest replies go, leaving their
+	// slots as executed with the reply lost, so a duplicate gets
+	// atmostonce_failure as if forgotten. a reply of a quarter of the
+	// budget or more is never held at all.
+	enum { REPLY_BUDGET = 64 << 20 };
+	std::atomic<long long> reply_budget_;
+	std::atomic<long long> retained_;
+	std::atomic<int> evicted_;
+	std::atomic<unsigned long long> retain_seq_;
+	// @pre cl->m locked
+	void retain(client_t *cl, reply_t *r);
+	void release(client_t *cl, reply_t *r);
+	void evict();
+	// evict() and compact_log() as needed. off the poll thread, as
+	// both may wait on other clients' locks
+	void trim();
+	void trim_later(int);
+	std::atomic<bool> trimming_;   // a trim_later() is queued
+
+	void cancel_req(unsigned int clt_nonce, unsigned int xid);
+
+	// the at-most-once state goes to log_ as well, if there is one;
+	// see amolog.h. a client's records are appended under its lock.
+	amo_log *log_;
+	void replay(const amo_log::rec &e);
+	void snapshot_log();
 
 	void free_reply_window(void);
-	void add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
+	void add_reply(client_t *cl, unsigned int xid, char *b, int sz);
 
-	rpcstate_t checkduplicate_and_update(unsigned int clt_nonce,
+	rpcstate_t checkduplicate_and_update(client_t *cl,
 			unsigned int xid, unsigned int rep_xid,
 			char **b, int *sz);
 
-    void remove_received_reply(unsigned int clt_nonce, unsigned int xid);
-    rpcstate_t try_retrieve_old(unsigned int clt_nonce, unsigned int xid, char** buf, int* sz);
-    void append_new_call(unsigned int clt_nonce, unsigned int xid);
+    void remove_received_reply(client_t *cl, unsigned int xid);
+    rpcstate_t try_retrieve_old(client_t *cl, unsigned int xid, char** buf, int* sz);
+    void append_new_call(client_t *cl, unsigned int xid);
 
 	void updatestat(unsigned int proc);
 
-	// latest connection to the client
-	std::map<unsigned int, connection *> conns_;
+	// replies: with the at-most-once bookkeeping, and to the latest
+	// connection from the client if c has died meanwhile
+	friend class rpc_reply;
+	void send_reply(connection *c, client_t *cl, unsigned int xid,
+			marshall &rep);
+	// send b, to which the caller keeps its reference; without waiting
+	// when on the poll thread
+	void send_pdu(connection *c, char *b, int sz);
+	struct send_job_t {
+		connection *c;
+		char *b;
+		int sz;
+	};
+	void send_later(send_job_t *j);
+	void finish_reply(rpc_reply *t, int ret, marshall &rep);
+	std::atomic<int> replies_owed_;   // rpc_replies not yet done
 
 	// counting
 	const int counting_;
@@ -312,42 +811,127 @@ class rpcs : public chanmgr {
 	int lossytest_;
 	bool reachable_;
 
-	// map proc # to function
+	// map proc # to function. dispatch reads proctab_, which reg1
+	// rebuilds from procs_; replaced tables are kept until the server
+	// goes, as a dispatch thread may still be reading one.
 	std::map<int, handler *> procs_;
+	std::atomic<const proc_table<handler> *> proctab_;
+	std::vector<const proc_table<handler> *> old_proctabs_;
 
 	pthread_mutex_t procs_m_; // protect insert/delete to procs[]
 	pthread_mutex_t count_m_;  //protect modification of counts
-	pthread_mutex_t reply_window_m_; // protect reply window et al
-	pthread_mutex_t conss_m_; // protect conns_
+
+	// streaming calls, see stream.h
+	std::map<unsigned int, std::function<int(rpc_stream &)> > stream_procs_;
+	std::map<unsigned int, std::shared_ptr<rpc_stream> > streams_;
+	unsigned int next_stream_;
+	pthread_mutex_t streams_m_; // protect stream_procs_ and streams_
+
+	std::shared_ptr<rpc_stream> find_stream(unsigned int sid);
+	void abort_streams();
+	// stream handlers run here, apart from dispatch, as they block
+	ThrPool *streampool_;
+	void run_stream(stream_job *j);
+
+	// batches, see batch.h. the dispatch thread starts a batch; a
+	// parallel batch's other workers, and the rest of one in order
+	// after a call that waited, run on batchpool_
+	ThrPool *batchpool_;
+	void batch1(batch_run *b, size_t i);
+	void batch_done1(batch_run *b);
+	void batch_seq(batch_run *b);
+	void batch_par(batch_run *b);
+	void batch_put(batch_run *b);
 
 
 	protected:
 
 	struct djob_t {
-		djob_t (connection *c, char *b, int bsz):buf(b),sz(bsz),conn(c) {}
+		djob_t (connection *c, char *b, int bsz, long long d)
+			:buf(b),sz(bsz),conn(c),deadline_us(d) {}
 		char *buf;
 		int sz;
 		connection *conn;
+		// when the caller stops waiting, on our CLOCK_MONOTONIC; 0 for
+		// never
+		long long deadline_us;
 	};
 	void dispatch(djob_t *);
+	void serve(connection *c, char *b, int sz, long long deadline_us);
 
-	// internal handler registration
-	void reg1(unsigned int proc, handler *);
+	// an inline run longer than this is slow, and an inline handler
+	// goes to the pool once its slow runs outnumber its fast ones by
+	// INLINE_SLOW_CALLS; one page fault or preemption does not do it
+	enum { INLINE_BUDGET_US = 500, INLINE_SLOW_CALLS = 4 };
+
+	// requests dropped because their caller had stopped waiting
+	std::atomic<int> expired_;
 
 	ThrPool* dispatchpool_;
 	tcpsconn* listener_;
 
 	public:
-	rpcs(unsigned int port, int counts=0);
+	// with amo_log, the at-most-once state, and the nonce, outlive the
+	// server: a new one started on the same log carries on with the
+	// clients of the old
+	rpcs(unsigned int port, int counts=0, const char *amo_log=NULL);
 	~rpcs();
 
 	//RPC handler for clients binding
 	int rpcbind(int a, int &r);
 
+	// RPC handlers carrying streaming calls
+	int stream_open(unsigned int proc, unsigned int &sid);
+	void stream_push(rpc_reply *reply, unsigned int sid, unsigned int seq,
+			std::string data, int flags);
+	void stream_pull(rpc_reply *reply, unsigned int sid, unsigned int seq);
+
+	// RPC handler carrying batches; answered with their replies
+	void batch(rpc_reply *reply, unsigned int flags,
+			std::vector<batch_call> calls);
+
 	void set_reachable(bool r) { reachable_ = r; }
 
+	// requests that expired before they could run
+	int expired() { return expired_.load(); }
+
+	// the bytes of replies kept for at-most-once, in all and for one
+	// client, and how many were dropped to stay in the budget
+	void set_reply_budget(long long bytes) { reply_budget_ = bytes; }
+	long long retained_bytes() { return retained_.load(); }
+	long long retained_bytes(unsigned int clt_nonce);
+	int evicted() { return evicted_.load(); }
+
+	// start the at-most-once log over with just the live state; done
+	// when it outgrows amo_log::COMPACT_SZ too
+	void compact_log();
+
 	bool got_pdu(connection *c, char *b, int sz);
 
+	// register a prebuilt handler object, as rpcgen skeletons do.
+	// rpcs owns h from now on.
+	void reg1(unsigned int proc, handler *h);
+
+	// register a streaming handler. each call runs it on a thread kept
+	// for streams, reading the request from and writing the reply to the
+	// rpc_stream. stream procs are numbered apart from the others.
+	template<class S>
+		void reg_stream(unsigned int proc, S*, int (S::*meth)(rpc_stream &));
+	void reg_stream1(unsigned int proc, std::function<int(rpc_stream &)> fn);
+
+	// run proc on the poll thread as its requests arrive, instead of
+	// handing them to a dispatch thread. for handlers that neither
+	// block nor take long: one that takes over INLINE_BUDGET_US once
+	// goes back to the pool for good.
+	void set_inline(unsigned int proc);
+	bool is_inline(unsigned int proc);
+
+	// register an asynchronous handler, which answers through its
+	// rpc_reply, now or later
+	template<class S, class... A>
+		void reg_async(unsigned int proc, S*,
+				void (S::*meth)(rpc_reply *reply, A...));
+
 	// register a handler
 	template<class S, class A1, class R>
 		void reg(unsigned int proc, S*, int (S::*meth)(const A1 a1, R & r));
@@ -377,6 +961,69 @@ class rpcs : public chanmgr {
 						R & r));
 };
 
+// the answer an async handler owes a call. done() sends it, keeping
+// it for at-most-once as dispatch would have, and deletes the
+// rpc_reply. it must be called exactly once, and before the rpcs goes.
+class rpc_reply {
+	public:
+		template<class R> void done(int ret, const R &r) {
+			marshall m;
+			m << r;
+			srv_->finish_reply(this, ret, m);
+		}
+		// with no result, for a failure
+		void done(int ret) {
+			marshall m;
+			srv_->finish_reply(this, ret, m);
+		}
+
+	private:
+		friend class rpcs;
+		rpc_reply(rpcs *srv, connection *c, rpcs::client_t *cl,
+				const reply_header &rh)
+			: srv_(srv), c_(c), cl_(cl), rh_(rh) { c_->incref(); }
+		// for a call in a batch, which takes the answer itself
+		rpc_reply(rpcs *srv, std::function<void(int, marshall &)> to)
+			: srv_(srv), c_(NULL), cl_(NULL), to_(to) { }
+
+		rpcs *srv_;
+		connection *c_;
+		rpcs::client_t *cl_;   // NULL without at-most-once
+		reply_header rh_;
+		std::function<void(int, marshall &)> to_;
+};
+
+template<class S, class... A> void
+rpcs::reg_async(unsigned int proc, S*sob,
+		void (S::*meth)(rpc_reply *reply, A...))
+{
+	class h1 : public async_handler {
+		private:
+			S * sob;
+			void (S::*meth)(rpc_reply *reply, A...);
+		public:
+			h1(S *xsob, void (S::*xmeth)(rpc_reply *reply, A...))
+				: sob(xsob), meth(xmeth) { }
+			void afn(unmarshall &args, rpc_reply *reply) {
+				std::tuple<typename std::decay<A>::type...> a;
+				args >> a;
+				if(!args.okdone()) {
+					reply->done(rpc_const::unmarshal_args_failure);
+					return;
+				}
+				std::apply([this, reply](auto &... x) {
+						(sob->*meth)(reply, x...); }, a);
+			}
+	};
+	reg1(proc, new h1(sob, meth));
+}
+
+template<class S> void
+rpcs::reg_stream(unsigned int proc, S*sob, int (S::*meth)(rpc_stream &))
+{
+	reg_stream1(proc, [sob, meth](rpc_stream &s) { return (sob->*meth)(s); });
+}
+
 template<class S, class A1, class R> void
 rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
 {
@@ -0,0 +1,129 @@
+// latency benchmark for hedged calls.
+//
+// a server whose handler stalls on a few calls at random, as a server
+// does when it pauses for a disk, a page fault or a busy neighbour, and
+// a client that makes calls one after another, first plain and then
+// hedged. prints each run's latency percentiles.
+//
+//   rpc/rpcbench [-n calls] [-s stalls per thousand] [-m stall ms]
+//                [-h hedge percentile]
+
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <algorithm>
+#include <vector>
+#include "jsl_log.h"
+#include "lang/verify.h"
+
+int stall_permille = 20;
+int stall_ms = 20;
+
+class srv {
+	public:
+		int handle_read(const int a, int &r);
+};
+
+int
+srv::handle_read(const int a, int &r)
+{
+	if (random() % 1000 < stall_permille)
+		usleep(stall_ms * 1000);
+	r = a;
+	return 0;
+}
+
+static long long
+now_us()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static void
+run(const char *name, rpcc *c, int n)
+{
+	int r;
+	// warm up connections and, if hedging, the latency histogram
+	for (int i = 0; i < 2 * latency_hist::MIN_SAMPLES; i++)
+		VERIFY(c->call(1000, i, r) == 0);
+
+	std::vector<long long> lat;
+	for (int i = 0; i < n; i++) {
+		long long start = now_us();
+		VERIFY(c->call(1000, i, r) == 0 && r == i);
+		lat.push_back(now_us() - start);
+	}
+	std::sort(lat.begin(), lat.end());
+	printf("%-8s p50 %6lld us  p90 %6lld us  p99 %6lld us  p99.9 %6lld us"
+			"  max %6lld us  hedges %d\n", name,
+			lat[n / 2], lat[n * 9 / 10], lat[n * 99 / 100],
+			lat[n * 999 / 1000], lat[n - 1], c->hedges(1000));
+}
+
+int
+main(int argc, char *argv[])
+{
+	setvbuf(stdout, NULL, _IONBF, 0);
+	int n = 5000;
+	int pct = 95;
+	int port = 20000 + (getpid() % 10000);
+
+	int ch;
+	while ((ch = getopt(argc, argv, "n:s:m:h:p:d:")) != -1) {
+		switch (ch) {
+			case 'n':
+				n = atoi(optarg);
+				break;
+			case 's':
+				stall_permille = atoi(optarg);
+				break;
+			case 'm':
+				stall_ms = atoi(optarg);
+				break;
+			case 'h':
+				pct = atoi(optarg);
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'd':
+				jsl_set_debug(atoi(optarg));
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n calls] [-s stalls per"
+						" thousand] [-m stall ms] [-h hedge percentile]\n",
+						argv[0]);
+				exit(1);
+		}
+	}
+	VERIFY(n >= 1000);
+
+	srv service;
+	rpcs server(port);
+	server.reg(1000, &service, &srv::handle_read);
+
+	sockaddr_in dst;
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_family = AF_INET;
+	dst.sin_addr.s_addr = inet_addr("127.0.0.1");
+	dst.sin_port = htons(port);
+
+	printf("%d calls, %d in 1000 stall %d ms, hedged at p%d\n",
+			n, stall_permille, stall_ms, pct);
+
+	rpcc plain(dst);
+	VERIFY(plain.bind() == 0);
+	run("plain", &plain, n);
+
+	rpcc hedged(dst);
+	VERIFY(hedged.bind() == 0);
+	hedged.hedge(1000, pct);
+	run("hedged", &hedged, n);
+
+	exit(0);
+}
@@ -0,0 +1,526 @@
+// rpcgen: compile a protocol description (.x) into a C++ header with
+// typed client stubs and server skeletons.
+//
+// A protocol file looks like
+//
+//   // lock protocol
+//   protocol lock_protocol {
+//   % enum xxstatus { OK, RETRY, RPCERR, NOENT, IOERR };
+//     typedef unsigned long long lockid_t;
+//     proc acquire = 0x7001 (int clt, lockid_t lid) returns int;
+//     proc release (int clt, lockid_t lid) returns int;
+//   };
+//
+// Lines starting with % are copied verbatim into the protocol class.
+// A proc without "= number" takes the previous number plus one.
+// "async proc" declares one whose server method answers through an
+// rpc_reply instead of returning, e.g.
+//   void acquire(rpc_reply *reply, int clt, lockid_t lid);
+// which calls reply->done(ret, r) with an r of the declared result
+// type, then or later; the client side does not change. "inline proc"
+// declares one that neither blocks nor takes long, which reg() sets to
+// run on the server's poll thread (see rpcs::set_inline()); it may be
+// async too.
+//
+// For every proc the generated class gets
+//   - an enum value with the proc number, so existing rpcc::call() and
+//     rpcs::reg() users keep working;
+//   - a method of the nested client class that marshalls exactly the
+//     declared argument types, so a wrong argument is a compile error
+//     instead of a VERIFY(0) in rpcc::call_m();
+//   - a handler template registered by reg(), which decodes the declared
+//     arguments and calls S::proc through a member pointer of exactly the
+//     declared type, so a server with the wrong signature does not compile;
+//     for an async proc, an async_handler.
+// Runs of fixed-size arguments are encoded and decoded at constant offsets
+// behind a single bounds check.
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+struct type_t {
+	std::string cxx;  // spelling in the generated code
+	int fixed;        // wire size, 0 if variable
+};
+
+struct param_t {
+	std::string type;
+	std::string name;
+};
+
+struct proc_t {
+	std::string name;
+	unsigned long num;
+	std::vector<param_t> args;
+	std::string rep;
+	bool async;
+	bool inl;
+};
+
+static const char *infile;
+static std::string src;
+static size_t pos;
+static int line = 1;
+
+static std::string proto;
+static std::vector<std::string> body;   // verbatim and typedef lines, in order
+static std::vector<proc_t> procs;
+static std::map<std::string, type_t> types;
+
+static void
+die(const char *msg, const std::string &what = "")
+{
+	fprintf(stderr, "%s:%d: %s%s%s\n", infile, line, msg,
+			what.empty() ? "" : " ", what.c_str());
+	exit(1);
+}
+
+static void
+skip_space()
+{
+	while (pos < src.size()) {
+		char c = src[pos];
+		if (c == '\n') {
+			line++;
+			pos++;
+		} else if (isspace((unsigned char) c)) {
+			pos++;
+		} else if (src.compare(pos, 2, "//") == 0) {
+			while (pos < src.size() && src[pos] != '\n')
+				pos++;
+		} else if (src.compare(pos, 2, "/*") == 0) {
+			size_t e = src.find("*/", pos + 2);
+			if (e == std::string::npos)
+				die("unterminated comment");
+			for (; pos < e + 2; pos++)
+				if (src[pos] == '\n')
+					line++;
+		} else if (c == '%') {
+			size_t e = src.find('\n', pos);
+			if (e == std::string::npos)
+				e = src.size();
+			size_t b = pos + 1;
+			while (b < e && isspace((unsigned char) src[b]))
+				b++;
+			body.push_back("  " + src.substr(b, e - b));
+			pos = e;
+		} else {
+			break;
+		}
+	}
+}
+
+// next token: an identifier, a number or a single punctuation character
+static std::string
+next()
+{
+	skip_space();
+	if (pos >= src.size())
+		return "";
+	size_t b = pos;
+	if (isalnum((unsigned char) src[pos]) || src[pos] == '_') {
+		while (pos < src.size() &&
+				(isalnum((unsigned char) src[pos]) || src[pos] == '_'))
+			pos++;
+	} else {
+		pos++;
+	}
+	return src.substr(b, pos - b);
+}
+
+static std::string
+peek()
+{
+	size_t p = pos;
+	int l = line;
+	size_t nbody = body.size();
+	std::string t = next();
+	pos = p;
+	line = l;
+	body.resize(nbody);
+	return t;
+}
+
+static void
+expect(const std::string &t)
+{
+	std::string got = next();
+	if (got != t)
+		die(("expected '" + t + "' but got").c_str(), "'" + got + "'");
+}
+
+static bool
+is_ident(const std::string &t)
+{
+	return !t.empty() && (isalpha((unsigned char) t[0]) || t[0] == '_');
+}
+
+// a type is one or more identifiers, e.g. "unsigned long long"
+static std::string
+parse_type(const std::string &first)
+{
+	std::string t = first;
+	while (types.find(t) == types.end()) {
+		std::string w = peek();
+		if (!is_ident(w))
+			die("unknown type", t);
+		t += " " + next();
+	}
+	return t;
+}
+
+static void
+parse_typedef()
+{
+	std::string t = parse_type(next());
+	std::string name = next();
+	if (!is_ident(name))
+		die("bad typedef name", name);
+	expect(";");
+	types[name] = types[t];
+	types[name].cxx = name;
+	body.push_back("  typedef " + types[t].cxx + " " + name + ";");
+}
+
+static void
+parse_proc(unsigned long *num, bool async, bool inl)
+{
+	proc_t p;
+	p.async = async;
+	p.inl = inl;
+	p.name = next();
+	if (!is_ident(p.name))
+		die("bad proc name", p.name);
+	std::string t = next();
+	if (t == "=") {
+		std::string n = next();
+		char *end;
+		*num = strtoul(n.c_str(), &end, 0);
+		if (n.empty() || *end)
+			die("bad proc number", n);
+		t = next();
+	} else if (procs.empty()) {
+		die("first proc needs a number:", p.name);
+	}
+	p.num = (*num)++;
+	if (t != "(")
+		die("expected '(' after proc", p.name);
+	if (peek() == ")") {
+		next();
+	} else {
+		for (;;) {
+			param_t a;
+			std::string w = next();
+			// the last identifier before ',' or ')' is the name
+			std::string words = w;
+			for (;;) {
+				std::string n = peek();
+				if (n == "," || n == ")")
+					break;
+				words += " " + next();
+			}
+			size_t sp = words.rfind(' ');
+			if (sp == std::string::npos)
+				die("argument needs a type and a name:", words);
+			a.name = words.substr(sp + 1);
+			a.type = words.substr(0, sp);
+			if (types.find(a.type) == types.end())
+				die("unknown type", a.type);
+			p.args.push_back(a);
+			t = next();
+			if (t == ")")
+				break;
+			if (t != ",")
+				die("expected ',' or ')' in", p.name);
+		}
+	}
+	expect("returns");
+	p.rep = parse_type(next());
+	expect(";");
+	procs.push_back(p);
+}
+
+static void
+parse()
+{
+	expect("protocol");
+	proto = next();
+	if (!is_ident(proto))
+		die("bad protocol name", proto);
+	expect("{");
+	unsigned long num = 0;
+	for (;;) {
+		std::string t = next();
+		bool async = false, inl = false;
+		for (; t == "async" || t == "inline"; t = next()) {
+			if (t == "async")
+				async = true;
+			else
+				inl = true;
+		}
+		if ((async || inl) && t != "proc")
+			die("expected 'proc' but got", "'" + t + "'");
+		if (t == "}")
+			break;
+		else if (t == "typedef")
+			parse_typedef();
+		else if (t == "proc")
+			parse_proc(&num, async, inl);
+		else
+			die("unexpected", "'" + t + "'");
+	}
+	expect(";");
+	if (!next().empty())
+		die("trailing input after protocol");
+}
+
+static std::string
+cxx(const std::string &t)
+{
+	return types[t].cxx;
+}
+
+static std::string
+arg_decl(const param_t &a)
+{
+	if (types[a.type].fixed)
+		return cxx(a.type) + " " + a.name;
+	return "const " + cxx(a.type) + " &" + a.name;
+}
+
+static void
+emit_client(FILE *f, const proc_t &p)
+{
+	fprintf(f, "inline void\n%s::client::%s_args(marshall &m", proto.c_str(),
+			p.name.c_str());
+	for (size_t i = 0; i < p.args.size(); i++)
+		fprintf(f, ", %s", arg_decl(p.args[i]).c_str());
+	fprintf(f, ")\n{\n");
+	size_t i = 0;
+	while (i < p.args.size()) {
+		size_t j = i;
+		int off = 0;
+		while (j < p.args.size() && types[p.args[j].type].fixed)
+			off += types[p.args[j++].type].fixed;
+		if (j > i) {
+			fprintf(f, "  {\n    char *p = m.extend(%d);\n", off);
+			off = 0;
+			for (; i < j; i++) {
+				fprintf(f, "    marshall_put(p + %d, %s);\n", off,
+						p.args[i].name.c_str());
+				off += types[p.args[i].type].fixed;
+			}
+			fprintf(f, "  }\n");
+		} else {
+			fprintf(f, "  m << %s;\n", p.args[i++].name.c_str());
+		}
+	}
+	fprintf(f, "}\n\n");
+
+	fprintf(f, "inline int\n%s::client::%s(", proto.c_str(), p.name.c_str());
+	for (size_t i = 0; i < p.args.size(); i++)
+		fprintf(f, "%s, ", arg_decl(p.args[i]).c_str());
+	fprintf(f, "%s &r, rpcc::TO to)\n{\n  marshall m;\n", cxx(p.rep).c_str());
+	fprintf(f, "  %s_args(m", p.name.c_str());
+	for (size_t i = 0; i < p.args.size(); i++)
+		fprintf(f, ", %s", p.args[i].name.c_str());
+	fprintf(f, ");\n  return cl_->call_m(%s::%s, m, r, to);\n}\n\n",
+			proto.c_str(), p.name.c_str());
+
+	fprintf(f, "inline rpc_call<%s>\n%s::client::co_%s(", cxx(p.rep).c_str(),
+			proto.c_str(), p.name.c_str());
+	for (size_t i = 0; i < p.args.size(); i++)
+		fprintf(f, "%s, ", arg_decl(p.args[i]).c_str());
+	fprintf(f, "rpcc::TO to)\n{\n  marshall *m = new marshall;\n");
+	fprintf(f, "  %s_args(*m", p.name.c_str());
+	for (size_t i = 0; i < p.args.size(); i++)
+		fprintf(f, ", %s", p.args[i].name.c_str());
+	fprintf(f, ");\n  return rpc_call<%s>(cl_, %s::%s, m, to);\n}\n\n",
+			cxx(p.rep).c_str(), proto.c_str(), p.name.c_str());
+}
+
+static void
+emit_skel(FILE *f, const proc_t &p)
+{
+	// an async proc's failures go back through the rpc_reply
+	const char *fail = p.async ?
+		" {\n          reply->done(rpc_const::unmarshal_args_failure);\n          return;\n        }" :
+		"\n          return rpc_const::unmarshal_args_failure;";
+	fprintf(f, "  template<class S>\n  class %s_skel : public %s {\n",
+			p.name.c_str(), p.async ? "async_handler" : "handler");
+	fprintf(f, "   public:\n    explicit %s_skel(S *s) : s_(s) {}\n",
+			p.name.c_str());
+	if (p.async) {
+		fprintf(f, "    void afn(unmarshall &args, rpc_reply *reply) {\n");
+		fprintf(f, "      void (S::*m)(rpc_reply *");
+		for (size_t i = 0; i < p.args.size(); i++)
+			fprintf(f, ", %s", cxx(p.args[i].type).c_str());
+		fprintf(f, ") = &S::%s;\n", p.name.c_str());
+	} else {
+		fprintf(f, "    int fn(unmarshall &args, marshall &ret) {\n");
+		fprintf(f, "      int (S::*m)(");
+		for (size_t i = 0; i < p.args.size(); i++)
+			fprintf(f, "%s, ", cxx(p.args[i].type).c_str());
+		fprintf(f, "%s &) = &S::%s;\n", cxx(p.rep).c_str(), p.name.c_str());
+	}
+	for (size_t i = 0; i < p.args.size(); i++)
+		fprintf(f, "      %s %s;\n", cxx(p.args[i].type).c_str(),
+				p.args[i].name.c_str());
+	size_t i = 0;
+	while (i < p.args.size()) {
+		size_t j = i;
+		int len = 0;
+		while (j < p.args.size() && types[p.args[j].type].fixed)
+			len += types[p.args[j++].type].fixed;
+		if (j > i) {
+			fprintf(f, "      {\n        const char *p = args.fetch(%d);\n", len);
+			fprintf(f, "        if (!p)%s\n", fail);
+			int off = 0;
+			for (; i < j; i++) {
+				fprintf(f, "        marshall_get(p + %d, &%s);\n", off,
+						p.args[i].name.c_str());
+				off += types[p.args[i].type].fixed;
+			}
+			fprintf(f, "      }\n");
+		} else {
+			fprintf(f, "      args >> %s;\n", p.args[i++].name.c_str());
+		}
+	}
+	if (p.async) {
+		fprintf(f, "      if (!args.okdone()) {\n        reply->done(rpc_const::unmarshal_args_failure);\n        return;\n      }\n");
+		fprintf(f, "      (s_->*m)(reply");
+		for (size_t i = 0; i < p.args.size(); i++)
+			fprintf(f, ", %s", p.args[i].name.c_str());
+		fprintf(f, ");\n    }\n");
+	} else {
+		fprintf(f, "      if (!args.okdone())\n        return rpc_const::unmarshal_args_failure;\n");
+		fprintf(f, "      %s r;\n      int b = (s_->*m)(", cxx(p.rep).c_str());
+		for (size_t i = 0; i < p.args.size(); i++)
+			fprintf(f, "%s, ", p.args[i].name.c_str());
+		fprintf(f, "r);\n      ret << r;\n      return b;\n    }\n");
+	}
+	fprintf(f, "   private:\n    S *s_;\n  };\n\n");
+}
+
+static void
+emit(FILE *f)
+{
+	fprintf(f, "// generated by rpcgen from %s; do not edit.\n\n", infile);
+	fprintf(f, "#ifndef %s_h\n#define %s_h\n\n", proto.c_str(), proto.c_str());
+	fprintf(f, "#include \"rpc.h\"\n#include \"coro.h\"\n\n");
+	fprintf(f, "class %s {\n public:\n", proto.c_str());
+	for (size_t i = 0; i < body.size(); i++)
+		fprintf(f, "%s\n", body[i].c_str());
+	fprintf(f, "\n  enum rpc_numbers {\n");
+	for (size_t i = 0; i < procs.size(); i++)
+		fprintf(f, "    %s = 0x%lx,\n", procs[i].name.c_str(), procs[i].num);
+	fprintf(f, "  };\n\n");
+
+	fprintf(f, "  // typed client stubs\n  class client {\n   public:\n");
+	fprintf(f, "    explicit client(rpcc *cl = NULL) : cl_(cl) {}\n");
+	for (size_t i = 0; i < procs.size(); i++) {
+		const proc_t &p = procs[i];
+		fprintf(f, "    int %s(", p.name.c_str());
+		for (size_t j = 0; j < p.args.size(); j++)
+			fprintf(f, "%s, ", arg_decl(p.args[j]).c_str());
+		fprintf(f, "%s &r, rpcc::TO to = rpcc::to_max);\n", cxx(p.rep).c_str());
+	}
+	fprintf(f, "    // for coroutines: co_await yields an rpcc::result\n");
+	for (size_t i = 0; i < procs.size(); i++) {
+		const proc_t &p = procs[i];
+		fprintf(f, "    rpc_call<%s> co_%s(", cxx(p.rep).c_str(), p.name.c_str());
+		for (size_t j = 0; j < p.args.size(); j++)
+			fprintf(f, "%s, ", arg_decl(p.args[j]).c_str());
+		fprintf(f, "rpcc::TO to = rpcc::to_max);\n");
+	}
+	fprintf(f, "   private:\n");
+	for (size_t i = 0; i < procs.size(); i++) {
+		const proc_t &p = procs[i];
+		fprintf(f, "    static void %s_args(marshall &m", p.name.c_str());
+		for (size_t j = 0; j < p.args.size(); j++)
+			fprintf(f, ", %s", arg_decl(p.args[j]).c_str());
+		fprintf(f, ");\n");
+	}
+	fprintf(f, "    rpcc *cl_;\n  };\n\n");
+
+	fprintf(f, "  // server skeletons\n");
+	for (size_t i = 0; i < procs.size(); i++)
+		emit_skel(f, procs[i]);
+	fprintf(f, "  // register every proc of the protocol, implemented by s\n");
+	fprintf(f, "  template<class S>\n  static void reg(rpcs *server, S *s) {\n");
+	for (size_t i = 0; i < procs.size(); i++) {
+		fprintf(f, "    server->reg1(%s, new %s_skel<S>(s));\n",
+				procs[i].name.c_str(), procs[i].name.c_str());
+		if (procs[i].inl)
+			fprintf(f, "    server->set_inline(%s);\n", procs[i].name.c_str());
+	}
+	fprintf(f, "  }\n};\n\n");
+
+	for (size_t i = 0; i < procs.size(); i++)
+		emit_client(f, procs[i]);
+	fprintf(f, "#endif\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *outfile = NULL;
+	if (argc == 4 && strcmp(argv[2], "-o") == 0) {
+		outfile = argv[3];
+	} else if (argc != 2) {
+		fprintf(stderr, "Usage: %s protocol.x [-o header.h]\n", argv[0]);
+		exit(1);
+	}
+	infile = argv[1];
+
+	FILE *in = fopen(infile, "r");
+	if (!in) {
+		perror(infile);
+		exit(1);
+	}
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+		src.append(buf, n);
+	fclose(in);
+
+	const char *builtin[][2] = {
+		{ "bool", "1" }, { "char", "1" }, { "unsigned char", "1" },
+		{ "short", "2" }, { "unsigned short", "2" },
+		{ "int", "4" }, { "unsigned int", "4" },
+		{ "unsigned long long", "8" }, { "string", "0" },
+	};
+	for (size_t i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++) {
+		type_t t;
+		t.cxx = strcmp(builtin[i][0], "string") ? builtin[i][0] : "std::string";
+		t.fixed = atoi(builtin[i][1]);
+		types[builtin[i][0]] = t;
+	}
+
+	parse();
+
+	FILE *f = stdout;
+	std::string tmp;
+	if (outfile) {
+		// write aside and rename, so a failed run leaves no stale header
+		tmp = std::string(outfile) + ".tmp";
+		f = fopen(tmp.c_str(), "w");
+		if (!f) {
+			perror(tmp.c_str());
+			exit(1);
+		}
+	}
+	emit(f);
+	if (outfile) {
+		if (fclose(f) != 0 || rename(tmp.c_str(), outfile) != 0) {
+			perror(outfile);
+			exit(1);
+		}
+	}
+	return 0;
+}
@@ -2,11 +2,15 @@
 // generates print statements on failures, but eventually says "rpctest OK"
 
 #include "rpc.h"
+#include "stream.h"
+#include "coro.h"
+#include "batch.h"
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <fcntl.h>
 #include "jsl_log.h"
 #include "gettime.h"
 #include "lang/verify.h"
@@ -28,8 +32,26 @@ class srv {
 		int handle_fast(const int a, int &r);
 		int handle_slow(const int a, int &r);
 		int handle_bigrep(const int a, std::string &r);
+		int handle_stream(rpc_stream &s);
+		int handle_count(const int a, int &r);
+		int handle_sleep(const int ms, int &r);
+		int handle_stall(const int a, int &r);
+		void handle_park(rpc_reply *reply, const int a);
+
+		// answer the parked calls with a + add
+		void unpark(int add);
+		int parked();
+
+		srv() { VERIFY(pthread_mutex_init(&park_m, 0) == 0); }
+	private:
+		pthread_mutex_t park_m;
+		std::vector<std::pair<rpc_reply *, int> > parked_;
 };
 
+std::atomic<int> counted;  // sum of handle_count() arguments
+std::atomic<int> stall_next;  // ms the next handle_stall() takes
+std::atomic<int> sleeps;  // handle_sleep() calls
+
 // a handler. a and b are arguments, r is the result.
 // there can be multiple arguments but only one result.
 // the caller also gets to see the int return value
@@ -66,22 +88,103 @@ srv::handle_bigrep(const int len, std::string &r)
 	return 0;
 }
 
+int
+srv::handle_count(const int a, int &r)
+{
+	r = counted += a;
+	return 0;
+}
+
+int
+srv::handle_sleep(const int ms, int &r)
+{
+	sleeps++;
+	usleep(ms * 1000);
+	r = ms;
+	return 0;
+}
+
+// fast, except for the one call after stall_next is set
+int
+srv::handle_stall(const int a, int &r)
+{
+	int ms = stall_next.exchange(0);
+	if (ms)
+		usleep(ms * 1000);
+	r = a + 3;
+	return 0;
+}
+
+// an async handler: answered when unpark() is called
+void
+srv::handle_park(rpc_reply *reply, const int a)
+{
+	ScopedLock pl(&park_m);
+	parked_.push_back(std::make_pair(reply, a));
+}
+
+void
+srv::unpark(int add)
+{
+	std::vector<std::pair<rpc_reply *, int> > p;
+	{
+		ScopedLock pl(&park_m);
+		p.swap(parked_);
+	}
+	for (auto &c : p)
+		c.first->done(0, c.second + add);
+}
+
+int
+srv::parked()
+{
+	ScopedLock pl(&park_m);
+	return parked_.size();
+}
+
+// a streaming handler: checks a request of bytes i % 251, then replies
+// with as many bytes of i % 253. returns the request size in KB.
+int
+srv::handle_stream(rpc_stream &s)
+{
+	std::string chunk;
+	long long n = 0;
+	while (s.read(chunk)) {
+		for (size_t i = 0; i < chunk.size(); i++, n++)
+			VERIFY((unsigned char) chunk[i] == n % 251);
+	}
+	std::string out;
+	for (long long i = 0; i < n; i += out.size()) {
+		out.resize(std::min(n - i, 100000LL));
+		for (size_t j = 0; j < out.size(); j++)
+			out[j] = (i + j) % 253;
+		if (!s.write(out))
+			return -1;
+	}
+	return n / 1024;
+}
+
 srv service;
 
-void startserver()
+void startserver(const char *amo_log = NULL)
 {
-	server = new rpcs(port);
+	server = new rpcs(port, 0, amo_log);
 	server->reg(22, &service, &srv::handle_22);
 	server->reg(23, &service, &srv::handle_fast);
 	server->reg(24, &service, &srv::handle_slow);
 	server->reg(25, &service, &srv::handle_bigrep);
+	server->reg_stream(26, &service, &srv::handle_stream);
+	server->reg(27, &service, &srv::handle_count);
+	server->reg(28, &service, &srv::handle_sleep);
+	server->reg(29, &service, &srv::handle_stall);
+	server->reg_async(30, &service, &srv::handle_park);
 }
 
 void
 testmarshall()
 {
 	marshall m;
-	req_header rh(1,2,3,4,5);
+	req_header rh(1,2,3,4,5,6);
 	m.pack_req_header(rh);
 	VERIFY(m.size()==RPC_HEADER_SZ);
 	int i = 12345;
@@ -110,6 +213,405 @@ testmarshall()
 	VERIFY(i1==i && l1==l && s1==s);
 }
 
+enum color { red, green = 300, blue = 70000 };
+
+struct point {
+	int x;
+	std::string label;
+	std::vector<unsigned long long> ids;
+	MARSHALL_FIELDS(x, label, ids)
+};
+
+void
+testmarshall_containers()
+{
+	std::vector<int> v;
+	for (int i = 0; i < 1000; i++)
+		v.push_back(i * 7 - 500);
+	std::vector<char> bytes(5000, 'q');
+	std::list<std::string> l;
+	l.push_back("a");
+	l.push_back("bb");
+	std::set<unsigned int> s;
+	s.insert(3);
+	s.insert(1);
+	std::map<std::string, int> mp;
+	mp["one"] = 1;
+	mp["two"] = 2;
+	std::unordered_map<unsigned long long, std::string> um;
+	um[1ULL << 40] = "big";
+	um[7] = "small";
+	std::pair<int, std::string> pr(42, "pair");
+	std::tuple<char, short, std::string> tp('c', -3, "tuple");
+	std::array<int, 3> ar = {{ 1, -2, 3 }};
+	color c = blue;
+	point pt;
+	pt.x = -9;
+	pt.label = "pt";
+	pt.ids.push_back(11);
+	pt.ids.push_back(1ULL << 63);
+
+	marshall m;
+	m << v << bytes << l << s << mp << um << pr << tp << ar << c << pt;
+	char *b;
+	int sz;
+	m.take_buf(&b, &sz);
+
+	unmarshall un(b, sz);
+	req_header rh;
+	un.unpack_req_header(&rh);
+	std::vector<int> v1;
+	std::vector<char> bytes1;
+	std::list<std::string> l1;
+	std::set<unsigned int> s1;
+	std::map<std::string, int> mp1;
+	std::unordered_map<unsigned long long, std::string> um1;
+	std::pair<int, std::string> pr1;
+	std::tuple<char, short, std::string> tp1;
+	std::array<int, 3> ar1;
+	color c1 = red;
+	point pt1;
+	un >> v1 >> bytes1 >> l1 >> s1 >> mp1 >> um1 >> pr1 >> tp1 >> ar1 >> c1 >> pt1;
+	VERIFY(un.okdone());
+	VERIFY(v1 == v && bytes1 == bytes && l1 == l && s1 == s);
+	VERIFY(mp1 == mp && um1 == um && pr1 == pr && tp1 == tp && ar1 == ar);
+	VERIFY(c1 == blue);
+	VERIFY(pt1.x == pt.x && pt1.label == pt.label && pt1.ids == pt.ids);
+
+	// a count that claims more elements than the packet holds must fail
+	// cleanly instead of reserving gigabytes
+	marshall bad;
+	bad << (unsigned int) 0x7fffffff;
+	bad << 1;
+	bad.take_buf(&b, &sz);
+	unmarshall badun(b, sz);
+	badun.unpack_req_header(&rh);
+	std::vector<int> v2;
+	badun >> v2;
+	VERIFY(!badun.ok());
+
+	// large blobs are referenced, small ones copied, and either way
+	// they look like strings on the wire
+	std::string blob(10000, 'b');
+	marshall gm;
+	gm << rpc_blob("tiny", 4);
+	gm << rpc_blob(blob);
+	gm << 7;
+	VERIFY(gm.nrefs() == 1);
+	VERIFY(gm.size() == RPC_HEADER_SZ + 4 + 4 + 4 + (int) blob.size() + 4);
+	const std::vector<struct iovec> &iov = gm.iov();
+	VERIFY(iov.size() == 3 && iov[1].iov_base == blob.data());
+	gm.take_buf(&b, &sz);
+	VERIFY(sz == RPC_HEADER_SZ + 4 + 4 + 4 + (int) blob.size() + 4);
+	unmarshall gun(b, sz);
+	gun.unpack_req_header(&rh);
+	std::string t1, t2;
+	int seven;
+	gun >> t1 >> t2 >> seven;
+	VERIFY(gun.okdone() && t1 == "tiny" && t2 == blob && seven == 7);
+	printf("marshall containers .. ok\n");
+}
+
+void *
+arena_release(void *xx)
+{
+	rpc_buf_unref((char *) xx);
+	return 0;
+}
+
+// allocates once the thread's arena is gone: built before the arena,
+// it is destroyed after it
+struct late_alloc {
+	~late_alloc() {
+		char *b = rpc_buf_alloc(100);
+		memset(b, 1, 100);
+		b = rpc_buf_realloc(b, 200);
+		rpc_buf_unref(b);
+	}
+};
+
+void *
+arena_late(void *)
+{
+	static thread_local late_alloc la;
+	(void) &la;
+	rpc_buf_unref(rpc_buf_alloc(100));
+	return 0;
+}
+
+void
+testarena()
+{
+	rpc_arena_stats_t before, after;
+	rpc_arena_stats(&before);
+
+	// a released buffer is reused by the next allocation of its class
+	char *b = rpc_buf_alloc(600);
+	VERIFY(rpc_buf_capacity(b) >= 600);
+	rpc_buf_unref(b);
+	char *b2 = rpc_buf_alloc(1000);
+	VERIFY(b2 == b);
+
+	// an extra reference keeps it alive
+	rpc_buf_ref(b2);
+	rpc_buf_unref(b2);
+	memset(b2, 1, 1000);
+
+	// growing keeps the contents
+	b2 = rpc_buf_realloc(b2, 5000);
+	VERIFY(rpc_buf_capacity(b2) >= 5000 && b2[999] == 1);
+
+	// released by another thread, it goes back to this thread's arena
+	pthread_t th;
+	VERIFY(pthread_create(&th, NULL, arena_release, (void *) b2) == 0);
+	VERIFY(pthread_join(th, NULL) == 0);
+	char *b3 = rpc_buf_alloc(5000);
+	rpc_buf_unref(b3);
+
+	// too big for the arena
+	char *big = rpc_buf_alloc(1 << 20);
+	rpc_buf_unref(big);
+
+	rpc_arena_stats(&after);
+	VERIFY(after.allocs - before.allocs == 5);
+	VERIFY(after.hits - before.hits >= 1);
+	VERIFY(after.oversized - before.oversized == 1);
+	VERIFY(after.remote_frees - before.remote_frees == 1);
+	VERIFY(after.frees - before.frees == 5);
+
+	VERIFY(pthread_create(&th, NULL, arena_late, NULL) == 0);
+	VERIFY(pthread_join(th, NULL) == 0);
+	printf("arena .. ok\n");
+}
+
+void
+testxidwin()
+{
+	// in order
+	xid_window w;
+	for (unsigned int x = 1; x <= 1000; x++) {
+		w.mark(x);
+		VERIFY(w.base() == x);
+	}
+
+	// out of order, in shuffled blocks of 300
+	xid_window w2;
+	std::vector<unsigned int> xs;
+	for (unsigned int x = 1; x <= 3000; x++)
+		xs.push_back(x);
+	for (size_t i = 0; i < xs.size(); i += 300) {
+		for (size_t j = 299; j > 0; j--)
+			std::swap(xs[i + j], xs[i + random() % (j + 1)]);
+	}
+	std::vector<bool> seen(3001);
+	unsigned int expect = 0;
+	for (size_t i = 0; i < xs.size(); i++) {
+		w2.mark(xs[i]);
+		seen[xs[i]] = true;
+		while (expect < 3000 && seen[expect + 1])
+			expect++;
+		VERIFY(w2.base() == expect);
+	}
+
+	// one straggler holds the base back while the ring grows past it
+	xid_window w3;
+	for (unsigned int x = 2; x <= 5000; x++)
+		w3.mark(x);
+	VERIFY(w3.base() == 0);
+	w3.mark(7000);
+	w3.mark(1);
+	VERIFY(w3.base() == 5000);
+	w3.mark(3);   // old news
+	VERIFY(w3.base() == 5000);
+	printf("xid window .. ok\n");
+}
+
+std::atomic<int> parked;
+
+void *
+park_waker(void *)
+{
+	usleep(50 * 1000);
+	parked = 1;
+	unpark(&parked);
+	return 0;
+}
+
+void
+testpark()
+{
+	struct timespec start, deadline, end;
+
+	// nobody wakes us: the deadline does
+	parked = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	add_timespec(start, 100, &deadline);
+	while (park(&parked, 0, &deadline))
+		;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	VERIFY(diff_timespec(end, start) >= 99);
+
+	// a wake ends the wait well before the deadline
+	pthread_t th;
+	VERIFY(pthread_create(&th, NULL, park_waker, NULL) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	add_timespec(start, 10000, &deadline);
+	while (parked.load() == 0)
+		VERIFY(park(&parked, 0, &deadline));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	VERIFY(diff_timespec(end, start) < 5000);
+	VERIFY(pthread_join(th, NULL) == 0);
+
+	// a stale value returns at once
+	VERIFY(park(&parked, 0, &deadline));
+	printf("park .. ok\n");
+}
+
+void
+testrtt()
+{
+	rtt_estimator e;
+	VERIFY(e.rto() == rtt_estimator::RTO_INIT_MS);
+
+	// a steady 200ms: the timeout settles just above it
+	for (int i = 0; i < 100; i++)
+		e.sample(200000);
+	VERIFY(e.srtt_us() == 200000);
+	VERIFY(e.rto() >= 200 && e.rto() < 210);
+
+	// jittery samples widen the margin
+	for (int i = 0; i < 100; i++)
+		e.sample(i % 2 ? 100000 : 300000);
+	VERIFY(e.rto() > 300);
+
+	// fast replies: the floor
+	for (int i = 0; i < 200; i++)
+		e.sample(100);
+	VERIFY(e.rto() == rtt_estimator::RTO_MIN_MS);
+
+	for (int to = 10; to < 100000; to *= 2) {
+		int b = rtt_estimator::backoff(to);
+		int base = std::min(2 * to, (int) rtt_estimator::BACKOFF_MAX_MS);
+		VERIFY(b >= base && b <= base + base / 4);
+	}
+	printf("rtt .. ok\n");
+}
+
+call_table<int> *ctab;
+std::atomic<bool> ctab_stop;
+
+// pin and unpin whatever the main thread has in flight
+void *
+calltab_pinner(void *)
+{
+	int slot;
+	while (!ctab_stop) {
+		for (unsigned int x = 1; x < 200; x++) {
+			int *p = ctab->pin(x, &slot);
+			if (p) {
+				VERIFY(*p == (int) x);
+				ctab->unpin(slot);
+			}
+		}
+	}
+	return 0;
+}
+
+void
+testproctab()
+{
+	static int h[64];
+	std::map<int, int *> procs;
+	proc_table<int> *t = proc_table<int>::build(procs);
+	VERIFY(t->find(0) == NULL && t->find(22) == NULL);
+	delete t;
+
+	// the reserved procs, a few small ones and rpcgen's 0x7000 style
+	for (int i = 0; i < 64; i++)
+		procs[i < 8 ? i + 1 : i < 32 ? i + 14 : 0x7000 + i] = &h[i];
+	t = proc_table<int>::build(procs);
+	for (auto &p : procs)
+		VERIFY(t->find(p.first) == p.second);
+	VERIFY(t->find(0) == NULL && t->find(0x8001) == NULL);
+	delete t;
+}
+
+void
+testcalltab()
+{
+	call_table<int> *t = new call_table<int>;
+	int v[3] = { 1, 2, 3 };
+	int slot;
+
+	int s1 = t->insert(1, &v[0]);
+	int s2 = t->insert(2, &v[1]);
+	VERIFY(t->size() == 2);
+	VERIFY(t->pin(1, &slot) == &v[0] && slot == s1);
+	t->unpin(slot);
+	VERIFY(t->pin(3, &slot) == NULL);
+
+	// a stale reply for an earlier user of the slot misses
+	t->remove(s1);
+	int s3 = t->insert(1 + call_table<int>::SLOTS, &v[2]);
+	VERIFY(s3 == s1);
+	VERIFY(t->pin(1, &slot) == NULL);
+	VERIFY(t->pin(1 + call_table<int>::SLOTS, &slot) == &v[2]);
+	t->unpin(slot);
+
+	// a call that has been around a whole lap pushes the next one along
+	int s4 = t->insert(2 + call_table<int>::SLOTS, &v[0]);
+	VERIFY(s4 != s2);
+	VERIFY(t->pin(2, &slot) == &v[1] && slot == s2);
+	t->unpin(slot);
+	VERIFY(t->pin(2 + call_table<int>::SLOTS, &slot) == &v[0]);
+	t->unpin(slot);
+
+	int n = 0;
+	t->for_each([&n](int *) { n++; });
+	VERIFY(n == 3);
+	t->remove(s2);
+	t->remove(s3);
+	t->remove(s4);
+	VERIFY(t->size() == 0);
+
+	// a full run turns a call away
+	int run[call_table<int>::MAX_PROBE];
+	for (int i = 0; i < call_table<int>::MAX_PROBE; i++)
+		VERIFY((run[i] = t->insert(10 + i * call_table<int>::SLOTS, &v[0])) >= 0);
+	VERIFY(t->insert(10 + call_table<int>::MAX_PROBE * call_table<int>::SLOTS,
+				&v[0]) == -1);
+	for (int i = 0; i < call_table<int>::MAX_PROBE; i++)
+		t->remove(run[i]);
+	VERIFY(t->size() == 0);
+	delete t;
+
+	// remove() waits out the pins of other threads
+	ctab = new call_table<int>;
+	ctab_stop = false;
+	pthread_t th[2];
+	for (int i = 0; i < 2; i++)
+		VERIFY(pthread_create(&th[i], NULL, calltab_pinner, NULL) == 0);
+	for (int round = 0; round < 2000; round++) {
+		int *vals = new int[200];
+		int slots[200];
+		for (int x = 1; x < 200; x++) {
+			vals[x] = x;
+			slots[x] = ctab->insert(x, &vals[x]);
+		}
+		for (int x = 1; x < 200; x++) {
+			ctab->remove(slots[x]);
+			vals[x] = -1;
+		}
+		delete[] vals;
+	}
+	ctab_stop = true;
+	for (int i = 0; i < 2; i++)
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	VERIFY(ctab->size() == 0);
+	delete ctab;
+	printf("call table .. ok\n");
+}
+
 void *
 client1(void *xx)
 {
@@ -242,6 +744,26 @@ simple_tests(rpcc *c)
 	VERIFY(rep.size() == 1000001);
 	printf("   -- huge 1M rpc request .. ok\n");
 
+	// the same, sent from big itself rather than a copy
+	intret = c->call(22, rpc_blob(big), (std::string)"z", rep);
+	VERIFY(intret == 0 && rep.size() == 1000001);
+	printf("   -- huge 1M rpc request by reference .. ok\n");
+
+	// an async call is done with the blob once call_async() returns;
+	// held for the bind the first call started, it goes out only later
+	{
+		rpcc lazy(dst);
+		std::future<rpcc::result<int> > first = lazy.call_async<int>(23, 1);
+		std::string gone(100000, 'y');
+		std::future<rpcc::result<std::string> > f =
+			lazy.call_async<std::string>(22, rpc_blob(gone), (std::string)"z");
+		gone.assign(gone.size(), 'q');
+		rpcc::result<std::string> res = f.get();
+		VERIFY(res.ret == 0 && res.r == std::string(100000, 'y') + "z");
+		VERIFY(first.get().ret == 0);
+	}
+	printf("   -- async request by reference .. ok\n");
+
 	// specify a timeout value to an RPC that should timeout (udp)
 	struct sockaddr_in non_existent;
 	memset(&non_existent, 0, sizeof(non_existent));
@@ -257,6 +779,893 @@ simple_tests(rpcc *c)
 	printf("simple_tests OK\n");
 }
 
+// a reader whose pull waits on a handler still reading the request
+void *
+stream_reader(void *xx)
+{
+	rpcc_stream *st = (rpcc_stream *) xx;
+	std::string buf;
+	VERIFY(st->read(buf) == 0 && st->result() == 0);
+	return 0;
+}
+
+void
+stream_test(rpcc *c)
+{
+	printf("stream_test\n");
+
+	// more than MAX_PDU each way, a chunk at a time
+	const long long n = 20 << 20;
+	rpcc_stream st(c, 26);
+	VERIFY(st.open() == 0);
+	std::string buf;
+	for (long long i = 0; i < n; i += buf.size()) {
+		buf.resize(std::min(n - i, 77777LL));
+		for (size_t j = 0; j < buf.size(); j++)
+			buf[j] = (i + j) % 251;
+		VERIFY(st.write(buf) == 0);
+	}
+	VERIFY(st.close_write() == 0);
+	long long got = 0;
+	int r;
+	while ((r = st.read(buf)) > 0) {
+		VERIFY(r <= STREAM_CHUNK);
+		for (size_t j = 0; j < buf.size(); j++, got++)
+			VERIFY((unsigned char) buf[j] == got % 253);
+	}
+	VERIFY(r == 0 && got == n && st.result() == n / 1024);
+	printf("   -- 20M each way .. ok\n");
+
+	// waiting streams, more than the dispatch and stream threads, hold
+	// none of the threads that other calls need
+	enum { N = 10 };
+	rpcc_stream *sts[N];
+	pthread_t th[N];
+	for (int i = 0; i < N; i++) {
+		sts[i] = new rpcc_stream(c, 26);
+		VERIFY(sts[i]->open() == 0);
+		VERIFY(pthread_create(&th[i], &attr, stream_reader,
+					(void *) sts[i]) == 0);
+	}
+	usleep(100000);
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < 20; i++)
+		VERIFY(c->call(23, i, r) == 0 && r == i + 1);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	VERIFY(diff_timespec(t1, t0) < 1000);
+	for (int i = 0; i < N; i++)
+		VERIFY(sts[i]->close_write() == 0);
+	for (int i = 0; i < N; i++) {
+		VERIFY(pthread_join(th[i], NULL) == 0);
+		delete sts[i];
+	}
+	printf("   -- %d waiting streams, other calls unhindered .. ok\n", N);
+
+	rpcc_stream none(c, 99);
+	VERIFY(none.open() == rpc_const::stream_failure);
+	printf("   -- unknown stream proc .. failed ok\n");
+	printf("stream_test OK\n");
+}
+
+// threads in this process, from /proc
+int
+nthreads()
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	VERIFY(f);
+	char line[256];
+	int n = -1;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "Threads: %d", &n) == 1)
+			break;
+	fclose(f);
+	return n;
+}
+
+std::atomic<bool> thread_watch;
+std::atomic<int> thread_peak;
+
+void *
+thread_watcher(void *)
+{
+	while (thread_watch) {
+		thread_peak = std::max(thread_peak.load(), nthreads());
+		usleep(5 * 1000);
+	}
+	return 0;
+}
+
+void
+batch_test(rpcc *c)
+{
+	printf("batch_test\n");
+
+	// mixed procs in one round trip, each with its own reply
+	rpc_batch b;
+	std::string s;
+	int r1 = 0, r2 = 0, bad = 0;
+	b.add(22, s, std::string("hello"), std::string(" batch"));
+	b.add(23, r1, 7);
+	b.add(24, r2, 7);
+	int ibad = b.add(1234, bad, 7);
+	int itoo = b.add(22, s, std::string("just one"));
+	VERIFY(b.call(c) == 0);
+	VERIFY(b.ret(0) == 0 && s == "hello batch");
+	VERIFY(b.ret(1) == 0 && r1 == 8);
+	VERIFY(b.ret(2) == 0 && r2 == 9);
+	VERIFY(b.ret(ibad) == rpc_const::batch_failure);
+	VERIFY(b.ret(itoo) == rpc_const::unmarshal_args_failure);
+	printf("   -- mixed batch .. ok\n");
+
+	// in order: calls see the effects of the ones before them
+	rpc_batch ob;
+	int before = 0, sums[10];
+	c->call(27, 0, before);
+	for (int i = 0; i < 10; i++)
+		ob.add(27, sums[i], 1);
+	VERIFY(ob.call(c) == 0);
+	for (int i = 0; i < 10; i++)
+		VERIFY(ob.ret(i) == 0 && sums[i] == before + i + 1);
+	printf("   -- in order .. ok\n");
+
+	// in parallel: the batch takes as long as its slowest call
+	rpc_batch pb(BATCH_PARALLEL);
+	int slept[8];
+	for (int i = 0; i < 8; i++)
+		pb.add(28, slept[i], 200);
+	struct timespec start, end;
+	clock_gettime(CLOCK_REALTIME, &start);
+	VERIFY(pb.call(c) == 0);
+	clock_gettime(CLOCK_REALTIME, &end);
+	int ms = diff_timespec(end, start);
+	for (int i = 0; i < 8; i++)
+		VERIFY(pb.ret(i) == 0 && slept[i] == 200);
+	VERIFY(ms < 8 * 200 / 2);
+	printf("   -- parallel (%d ms) .. ok\n", ms);
+
+	// but only BATCH_THREADS at a time, on threads the server has
+	// already
+	rpc_batch fb(BATCH_PARALLEL);
+	int fslept[BATCH_MAX];
+	for (int i = 0; i < BATCH_MAX; i++)
+		fb.add(28, fslept[i], 20);
+	int threads = nthreads();
+	thread_peak = 0;
+	thread_watch = true;
+	pthread_t th;
+	VERIFY(pthread_create(&th, NULL, thread_watcher, NULL) == 0);
+	clock_gettime(CLOCK_REALTIME, &start);
+	VERIFY(fb.call(c) == 0);
+	clock_gettime(CLOCK_REALTIME, &end);
+	thread_watch = false;
+	VERIFY(pthread_join(th, NULL) == 0);
+	// the watcher's own
+	VERIFY(thread_peak <= threads + 1);
+	ms = diff_timespec(end, start);
+	for (int i = 0; i < BATCH_MAX; i++)
+		VERIFY(fb.ret(i) == 0 && fslept[i] == 20);
+	VERIFY(ms >= BATCH_MAX / BATCH_THREADS * 20);
+	printf("   -- %d calls, %d threads (%d ms) .. ok\n", BATCH_MAX,
+			BATCH_THREADS, ms);
+
+	printf("batch_test OK\n");
+}
+
+// a listener with a full accept queue, so that a connect to it stalls,
+// here for about two seconds, until the queued ones are taken
+struct stalled_listener {
+	int l;
+	sockaddr_in sin;
+	std::vector<int> fds;
+	pthread_t th;
+
+	static void *
+	acceptor(void *xx)
+	{
+		stalled_listener *sl = (stalled_listener *) xx;
+		usleep(1500 * 1000);
+		for (int i = 0; i < 2; i++)
+			sl->fds.push_back(accept(sl->l, NULL, NULL));
+		return 0;
+	}
+
+	stalled_listener() {
+		l = socket(AF_INET, SOCK_STREAM, 0);
+		sin = dst;
+		sin.sin_port = 0;
+		socklen_t slen = sizeof(sin);
+		VERIFY(bind(l, (sockaddr *) &sin, sizeof(sin)) == 0 &&
+				listen(l, 0) == 0);
+		VERIFY(getsockname(l, (sockaddr *) &sin, &slen) == 0);
+		for (int i = 0; i < 3; i++) {
+			int s = socket(AF_INET, SOCK_STREAM, 0);
+			fcntl(s, F_SETFL, O_NONBLOCK);
+			connect(s, (sockaddr *) &sin, sizeof(sin));
+			fds.push_back(s);
+		}
+		usleep(100 * 1000);
+		VERIFY(pthread_create(&th, NULL, acceptor, this) == 0);
+	}
+	~stalled_listener() {
+		VERIFY(pthread_join(th, NULL) == 0);
+		for (size_t i = 0; i < fds.size(); i++)
+			close(fds[i]);
+		close(l);
+	}
+};
+
+void
+deadline_test(rpcc *c, rpcc *other)
+{
+	printf("deadline_test\n");
+
+	// tie up every one of the server's dispatch threads
+	std::vector<std::future<rpcc::result<int> > > busy;
+	for (int i = 0; i < 6; i++)
+		busy.push_back(c->call_async<int>(28, 1000));
+	usleep(100 * 1000);
+
+	// this one waits behind them for longer than its caller does
+	int before = counted, r;
+	int expired = server->expired();
+	VERIFY(other->call(27, 1000, r, rpcc::to(300)) ==
+			rpc_const::timeout_failure);
+	for (size_t i = 0; i < busy.size(); i++)
+		VERIFY(busy[i].get().ret == 0);
+	usleep(100 * 1000);
+	VERIFY(counted == before);
+	VERIFY(server->expired() == expired + 1);
+	printf("   -- dropped once expired .. ok\n");
+
+	// a deadline that has not passed changes nothing
+	VERIFY(other->call(27, 1, r, rpcc::to(5000)) == 0 && r == before + 1);
+	VERIFY(server->expired() == expired + 1);
+	printf("   -- run in time .. ok\n");
+
+	// a connect that stalls past the deadline. once for a bind and once
+	// for an async call
+	for (int async = 0; async < 2; async++) {
+		stalled_listener sl;
+		rpcc stalled(sl.sin);
+		if (async)
+			VERIFY(stalled.call_async<int>(23, rpcc::to(500), 1).get().ret < 0);
+		else
+			VERIFY(stalled.bind(rpcc::to(500)) < 0);
+	}
+	printf("   -- connect stalled past the deadline .. ok\n");
+
+	printf("deadline_test OK\n");
+}
+
+rpcc *shared_cl;
+
+void *
+shared_caller(void *xx)
+{
+	int ms = (intptr_t) xx;
+	int r = 0;
+	VERIFY(shared_cl->call(28, ms, r) == 0 && r == ms);
+	return 0;
+}
+
+void
+coalesce_test()
+{
+	printf("coalesce_test\n");
+	rpcc c(dst);
+	VERIFY(c.bind() == 0);
+	c.coalesce(28);
+	shared_cl = &c;
+
+	// ten identical calls at once: one goes to the server
+	int before = sleeps;
+	pthread_t th[10];
+	for (int i = 0; i < 10; i++)
+		VERIFY(pthread_create(&th[i], &attr, shared_caller,
+					(void *) (intptr_t) 500) == 0);
+	for (int i = 0; i < 10; i++)
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	VERIFY(sleeps == before + 1);
+	printf("   -- identical calls share one .. ok\n");
+
+	// different arguments do not
+	before = sleeps;
+	for (int i = 0; i < 4; i++)
+		VERIFY(pthread_create(&th[i], &attr, shared_caller,
+					(void *) (intptr_t) (200 + i)) == 0);
+	for (int i = 0; i < 4; i++)
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	VERIFY(sleeps == before + 4);
+	printf("   -- different calls do not .. ok\n");
+
+	// nor do calls one after the other
+	before = sleeps;
+	shared_caller((void *) 10);
+	shared_caller((void *) 10);
+	VERIFY(sleeps == before + 2);
+	printf("   -- later calls do not .. ok\n");
+
+	printf("coalesce_test OK\n");
+}
+
+void *
+canceller(void *xtok)
+{
+	usleep(100 * 1000);
+	((cancel_token *) xtok)->cancel();
+	return 0;
+}
+
+void
+cancel_test(rpcc *c, rpcc *other)
+{
+	printf("cancel_test\n");
+
+	// a call queued behind busy dispatch threads
+	std::vector<std::future<rpcc::result<int> > > busy;
+	for (int i = 0; i < 6; i++)
+		busy.push_back(c->call_async<int>(28, 1000));
+	usleep(100 * 1000);
+
+	int before = counted, r;
+	cancel_token tok;
+	std::future<rpcc::result<int> > f =
+		other->call_async<int>(27, rpcc::to(10000, &tok), 1000);
+	usleep(100 * 1000);
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tok.cancel();
+	VERIFY(f.get().ret == rpc_const::cancel_failure);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	VERIFY(diff_timespec(end, start) < 100);
+	printf("   -- cancelled at once .. ok\n");
+
+	// the others went on, and the server never ran it
+	for (size_t i = 0; i < busy.size(); i++)
+		VERIFY(busy[i].get().ret == 0);
+	usleep(100 * 1000);
+	VERIFY(counted == before);
+	printf("   -- others unaffected, server skipped it .. ok\n");
+
+	// from another thread, during a call()
+	pthread_t th;
+	tok.reset();
+	VERIFY(pthread_create(&th, &attr, canceller, (void *) &tok) == 0);
+	VERIFY(other->call(28, 1000, r, rpcc::to(10000, &tok)) ==
+			rpc_const::cancel_failure);
+	VERIFY(pthread_join(th, NULL) == 0);
+	// from a timer, on the poll thread
+	tok.reset();
+	PollMgr::Instance()->add_timer(100, [&tok]() { tok.cancel(); });
+	VERIFY(other->call(28, 1000, r, rpcc::to(10000, &tok)) ==
+			rpc_const::cancel_failure);
+	// and before one
+	VERIFY(other->call(27, 1, r, rpcc::to(10000, &tok)) ==
+			rpc_const::cancel_failure);
+	tok.reset();
+	VERIFY(other->call(27, 1, r, rpcc::to(10000, &tok)) == 0 &&
+			r == before + 1);
+	printf("   -- call() cancelled, token reused .. ok\n");
+
+	// from a timer while the connect stalls: the cancel does not wait
+	// for the connection, and the poll thread goes on
+	{
+		stalled_listener sl;
+		rpcc stalled(sl.sin);
+		struct timespec fired = { 0, 0 };
+		tok.reset();
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		PollMgr::Instance()->add_timer(100, [&tok]() { tok.cancel(); });
+		PollMgr::Instance()->add_timer(200, [&fired]() {
+			clock_gettime(CLOCK_MONOTONIC, &fired);
+		});
+		VERIFY(stalled.call(23, 1, r, rpcc::to(10000, &tok)) ==
+				rpc_const::cancel_failure);
+		VERIFY(fired.tv_sec && diff_timespec(fired, start) < 1000);
+	}
+	printf("   -- cancelled without a connection .. ok\n");
+
+	printf("cancel_test OK\n");
+}
+
+void
+reply_budget_test()
+{
+	printf("reply_budget_test\n");
+	enum { N = 16, REP = 32 * 1024, BUDGET = 256 * 1024 };
+	server->set_reply_budget(BUDGET);
+	int evicted = server->evicted();
+
+	// each client's last reply stays until its next call
+	rpcc *cl[N];
+	std::string s;
+	for (int i = 0; i < N; i++) {
+		cl[i] = new rpcc(dst);
+		VERIFY(cl[i]->call(25, REP, s) == 0 && (int) s.size() == REP);
+	}
+	VERIFY(server->retained_bytes() <= BUDGET);
+	VERIFY(server->evicted() > evicted);
+	VERIFY(server->retained_bytes(cl[0]->id()) == 0);
+	VERIFY(server->retained_bytes(cl[N - 1]->id()) >= REP);
+	printf("   -- oldest replies evicted .. ok\n");
+
+	// past a quarter of the budget, not kept at all
+	evicted = server->evicted();
+	VERIFY(cl[N - 1]->call(25, BUDGET / 2, s) == 0 &&
+			(int) s.size() == BUDGET / 2);
+	VERIFY(server->retained_bytes(cl[N - 1]->id()) == 0);
+	VERIFY(server->evicted() == evicted + 1);
+	printf("   -- big replies not kept .. ok\n");
+
+	for (int i = 0; i < N; i++)
+		delete cl[i];
+	server->set_reply_budget(64 << 20);
+	printf("reply_budget_test OK\n");
+}
+
+// the return value of each reply on a connection of our own, for
+// requests made up here rather than by an rpcc
+class raw_chan : public chanmgr {
+	public:
+		std::atomic<int> replies;
+		std::atomic<int> ret;
+		raw_chan() : replies(0), ret(0) { }
+		bool got_pdu(connection *c, char *b, int sz) {
+			reply_header h;
+			VERIFY(unmarshall::peek_reply_header(b, sz, &h));
+			rpc_buf_unref(b);
+			ret = h.ret;
+			replies++;
+			return true;
+		}
+};
+
+// send proc 23 as xid from a client of our own; its reply's return
+// value
+int
+raw_call(raw_chan *rc, connection *c, unsigned int xid)
+{
+	marshall m;
+	req_header h(xid, 23, 0x5eed, 0, 0);
+	m.pack_req_header(h);
+	m << 1;
+	int n = rc->replies;
+	VERIFY(c->send(m.cstr(), m.size()));
+	while (rc->replies == n)
+		usleep(1000);
+	return rc->ret;
+}
+
+void
+window_cap_test()
+{
+	printf("window_cap_test\n");
+	raw_chan rc;
+	connection *c = connect_to_dst(dst, &rc);
+	VERIFY(c);
+	VERIFY(raw_call(&rc, c, 1) == 0);
+	// far ahead of the client's acknowledged xid: no window for it
+	VERIFY(raw_call(&rc, c, 1 << 30) == rpc_const::atmostonce_failure);
+	VERIFY(raw_call(&rc, c, 1000) == 0);
+	c->closeconn();
+	c->decref();
+	printf("   -- far xid turned away .. ok\n");
+	printf("window_cap_test OK\n");
+}
+
+void
+durable_test()
+{
+	printf("durable_test\n");
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/rpctest-amo.%d", getpid());
+	std::string next = std::string(path) + ".new";
+	unlink(path);
+	delete server;
+	startserver(path);
+
+	rpcc *c = new rpcc(dst);
+	int before = counted, r;
+	VERIFY(c->call(27, 1, r) == 0 && r == before + 1);
+	long long kept = server->retained_bytes(c->id());
+	VERIFY(kept > 0);
+
+	// the new server has the old one's nonce, and c's last reply
+	delete server;
+	startserver(path);
+	VERIFY(server->retained_bytes(c->id()) == kept);
+	VERIFY(c->call(27, 1, r) == 0 && r == before + 2);
+	printf("   -- restart keeps the client's session .. ok\n");
+
+	server->compact_log();
+	delete server;
+	startserver(path);
+	VERIFY(c->call(27, 1, r) == 0 && r == before + 3);
+	VERIFY(access(next.c_str(), F_OK) != 0);
+	printf("   -- and compaction .. ok\n");
+
+	delete c;
+	unlink(path);
+	// the others were bound to the server this test started with
+	for (int i = 0; i < NUM_CL; i++) {
+		delete clients[i];
+		clients[i] = new rpcc(dst);
+		VERIFY(clients[i]->bind() == 0);
+	}
+	printf("durable_test OK\n");
+}
+
+void
+shared_conn_test()
+{
+	printf("shared_conn_test\n");
+	enum { N = 20, CALLS = 5 };
+	rpcc *cl[N];
+	for (int i = 0; i < N; i++) {
+		cl[i] = new rpcc(dst);
+		VERIFY(cl[i]->bind() == 0);
+		VERIFY(cl[i]->channo() >= 0 && cl[i]->channo() == cl[0]->channo());
+	}
+	printf("   -- %d clients, one connection .. ok\n", N);
+
+	// every client's xids start at the same place, so only the nonce
+	// tells whose reply is whose
+	std::vector<std::future<rpcc::result<int> > > fs;
+	for (int j = 0; j < CALLS; j++)
+		for (int i = 0; i < N; i++)
+			fs.push_back(cl[i]->call_async<int>(23, i * 100 + j));
+	for (int j = 0; j < CALLS; j++)
+		for (int i = 0; i < N; i++) {
+			rpcc::result<int> res = fs[j * N + i].get();
+			VERIFY(res.ret == 0 && res.r == i * 100 + j + 1);
+		}
+	printf("   -- replies reach their own client .. ok\n");
+
+	// a new client of the destination goes by the others' round trips
+	rpcc late(dst);
+	VERIFY(late.rto() == cl[0]->rto() &&
+			late.rto() < rtt_estimator::RTO_INIT_MS);
+	printf("   -- and share round trip times .. ok\n");
+
+	// a client that does not retransmit has no nonce to be told apart by
+	rpcc priv(dst, false);
+	VERIFY(priv.bind() == 0);
+	int r;
+	VERIFY(priv.call(23, 1, r) == 0 && r == 2);
+	VERIFY(priv.channo() != cl[0]->channo());
+	printf("   -- but not a client without a nonce .. ok\n");
+
+	for (int i = 0; i < N; i++)
+		delete cl[i];
+	printf("shared_conn_test OK\n");
+}
+
+void
+hedge_test(rpcc *c)
+{
+	printf("hedge_test\n");
+	c->hedge(29, 90);
+
+	// no hedges until there are latencies to go by
+	int r;
+	stall_next = 3000;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	VERIFY(c->call(29, 1, r) == 0 && r == 4);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	VERIFY(diff_timespec(end, start) >= 3000);
+	VERIFY(c->hedges(29) == 0);
+	printf("   -- none before %d samples .. ok\n", latency_hist::MIN_SAMPLES);
+
+	for (int i = 0; i < 2 * latency_hist::MIN_SAMPLES; i++)
+		VERIFY(c->call(29, i, r) == 0 && r == i + 3);
+
+	// the stalled copy is overtaken by its hedge
+	int before = c->hedges(29);
+	stall_next = 3000;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	VERIFY(c->call(29, 7, r) == 0 && r == 10);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	int ms = diff_timespec(end, start);
+	VERIFY(ms < 1000);
+	VERIFY(c->hedges(29) > before);
+	printf("   -- hedge wins (%d ms) .. ok\n", ms);
+
+	printf("hedge_test OK\n");
+}
+
+// a batch of parked calls, in order or in parallel by i
+rpcc *parked_cl;
+std::atomic<int> batches_done;
+
+void *
+parked_batcher(void *xx)
+{
+	int i = (long) xx;
+	rpc_batch b(i % 2 ? BATCH_PARALLEL : 0);
+	int r[3];
+	for (int j = 0; j < 3; j++)
+		b.add(30, r[j], i * 10 + j);
+	VERIFY(b.call(parked_cl) == 0);
+	for (int j = 0; j < 3; j++)
+		VERIFY(b.ret(j) == 0 && r[j] == i * 10 + j + 1000);
+	batches_done++;
+	return 0;
+}
+
+void
+async_handler_test(rpcc *c)
+{
+	printf("async_handler_test\n");
+	enum { N = 20 };   // more than the server's dispatch threads
+	std::vector<std::future<rpcc::result<int> > > fs;
+	for (int i = 0; i < N; i++)
+		fs.push_back(c->call_async<int>(30, i));
+	while (service.parked() < N)
+		usleep(1000);
+	int r;
+	VERIFY(c->call(23, 1, r) == 0 && r == 2);
+	printf("   -- %d calls waiting, none holding a thread .. ok\n", N);
+
+	service.unpark(1000);
+	for (int i = 0; i < N; i++) {
+		rpcc::result<int> res = fs[i].get();
+		VERIFY(res.ret == 0 && res.r == i + 1000);
+	}
+	printf("   -- answered from another thread .. ok\n");
+
+	// batches of them hold no thread either: one parked call from each
+	// batch in order, all three from each in parallel
+	enum { NB = 10 };
+	pthread_t bth[NB];
+	parked_cl = c;
+	batches_done = 0;
+	for (long i = 0; i < NB; i++)
+		VERIFY(pthread_create(&bth[i], NULL, parked_batcher,
+					(void *) i) == 0);
+	while (service.parked() < NB / 2 + NB / 2 * 3)
+		usleep(1000);
+	VERIFY(c->call(23, 1, r) == 0 && r == 2);
+	// the rest of a batch in order goes on from its answered call
+	while (batches_done < NB) {
+		service.unpark(1000);
+		usleep(1000);
+	}
+	for (int i = 0; i < NB; i++)
+		VERIFY(pthread_join(bth[i], NULL) == 0);
+	VERIFY(service.parked() == 0);
+	printf("   -- %d batches waiting, none holding a thread .. ok\n", NB);
+
+	// more calls in flight than the client has slots for, 4096: the
+	// rest fail at once instead of waiting for room
+	enum { SLOTS = 4096, OVER = 100 };
+	rpcc full(dst);
+	VERIFY(full.bind() == 0);
+	fs.clear();
+	for (int i = 0; i < SLOTS + OVER; i++)
+		fs.push_back(full.call_async<int>(30, i));
+	VERIFY(full.call(23, 1, r) == rpc_const::busy_failure);
+	while (service.parked() < SLOTS)
+		usleep(1000);
+	service.unpark(0);
+	int busy = 0;
+	for (int i = 0; i < SLOTS + OVER; i++) {
+		rpcc::result<int> res = fs[i].get();
+		if (res.ret == rpc_const::busy_failure)
+			busy++;
+		else
+			VERIFY(res.ret == 0 && res.r == i);
+	}
+	VERIFY(busy == OVER);
+	VERIFY(full.call(23, 1, r) == 0 && r == 2);
+	printf("   -- too many calls turned away .. ok\n");
+	printf("async_handler_test OK\n");
+}
+
+// inline replies and pool replies, small and large, on one connection
+void *
+inline_mixer(void *xx)
+{
+	rpcc *c = (rpcc *) xx;
+	for (int i = 0; i < 100; i++) {
+		int r;
+		VERIFY(c->call(23, i, r) == 0 && r == i + 1);
+		int len = (i % 4) * 96 * 1024;
+		std::string s;
+		VERIFY(c->call(25, len, s) == 0 && (int) s.size() == len);
+		VERIFY(c->call(22, std::string(len, 'a'), std::string("b"), s) == 0 &&
+				(int) s.size() == len + 1);
+	}
+	return 0;
+}
+
+void
+inline_test(rpcc *c)
+{
+	printf("inline_test\n");
+	int r;
+	server->set_inline(23);
+	for (int i = 0; i < 100; i++)
+		VERIFY(c->call(23, i, r) == 0 && r == i + 1);
+	std::vector<std::future<rpcc::result<int> > > fs;
+	for (int i = 0; i < 100; i++)
+		fs.push_back(c->call_async<int>(23, i));
+	for (int i = 0; i < 100; i++) {
+		rpcc::result<int> res = fs[i].get();
+		VERIFY(res.ret == 0 && res.r == i + 1);
+	}
+	VERIFY(server->is_inline(23));
+	printf("   -- run on the poll thread .. ok\n");
+
+	rpcc *shared = new rpcc(dst);
+	VERIFY(shared->bind() == 0);
+	pthread_t th[8];
+	for (int i = 0; i < 8; i++)
+		VERIFY(pthread_create(&th[i], NULL, inline_mixer, shared) == 0);
+	for (int i = 0; i < 8; i++)
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	VERIFY(server->is_inline(23));
+	delete shared;
+	printf("   -- sent alongside others on one connection .. ok\n");
+
+	// one slow call does not demote it, a run of them does
+	server->set_inline(28);
+	VERIFY(c->call(28, 5, r) == 0 && r == 5);
+	VERIFY(server->is_inline(28));
+	for (int i = 0; i < 4; i++)
+		VERIFY(c->call(28, 0, r) == 0 && r == 0);
+	// rpcs::INLINE_SLOW_CALLS is 4
+	for (int i = 1; i < 4; i++) {
+		VERIFY(c->call(28, 5, r) == 0 && r == 5);
+		VERIFY(server->is_inline(28));
+	}
+	VERIFY(c->call(28, 5, r) == 0 && r == 5);
+	VERIFY(!server->is_inline(28));
+	VERIFY(c->call(28, 1, r) == 0 && r == 1);
+	printf("   -- demoted past its budget .. ok\n");
+	printf("inline_test OK\n");
+}
+
+struct async_count {
+	async_count(): n(0) {
+		VERIFY(pthread_mutex_init(&m, 0) == 0);
+		VERIFY(pthread_cond_init(&c, 0) == 0);
+	}
+	int n;
+	pthread_mutex_t m;
+	pthread_cond_t c;
+};
+
+void
+async_test(rpcc *c)
+{
+	printf("async_test\n");
+
+	// many calls in flight from one thread
+	const int n = 200;
+	std::vector<std::future<rpcc::result<int> > > fs;
+	for (int i = 0; i < n; i++)
+		fs.push_back(c->call_async<int>(i % 2 ? 23 : 24, i));
+	for (int i = 0; i < n; i++) {
+		rpcc::result<int> r = fs[i].get();
+		VERIFY(r.ret == 0 && r.r == i + (i % 2 ? 1 : 2));
+	}
+	printf("   -- %d futures .. ok\n", n);
+
+	// callbacks on the executor
+	async_count done;
+	for (int i = 0; i < n; i++) {
+		c->call_async_cb<std::string>(22,
+				[i, &done](int ret, std::string &r) {
+					VERIFY(ret == 0 && r == "x" + std::to_string(i));
+					ScopedLock ml(&done.m);
+					if (++done.n == n)
+						VERIFY(pthread_cond_signal(&done.c) == 0);
+				}, std::string("x"), std::to_string(i));
+	}
+	{
+		ScopedLock ml(&done.m);
+		while (done.n < n)
+			VERIFY(pthread_cond_wait(&done.c, &done.m) == 0);
+	}
+	printf("   -- %d callbacks .. ok\n", n);
+
+	// a call nobody answers times out on its own
+	if (server) {
+		server->set_reachable(false);
+		std::future<rpcc::result<int> > f =
+			c->call_async<int>(23, rpcc::to(1500), 1);
+		VERIFY(f.get().ret == rpc_const::timeout_failure);
+		server->set_reachable(true);
+		printf("   -- timeout .. ok\n");
+	}
+	printf("async_test OK\n");
+}
+
+// two dependent calls, written as straight-line code
+rpc_task<int>
+coro_chain(rpcc *c, int i, ThrPool *pool)
+{
+	rpcc::result<int> r = co_await c->co_call<int>(23, i).via(pool);
+	if (r.ret != 0)
+		co_return r.ret;
+	r = co_await c->co_call<int>(24, r.r);
+	co_return r.ret != 0 ? r.ret : r.r;
+}
+
+rpc_task<int>
+coro_sum(rpcc *c, int n)
+{
+	int sum = 0;
+	for (int i = 0; i < n; i++)
+		sum += co_await coro_chain(c, i, NULL);
+	co_return sum;
+}
+
+rpc_task<>
+coro_dropped(rpcc *c, int i, async_count *done)
+{
+	VERIFY(co_await coro_chain(c, i, NULL) == i + 3);
+	ScopedLock ml(&done->m);
+	done->n++;
+	VERIFY(pthread_cond_signal(&done->c) == 0);
+}
+
+rpc_task<int>
+coro_timeout(rpcc *c)
+{
+	rpcc::result<int> r = co_await c->co_call<int>(23, rpcc::to(1500), 1);
+	co_return r.ret;
+}
+
+void
+coro_test(rpcc *c)
+{
+	printf("coro_test\n");
+
+	// many coroutines suspended at once on one thread
+	const int n = 100;
+	std::vector<rpc_task<int> > ts;
+	for (int i = 0; i < n; i++)
+		ts.push_back(coro_chain(c, i, NULL));
+	for (int i = 0; i < n; i++)
+		VERIFY(ts[i].get() == i + 3);
+	printf("   -- %d coroutines .. ok\n", n);
+
+	// resumed on a pool of our own
+	ThrPool pool(2, false);
+	ts.clear();
+	for (int i = 0; i < n; i++)
+		ts.push_back(coro_chain(c, i, &pool));
+	for (int i = 0; i < n; i++)
+		VERIFY(ts[i].get() == i + 3);
+	printf("   -- via pool .. ok\n");
+
+	// a coroutine awaiting others
+	VERIFY(coro_sum(c, 10).get() == 45 + 30);
+	printf("   -- nested .. ok\n");
+
+	// dropped before it finishes; it cleans up after itself
+	async_count done;
+	for (int i = 0; i < 10; i++)
+		coro_dropped(c, i, &done);
+	{
+		ScopedLock ml(&done.m);
+		while (done.n < 10)
+			VERIFY(pthread_cond_wait(&done.c, &done.m) == 0);
+	}
+	printf("   -- dropped .. ok\n");
+
+	if (server) {
+		server->set_reachable(false);
+		VERIFY(coro_timeout(c).get() == rpc_const::timeout_failure);
+		server->set_reachable(true);
+		printf("   -- timeout .. ok\n");
+	}
+	printf("coro_test OK\n");
+}
+
 void
 concurrent_test(int nt)
 {
@@ -307,6 +1716,34 @@ lossy_test()
 	for(int i = 0; i < nt; i++){
 		VERIFY(pthread_join(th[i], NULL) == 0);
 	}
+
+	// async calls recover from lost connections through their timers.
+	// a lossy server drops the connection on 1 in RPC_LOSSY replies, so
+	// keep few in flight at once, or they all lose theirs every round
+	// and back off past the deadline.
+	for (int w = 0; w < 50; w += 10) {
+		std::vector<std::future<rpcc::result<int> > > fs;
+		for (int i = w; i < w + 10; i++)
+			fs.push_back(clients[1]->call_async<int>(23, i));
+		for (int i = w; i < w + 10; i++) {
+			rpcc::result<int> r = fs[i - w].get();
+			VERIFY(r.ret == 0 && r.r == i + 1);
+		}
+	}
+
+	// retransmitted batches run at most once, as a whole
+	int before = 0, after = 0;
+	VERIFY(clients[0]->call(27, 0, before) == 0);
+	for (int i = 0; i < 20; i++) {
+		rpc_batch b(i % 2 ? BATCH_PARALLEL : 0);
+		int r[5];
+		for (int j = 0; j < 5; j++)
+			b.add(27, r[j], 1);
+		VERIFY(b.call(clients[0]) == 0);
+	}
+	VERIFY(clients[0]->call(27, 0, after) == 0);
+	VERIFY(after - before == 100);
+
 	printf(".. OK\n");
 	VERIFY(setenv("RPC_LOSSY", "0", 1) == 0);
 }
@@ -319,6 +1756,41 @@ failure_test()
 
 	printf("failure_test\n");
 
+	// bound by its first calls rather than by bind(); those after the
+	// first wait for the nonce
+	std::string rep;
+	rpcc *lazy = new rpcc(dst);
+	std::vector<std::future<rpcc::result<int> > > fs;
+	for (int i = 0; i < 20; i++)
+		fs.push_back(lazy->call_async<int>(23, i));
+	VERIFY(lazy->call(22, (std::string)"hello", (std::string)" goodbye",
+				rep) == 0);
+	VERIFY(rep == "hello goodbye");
+	for (int i = 0; i < 20; i++) {
+		rpcc::result<int> res = fs[i].get();
+		VERIFY(res.ret == 0 && res.r == i + 1);
+	}
+	VERIFY(lazy->bind() == 0);
+	// a token on the call that starts the bind is the call's alone
+	{
+		rpcc tokened(dst);
+		cancel_token tok;
+		int r;
+		VERIFY(tokened.call(23, 1, r, rpcc::to(10000, &tok)) == 0 && r == 2);
+	}
+	// and the bind outlives the call, unanswered, until the client goes
+	server->set_reachable(false);
+	{
+		rpcc gaveup(dst);
+		cancel_token tok;
+		int r;
+		PollMgr::Instance()->add_timer(100, [&tok]() { tok.cancel(); });
+		VERIFY(gaveup.call(23, 1, r, rpcc::to(10000, &tok)) ==
+				rpc_const::cancel_failure);
+	}
+	server->set_reachable(true);
+	printf("   -- first calls bind a new client .. ok\n");
+
 	delete server;
 
 	client1 = new rpcc(dst);
@@ -329,16 +1801,18 @@ failure_test()
 
 	startserver();
 
-	std::string rep;
 	int intret = client->call(22, (std::string)"hello", (std::string)" goodbye", rep);
 	VERIFY(intret == rpc_const::oldsrv_failure);
+	intret = lazy->call(22, (std::string)"hello", (std::string)" goodbye", rep);
+	VERIFY(intret == rpc_const::oldsrv_failure);
 	printf("   -- call recovered server with old client .. failed ok\n");
+	delete lazy;
 
 	delete client;
 
 	clients[0] = client = new rpcc(dst);
 	VERIFY (client->bind() >= 0);
-	VERIFY (client->bind() < 0);
+	VERIFY (client->bind() == 0);
 
 	intret = client->call(22, (std::string)"hello", (std::string)" goodbye", rep);
 	VERIFY(intret == 0);
@@ -431,6 +1905,13 @@ main(int argc, char *argv[])
 	}
 
 	testmarshall();
+	testmarshall_containers();
+	testarena();
+	testcalltab();
+	testproctab();
+	testxidwin();
+	testpark();
+	testrtt();
 
 	pthread_attr_init(&attr);
 	// set stack size to 32K, so we don't run out of memory
@@ -460,6 +1941,28 @@ main(int argc, char *argv[])
 		}
 
 		simple_tests(clients[0]);
+		stream_test(clients[0]);
+		async_test(clients[0]);
+		coro_test(clients[0]);
+		batch_test(clients[0]);
+		shared_conn_test();
+		if (isserver)
+			deadline_test(clients[0], clients[1]);
+		if (isserver)
+			cancel_test(clients[0], clients[1]);
+		if (isserver)
+			coalesce_test();
+		if (isserver)
+			reply_budget_test();
+		if (isserver)
+			window_cap_test();
+		if (isserver)
+			durable_test();
+		if (isserver)
+			async_handler_test(clients[0]);
+		if (isserver)
+			inline_test(clients[0]);
+		hedge_test(clients[1]);
 		concurrent_test(10);
 		lossy_test();
 		if (isserver) {
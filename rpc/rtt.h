@@ -0,0 +1,154 @@
+#ifndef rtt_h
+#define rtt_h
+
+// round trip time estimation for retransmission, after Jacobson and
+// Karels (and RFC 6298): a smoothed rtt and its mean deviation, from
+// which the first retransmission timeout of a call is derived.
+//
+// a sample is the time from a request's first transmission to its
+// reply, and includes the handler's run time, so destinations with
+// slow handlers get a longer timeout rather than spurious duplicates.
+// samples come from many threads; a lost update only makes the
+// estimate a little staler, so there is no lock.
+
+#include <algorithm>
+#include <atomic>
+#include <stdlib.h>
+#include <time.h>
+
+class rtt_estimator {
+	public:
+		enum {
+			RTO_INIT_MS = 1000,    // until the first sample
+			RTO_MIN_MS = 50,
+			RTO_MAX_MS = 60000,
+			// backoff stops growing here. a call that waits this long
+			// is usually blocked in its handler, and its reply may have
+			// been lost with a connection; it should not sit out
+			// minutes before asking again.
+			BACKOFF_MAX_MS = 8000,
+			GRANULARITY_US = 1000, // least rttvar term
+		};
+
+		rtt_estimator() : srtt_us_(0), rttvar_us_(0) {}
+
+		void sample(long long us) {
+			if (us < 0)
+				return;
+			if (us > RTO_MAX_MS * 1000LL)
+				us = RTO_MAX_MS * 1000LL;
+			long long srtt = srtt_us_.load(std::memory_order_relaxed);
+			long long var = rttvar_us_.load(std::memory_order_relaxed);
+			if (srtt == 0) {
+				srtt = us ? us : 1;
+				var = us / 2;
+			} else {
+				long long err = us > srtt ? us - srtt : srtt - us;
+				var = var - var / 4 + err / 4;
+				srtt = srtt - srtt / 8 + us / 8;
+				if (srtt == 0)
+					srtt = 1;
+			}
+			rttvar_us_.store(var, std::memory_order_relaxed);
+			srtt_us_.store(srtt, std::memory_order_relaxed);
+		}
+
+		// the first retransmission timeout, in ms
+		int rto() {
+			long long srtt = srtt_us_.load(std::memory_order_relaxed);
+			if (srtt == 0)
+				return RTO_INIT_MS;
+			long long var = rttvar_us_.load(std::memory_order_relaxed);
+			long long ms = (srtt + std::max(4 * var,
+						(long long) GRANULARITY_US)) / 1000;
+			return std::min(std::max(ms, (long long) RTO_MIN_MS),
+					(long long) RTO_MAX_MS);
+		}
+
+		long long srtt_us() { return srtt_us_.load(std::memory_order_relaxed); }
+
+		// the interval after one of to ms: double it, up to
+		// BACKOFF_MAX_MS, plus up to a quarter more at random, so that
+		// calls that timed out together do not all come back at once
+		static int backoff(int to) {
+			to = std::min(to * 2, (int) BACKOFF_MAX_MS);
+			return to + random() % (to / 4 + 1);
+		}
+
+	private:
+		std::atomic<long long> srtt_us_;
+		std::atomic<long long> rttvar_us_;
+};
+
+// a histogram of call latencies, for the delay before a hedge. buckets
+// are a quarter of a power of two wide, so a percentile is read off
+// to within 25%. counts are halved every DECAY samples, so that it
+// follows a destination that got slower or faster. as above, samples
+// race and the odd one is lost.
+class latency_hist {
+	public:
+		enum {
+			BUCKETS = 112,       // up to about 2^28 us
+			MIN_SAMPLES = 32,    // before which there is no percentile
+			DECAY = 1024,
+		};
+
+		latency_hist() : total_(0) {
+			for (int i = 0; i < BUCKETS; i++)
+				n_[i].store(0, std::memory_order_relaxed);
+		}
+
+		void sample(long long us) {
+			if (us < 0)
+				return;
+			n_[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+			if (total_.fetch_add(1, std::memory_order_relaxed) + 1 == DECAY) {
+				int t = 0;
+				for (int i = 0; i < BUCKETS; i++) {
+					int v = n_[i].load(std::memory_order_relaxed) / 2;
+					n_[i].store(v, std::memory_order_relaxed);
+					t += v;
+				}
+				total_.store(t, std::memory_order_relaxed);
+			}
+		}
+
+		// the pct'th percentile in us, rounded up to its bucket's end;
+		// -1 until MIN_SAMPLES
+		long long percentile(int pct) {
+			int t = 0;
+			for (int i = 0; i < BUCKETS; i++)
+				t += n_[i].load(std::memory_order_relaxed);
+			if (t < MIN_SAMPLES)
+				return -1;
+			long long want = ((long long) t * pct + 99) / 100;
+			for (int i = 0; i < BUCKETS; i++) {
+				want -= n_[i].load(std::memory_order_relaxed);
+				if (want <= 0)
+					return end(i);
+			}
+			return end(BUCKETS - 1);
+		}
+
+	private:
+		// 0..3 for 0..3 us, then four per power of two
+		static int bucket(long long us) {
+			if (us < 4)
+				return us;
+			int msb = 63 - __builtin_clzll(us);
+			int b = 4 * (msb - 1) + ((us >> (msb - 2)) & 3);
+			return std::min(b, (int) BUCKETS - 1);
+		}
+		// the first latency past bucket b
+		static long long end(int b) {
+			if (b < 4)
+				return b + 1;
+			int shift = b / 4 - 1;
+			return (long long) (4 + b % 4 + 1) << shift;
+		}
+
+		std::atomic<int> n_[BUCKETS];
+		std::atomic<int> total_;
+};
+
+#endif
@@ -0,0 +1,588 @@
+// streaming rpcs, see stream.h
+
+#include <errno.h>
+#include <time.h>
+
+#include "stream.h"
+#include "slock.h"
+#include "jsl_log.h"
+#include "gettime.h"
+#include "pollmgr.h"
+#include "lang/verify.h"
+
+// the held push and pull answered, to be sent once m_ is released
+struct rpc_stream::answers {
+	answers() : push(NULL), push_ret(0), credit(0), pull(NULL), pull_ret(0) {}
+	rpc_reply *push;
+	int push_ret;
+	int credit;
+	rpc_reply *pull;
+	int pull_ret;
+	stream_chunk chunk;
+
+	bool any() { return push || pull; }
+	void send() {
+		if (push)
+			push->done(push_ret, credit);
+		if (pull)
+			pull->done(pull_ret, chunk);
+	}
+};
+
+static void
+probe_deadline(struct timespec *deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	add_timespec(now, STREAM_PROBE_MS, deadline);
+}
+
+rpc_stream::rpc_stream(unsigned int id)
+	: id_(id), inbytes_(0), inseq_(0), ineof_(false), outbytes_(0),
+	outseq_(0), push_(NULL), push_seq_(0), push_flags_(0), pull_(NULL),
+	pull_seq_(0), push_hold_(0), pull_hold_(0), holds_(0), done_(false),
+	ret_(0), aborted_(false), touched_(time(0))
+{
+	VERIFY(pthread_mutex_init(&m_, 0) == 0);
+	VERIFY(pthread_cond_init(&c_, 0) == 0);
+}
+
+rpc_stream::~rpc_stream()
+{
+	// a held call's timer keeps its stream
+	VERIFY(!push_ && !pull_);
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
+	VERIFY(pthread_cond_destroy(&c_) == 0);
+}
+
+// @pre m_ locked
+bool
+rpc_stream::wait(const struct timespec &deadline)
+{
+	return pthread_cond_timedwait(&c_, &m_, &deadline) != ETIMEDOUT;
+}
+
+// @pre m_ locked
+int
+rpc_stream::room()
+{
+	return inbytes_ < STREAM_WINDOW ? STREAM_WINDOW - inbytes_ : 0;
+}
+
+bool
+rpc_stream::read(std::string &chunk)
+{
+	ScopedLock ml(&m_);
+	while (in_.empty() && !ineof_ && !aborted_) {
+		struct timespec deadline;
+		probe_deadline(&deadline);
+		if (!wait(deadline) && idle(time(0)))
+			aborted_ = true;
+	}
+	if (in_.empty())
+		return false;
+	chunk.swap(in_.front());
+	in_.pop_front();
+	inbytes_ -= chunk.size();
+	// a held push or probe may fit now
+	wake();
+	return true;
+}
+
+bool
+rpc_stream::write(const char *p, int n)
+{
+	ScopedLock ml(&m_);
+	while (n > 0) {
+		while (outbytes_ >= STREAM_WINDOW && !aborted_) {
+			struct timespec deadline;
+			probe_deadline(&deadline);
+			if (!wait(deadline) && idle(time(0)))
+				aborted_ = true;
+		}
+		if (aborted_)
+			return false;
+		int k = std::min(n, (int) STREAM_CHUNK);
+		out_.push_back(std::string(p, k));
+		outbytes_ += k;
+		p += k;
+		n -= k;
+		wake();
+	}
+	return true;
+}
+
+bool
+rpc_stream::aborted()
+{
+	ScopedLock ml(&m_);
+	return aborted_;
+}
+
+// @pre m_ locked
+bool
+rpc_stream::idle(time_t now)
+{
+	return now - touched_ > STREAM_IDLE_SEC;
+}
+
+void
+rpc_stream::finish(int ret)
+{
+	ScopedLock ml(&m_);
+	done_ = true;
+	ret_ = ret;
+	wake();
+}
+
+void
+rpc_stream::abort()
+{
+	ScopedLock ml(&m_);
+	aborted_ = true;
+	VERIFY(pthread_cond_broadcast(&c_) == 0);
+	wake();
+}
+
+// @pre m_ locked
+void
+rpc_stream::wake()
+{
+	answers a;
+	settle(a, false, false);
+	if (!a.any())
+		return;
+	VERIFY(pthread_mutex_unlock(&m_) == 0);
+	a.send();
+	VERIFY(pthread_mutex_lock(&m_) == 0);
+}
+
+// @pre m_ locked
+void
+rpc_stream::settle(answers &a, bool push_late, bool pull_late)
+{
+	if (push_) {
+		int r = try_push(push_seq_, push_data_, push_flags_, a.credit,
+				push_late);
+		if (r != STREAM_WAIT) {
+			a.push = push_;
+			a.push_ret = r;
+			push_ = NULL;
+			push_data_.clear();
+		}
+	}
+	if (pull_) {
+		int r = try_pull(pull_seq_, a.chunk, pull_late);
+		if (r != STREAM_WAIT) {
+			a.pull = pull_;
+			a.pull_ret = r;
+			pull_ = NULL;
+		}
+	}
+}
+
+void
+rpc_stream::expire(bool push, unsigned long hold)
+{
+	answers a;
+	{
+		ScopedLock ml(&m_);
+		settle(a, push && push_hold_ == hold, !push && pull_hold_ == hold);
+	}
+	a.send();
+}
+
+// a chunk of the request. the answer is 0 if it was taken, with the
+// credit left afterwards, or STREAM_AGAIN if the client should send it
+// again later.
+void
+rpc_stream::push(std::shared_ptr<rpc_stream> self, rpc_reply *reply,
+		unsigned int seq, const std::string &data, int flags)
+{
+	answers a;
+	int r, credit = 0;
+	unsigned long hold = 0;
+	{
+		ScopedLock ml(&m_);
+		touched_ = time(0);
+		// the caller of one held already has given up on it
+		if (push_) {
+			a.push = push_;
+			a.push_ret = STREAM_AGAIN;
+			a.credit = room();
+			push_ = NULL;
+		}
+		r = try_push(seq, data, flags, credit, false);
+		if (r == STREAM_WAIT) {
+			push_ = reply;
+			push_seq_ = seq;
+			push_data_ = data;
+			push_flags_ = flags;
+			hold = push_hold_ = ++holds_;
+		}
+	}
+	a.send();
+	if (r != STREAM_WAIT)
+		reply->done(r, credit);
+	else
+		PollMgr::Instance()->add_timer(STREAM_PROBE_MS,
+				[self, hold]() { self->expire(true, hold); });
+}
+
+// @pre m_ locked
+int
+rpc_stream::try_push(unsigned int seq, const std::string &data, int flags,
+		int &credit, bool late)
+{
+	if (flags & STREAM_PROBE) {
+		if (room() < STREAM_CHUNK && !in_.empty() && !aborted_ && !late)
+			return STREAM_WAIT;
+		credit = in_.empty() ? STREAM_WINDOW : room();
+		return 0;
+	}
+	if (seq != inseq_) {
+		// a resend of a chunk taken already
+		if (seq + 1 == inseq_) {
+			credit = room();
+			return 0;
+		}
+		return rpc_const::stream_failure;
+	}
+
+	// a chunk that does not fit is only taken once the handler has
+	// caught up, which also lets chunks larger than the window through
+	if (inbytes_ + (int) data.size() > STREAM_WINDOW && !in_.empty() &&
+			!aborted_) {
+		if (!late)
+			return STREAM_WAIT;
+		credit = room();
+		return STREAM_AGAIN;
+	}
+	if (aborted_)
+		return rpc_const::stream_failure;
+
+	if (!data.empty()) {
+		in_.push_back(data);
+		inbytes_ += data.size();
+	}
+	if (flags & STREAM_EOF)
+		ineof_ = true;
+	inseq_++;
+	credit = room();
+	VERIFY(pthread_cond_broadcast(&c_) == 0);
+	return 0;
+}
+
+// the next chunk of the reply: up to STREAM_CHUNK bytes of what the
+// handler has written, or the end of the reply once it has returned.
+// STREAM_AGAIN if there is nothing yet.
+void
+rpc_stream::pull(std::shared_ptr<rpc_stream> self, rpc_reply *reply,
+		unsigned int seq)
+{
+	answers a;
+	stream_chunk c;
+	int r;
+	unsigned long hold = 0;
+	{
+		ScopedLock ml(&m_);
+		touched_ = time(0);
+		if (pull_) {
+			a.pull = pull_;
+			a.pull_ret = STREAM_AGAIN;
+			pull_ = NULL;
+		}
+		r = try_pull(seq, c, false);
+		if (r == STREAM_WAIT) {
+			pull_ = reply;
+			pull_seq_ = seq;
+			hold = pull_hold_ = ++holds_;
+		}
+	}
+	a.send();
+	if (r != STREAM_WAIT)
+		reply->done(r, c);
+	else
+		PollMgr::Instance()->add_timer(STREAM_PROBE_MS,
+				[self, hold]() { self->expire(false, hold); });
+}
+
+// @pre m_ locked
+int
+rpc_stream::try_pull(unsigned int seq, stream_chunk &c, bool late)
+{
+	if (seq + 1 == outseq_) {
+		c = last_;
+		return 0;
+	}
+	if (seq != outseq_)
+		return rpc_const::stream_failure;
+
+	if (out_.empty() && !done_ && !aborted_)
+		return late ? STREAM_AGAIN : STREAM_WAIT;
+	if (aborted_)
+		return rpc_const::stream_failure;
+
+	c = stream_chunk();
+	while (!out_.empty() &&
+			c.data.size() + out_.front().size() <= (size_t) STREAM_CHUNK) {
+		c.data += out_.front();
+		outbytes_ -= out_.front().size();
+		out_.pop_front();
+	}
+	if (out_.empty() && done_) {
+		c.eof = true;
+		c.ret = ret_;
+	}
+	last_ = c;
+	outseq_++;
+	VERIFY(pthread_cond_broadcast(&c_) == 0);
+	return 0;
+}
+
+struct stream_job {
+	std::function<int(rpc_stream &)> fn;
+	std::shared_ptr<rpc_stream> s;
+};
+
+void
+rpcs::run_stream(stream_job *j)
+{
+	// one aborted while it waited for a thread never starts
+	j->s->finish(j->s->aborted() ? rpc_const::stream_failure : j->fn(*j->s));
+	delete j;
+}
+
+void
+rpcs::reg_stream1(unsigned int proc, std::function<int(rpc_stream &)> fn)
+{
+	ScopedLock sl(&streams_m_);
+	VERIFY(stream_procs_.count(proc) == 0);
+	stream_procs_[proc] = fn;
+}
+
+std::shared_ptr<rpc_stream>
+rpcs::find_stream(unsigned int sid)
+{
+	ScopedLock sl(&streams_m_);
+	std::map<unsigned int, std::shared_ptr<rpc_stream> >::iterator i =
+		streams_.find(sid);
+	if (i == streams_.end())
+		return std::shared_ptr<rpc_stream>();
+	return i->second;
+}
+
+int
+rpcs::stream_open(unsigned int proc, unsigned int &sid)
+{
+	stream_job *j = new stream_job;
+	std::vector<std::shared_ptr<rpc_stream> > gone;
+	{
+		ScopedLock sl(&streams_m_);
+		std::map<unsigned int, std::function<int(rpc_stream &)> >::iterator p =
+			stream_procs_.find(proc);
+		if (p == stream_procs_.end()) {
+			jsl_log(JSL_DBG_1, "rpcs::stream_open: unknown proc %x\n", proc);
+			delete j;
+			return rpc_const::stream_failure;
+		}
+
+		// forget streams whose clients went away without closing them
+		time_t now = time(0);
+		std::map<unsigned int, std::shared_ptr<rpc_stream> >::iterator i;
+		for (i = streams_.begin(); i != streams_.end(); ) {
+			ScopedLock ml(&i->second->m_);
+			if (i->second->idle(now)) {
+				gone.push_back(i->second);
+				streams_.erase(i++);
+			} else {
+				i++;
+			}
+		}
+
+		sid = next_stream_++;
+		j->fn = p->second;
+		j->s.reset(new rpc_stream(sid));
+		streams_[sid] = j->s;
+	}
+	for (size_t i = 0; i < gone.size(); i++)
+		gone[i]->abort();
+
+	if (!streampool_->addObjJob(this, &rpcs::run_stream, j)) {
+		jsl_log(JSL_DBG_1, "rpcs::stream_open: too many streams waiting\n");
+		ScopedLock sl(&streams_m_);
+		streams_.erase(sid);
+		delete j;
+		return rpc_const::stream_failure;
+	}
+	jsl_log(JSL_DBG_2, "rpcs::stream_open: proc %x stream %u\n", proc, sid);
+	return 0;
+}
+
+void
+rpcs::stream_push(rpc_reply *reply, unsigned int sid, unsigned int seq,
+		std::string data, int flags)
+{
+	std::shared_ptr<rpc_stream> s = find_stream(sid);
+	if (!s) {
+		reply->done(rpc_const::stream_failure, 0);
+		return;
+	}
+	if (flags & STREAM_CLOSE) {
+		{
+			ScopedLock sl(&streams_m_);
+			streams_.erase(sid);
+		}
+		s->abort();
+		reply->done(0, 0);
+		return;
+	}
+	s->push(s, reply, seq, data, flags);
+}
+
+void
+rpcs::stream_pull(rpc_reply *reply, unsigned int sid, unsigned int seq)
+{
+	std::shared_ptr<rpc_stream> s = find_stream(sid);
+	if (!s) {
+		reply->done(rpc_const::stream_failure, stream_chunk());
+		return;
+	}
+	s->pull(s, reply, seq);
+}
+
+void
+rpcs::abort_streams()
+{
+	std::map<unsigned int, std::shared_ptr<rpc_stream> > all;
+	{
+		ScopedLock sl(&streams_m_);
+		all.swap(streams_);
+	}
+	std::map<unsigned int, std::shared_ptr<rpc_stream> >::iterator i;
+	for (i = all.begin(); i != all.end(); i++)
+		i->second->abort();
+}
+
+rpcc_stream::rpcc_stream(rpcc *cl, unsigned int proc, rpcc::TO to)
+	: cl_(cl), proc_(proc), to_(to), sid_(0), open_(false), wseq_(0),
+	credit_(0), weof_(false), rseq_(0), reof_(false), ret_(0)
+{
+}
+
+rpcc_stream::~rpcc_stream()
+{
+	close();
+}
+
+int
+rpcc_stream::open()
+{
+	VERIFY(!open_);
+	int ret = cl_->call(rpc_const::stream_open, proc_, sid_, to_);
+	if (ret < 0)
+		return ret;
+	open_ = true;
+	credit_ = STREAM_WINDOW;
+	return 0;
+}
+
+int
+rpcc_stream::push(const std::string &data, int flags)
+{
+	for (;;) {
+		int ret, credit;
+		if (!(flags & STREAM_CLOSE) && credit_ < (int) data.size() &&
+				credit_ < STREAM_WINDOW) {
+			// out of credit: wait for the handler to catch up rather
+			// than send what the server has no room for
+			ret = cl_->call(rpc_const::stream_push, sid_, wseq_,
+					std::string(), (int) STREAM_PROBE, credit, to_);
+			if (ret < 0)
+				return ret;
+			credit_ = credit;
+			if (credit_ < (int) data.size() && credit_ < STREAM_WINDOW)
+				continue;
+		}
+		ret = cl_->call(rpc_const::stream_push, sid_, wseq_, rpc_blob(data),
+				flags, credit, to_);
+		if (ret == STREAM_AGAIN) {
+			credit_ = credit;
+			continue;
+		}
+		if (ret < 0)
+			return ret;
+		credit_ = credit;
+		wseq_++;
+		return 0;
+	}
+}
+
+int
+rpcc_stream::write(const char *p, int n)
+{
+	VERIFY(open_ && !weof_);
+	while (n > 0) {
+		int k = std::min(n, STREAM_CHUNK - (int) wbuf_.size());
+		wbuf_.append(p, k);
+		p += k;
+		n -= k;
+		if (wbuf_.size() == (size_t) STREAM_CHUNK) {
+			int ret = push(wbuf_, 0);
+			if (ret < 0)
+				return ret;
+			wbuf_.clear();
+		}
+	}
+	return 0;
+}
+
+int
+rpcc_stream::close_write()
+{
+	VERIFY(open_);
+	if (weof_)
+		return 0;
+	int ret = push(wbuf_, STREAM_EOF);
+	if (ret < 0)
+		return ret;
+	wbuf_.clear();
+	weof_ = true;
+	return 0;
+}
+
+int
+rpcc_stream::read(std::string &chunk)
+{
+	VERIFY(open_);
+	chunk.clear();
+	while (!reof_) {
+		stream_chunk c;
+		int ret = cl_->call(rpc_const::stream_pull, sid_, rseq_, c, to_);
+		if (ret == STREAM_AGAIN)
+			continue;
+		if (ret < 0)
+			return ret;
+		rseq_++;
+		if (c.eof) {
+			reof_ = true;
+			ret_ = c.ret;
+		}
+		if (!c.data.empty()) {
+			chunk.swap(c.data);
+			return chunk.size();
+		}
+	}
+	return 0;
+}
+
+void
+rpcc_stream::close()
+{
+	if (!open_)
+		return;
+	open_ = false;
+	int credit;
+	cl_->call(rpc_const::stream_push, sid_, 0u, std::string(),
+			(int) STREAM_CLOSE, credit, to_);
+}
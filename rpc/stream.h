@@ -0,0 +1,176 @@
+#ifndef stream_h
+#define stream_h
+
+// streaming rpcs.
+//
+// a streaming call moves a request and a reply of any length, each as
+// a sequence of chunks of at most STREAM_CHUNK bytes carried by ordinary
+// rpcs on reserved procs. neither side holds more than a window of the
+// stream in memory, so a call is not limited by MAX_PDU, and the
+// handler starts on the first chunk before the last one has been sent.
+//
+// the client pushes request chunks (rpc_const::stream_push) and pulls
+// reply chunks (rpc_const::stream_pull). every push reply carries the
+// credit, the number of request bytes the server will still queue for
+// the handler. the client never sends past its credit: when it runs
+// out it sends an empty probe instead, which the server holds until the
+// handler has drained the queue a little or STREAM_PROBE_MS passes. a
+// pull is held the same way until the handler has written something.
+// a held push or pull is an unanswered rpc_reply, and holds no thread.
+// the handler's own writes block once STREAM_WINDOW bytes wait for the
+// client.
+//
+// the handler runs on one of STREAM_THREADS threads kept for streams,
+// or waits its turn, and sees the stream through rpc_stream. like a
+// pair of pipes, a client that writes its whole
+// request before reading deadlocks against a handler that writes more
+// than STREAM_WINDOW bytes before reading all of it.
+
+#include <deque>
+#include <string>
+#include "rpc.h"
+
+enum {
+	STREAM_CHUNK = 64 << 10,
+	STREAM_WINDOW = 4 * STREAM_CHUNK,
+	STREAM_PROBE_MS = 500,
+	STREAM_THREADS = 8,   // handlers running at once
+	// a stream whose client has not been heard from for this long is
+	// aborted and forgotten
+	STREAM_IDLE_SEC = 60,
+};
+
+enum {
+	STREAM_AGAIN = 1,   // a push or pull the client should repeat
+	STREAM_WAIT = 2,    // one to hold rather than answer yet; never sent
+};
+
+// pushed chunk flags
+enum {
+	STREAM_EOF = 1,     // last chunk of the request
+	STREAM_CLOSE = 2,   // client is done with the stream
+	STREAM_PROBE = 4,   // no data, wait for credit
+};
+
+// a pulled chunk of the reply
+struct stream_chunk {
+	stream_chunk(): eof(false), ret(0) {}
+	std::string data;
+	bool eof;       // last chunk; ret is the handler's return value
+	int ret;
+	MARSHALL_FIELDS(data, eof, ret)
+};
+
+// the server side of one streaming call, as its handler sees it
+class rpc_stream {
+	public:
+		// the next piece of the request, in order. false once the
+		// request is over or the client has gone away.
+		bool read(std::string &chunk);
+		// append to the reply. blocks while the client is STREAM_WINDOW
+		// bytes behind; false if the client has gone away.
+		bool write(const char *p, int n);
+		bool write(const std::string &s) { return write(s.data(), s.size()); }
+		bool aborted();
+
+		~rpc_stream();
+
+	private:
+		friend class rpcs;
+
+		rpc_stream(unsigned int id);
+
+		// answer reply now if the push or pull can be, or hold it
+		void push(std::shared_ptr<rpc_stream> self, rpc_reply *reply,
+				unsigned int seq, const std::string &data, int flags);
+		void pull(std::shared_ptr<rpc_stream> self, rpc_reply *reply,
+				unsigned int seq);
+		// the answers; STREAM_WAIT to hold the call, unless late
+		int try_push(unsigned int seq, const std::string &data, int flags,
+				int &credit, bool late);
+		int try_pull(unsigned int seq, stream_chunk &c, bool late);
+		// a held push or pull's time is up
+		void expire(bool push, unsigned long hold);
+		// answer what is held and can now be, dropping m_ to send
+		void wake();
+		struct answers;
+		void settle(answers &a, bool push_late, bool pull_late);
+		void finish(int ret);
+		void abort();
+		bool idle(time_t now);
+		int room();     // request bytes the client may still send
+		// wait on c_ until the deadline; false once it has passed
+		bool wait(const struct timespec &deadline);
+
+		unsigned int id_;
+		pthread_mutex_t m_;
+		pthread_cond_t c_;
+
+		std::deque<std::string> in_;   // request chunks not yet read
+		int inbytes_;
+		unsigned int inseq_;           // next chunk the client pushes
+		bool ineof_;
+
+		std::deque<std::string> out_;  // reply data not yet pulled
+		int outbytes_;
+		unsigned int outseq_;          // next chunk the client pulls
+		stream_chunk last_;            // the chunk pulled last, for resends
+
+		// the push and the pull held, with what they asked
+		rpc_reply *push_;
+		unsigned int push_seq_;
+		std::string push_data_;
+		int push_flags_;
+		rpc_reply *pull_;
+		unsigned int pull_seq_;
+		unsigned long push_hold_, pull_hold_;   // for their timers
+		unsigned long holds_;
+
+		bool done_;     // handler has returned ret_
+		int ret_;
+		bool aborted_;
+		time_t touched_;  // last time the client was heard from
+};
+
+// the client side of one streaming call
+class rpcc_stream {
+	public:
+		rpcc_stream(rpcc *cl, unsigned int proc, rpcc::TO to = rpcc::to_max);
+		~rpcc_stream();
+
+		// start the handler for proc; 0 or an rpc_const failure
+		int open();
+		// send request bytes, in STREAM_CHUNK sized rpcs as they fill up.
+		// 0 or an rpc_const failure.
+		int write(const char *p, int n);
+		int write(const std::string &s) { return write(s.data(), s.size()); }
+		// the request is complete
+		int close_write();
+		// the next piece of the reply: its size, 0 at the end of the reply
+		// (result() then holds what the handler returned), or an rpc_const
+		// failure
+		int read(std::string &chunk);
+		int result() { return ret_; }
+		// abandon the call, stopping the handler if it is still running
+		void close();
+
+	private:
+		int push(const std::string &data, int flags);
+
+		rpcc *cl_;
+		unsigned int proc_;
+		rpcc::TO to_;
+		unsigned int sid_;
+		bool open_;
+
+		std::string wbuf_;  // request bytes not yet pushed
+		unsigned int wseq_;
+		int credit_;
+		bool weof_;
+
+		unsigned int rseq_;
+		bool reof_;
+		int ret_;
+};
+
+#endif
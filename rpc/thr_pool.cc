@@ -20,8 +20,8 @@ do_worker(void *arg)
 
 //if blocking, then addJob() blocks when queue is full
 //otherwise, addJob() simply returns false when queue is full
-ThrPool::ThrPool(int sz, bool blocking)
-: nthreads_(sz),blockadd_(blocking),jobq_(100*sz) 
+ThrPool::ThrPool(int sz, bool blocking, int qlimit)
+: nthreads_(sz),blockadd_(blocking),jobq_(qlimit < 0 ? 100*sz : qlimit) 
 {
 	pthread_attr_init(&attr_);
 	pthread_attr_setstacksize(&attr_, 128<<10);
@@ -15,7 +15,8 @@ class ThrPool {
 			void *a; //function arguments
 		};
 
-		ThrPool(int sz, bool blocking=true);
+		// a queue of qlimit jobs, 100 per thread by default, 0 for no limit
+		ThrPool(int sz, bool blocking=true, int qlimit=-1);
 		~ThrPool();
 		template<class C, class A> bool addObjJob(C *o, void (C::*m)(A), A a);
 		void waitDone();
@@ -0,0 +1,91 @@
+#ifndef xidwin_h
+#define xidwin_h
+
+// the xids a client has all the replies up to, for req_header's
+// xid_rep.
+//
+// base() is the highest xid such that the client is done with that
+// one and every one before it. the xids above it that are done too
+// are bits in a ring of 64 bit words, the first of which holds
+// base() + 1. marking an xid sets its bit; marking base() + 1 moves
+// base() up past the run of set bits, a word at a time, and hands
+// the words it empties back to the end of the ring. the ring grows
+// when a call that is still waiting holds base() back further than
+// it reaches.
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include "lang/verify.h"
+
+class xid_window {
+	public:
+		enum { INIT_WORDS = 16 };  // a power of two
+
+		xid_window() : base_(0), start_(0), head_(0), bits_(INIT_WORDS) {}
+
+		// xid is done with; not thread safe
+		void mark(unsigned int xid);
+		// may be called while another thread marks
+		unsigned int base() { return base_.load(std::memory_order_acquire); }
+
+	private:
+		void advance();
+		void grow(size_t words);
+
+		std::atomic<unsigned int> base_;
+		unsigned int start_;   // xid of bit 0 of the head word
+		size_t head_;          // word that holds base_ + 1
+		std::vector<uint64_t> bits_;
+};
+
+inline void
+xid_window::mark(unsigned int xid)
+{
+	unsigned int base = base_.load(std::memory_order_relaxed);
+	if (xid <= base)
+		return;
+	size_t k = (xid - start_) / 64;
+	if (k >= bits_.size())
+		grow(k + 1);
+	bits_[(head_ + k) & (bits_.size() - 1)] |= 1ULL << ((xid - start_) % 64);
+	if (xid == base + 1)
+		advance();
+}
+
+inline void
+xid_window::advance()
+{
+	unsigned int base = base_.load(std::memory_order_relaxed);
+	while (1) {
+		unsigned int pos = base + 1 - start_;
+		if (pos < 64) {
+			// the unset bits from base + 1 on
+			uint64_t holes = ~bits_[head_] & (~0ULL << pos);
+			if (holes) {
+				base = start_ + __builtin_ctzll(holes) - 1;
+				break;
+			}
+			base = start_ + 63;
+		}
+		bits_[head_] = 0;
+		head_ = (head_ + 1) & (bits_.size() - 1);
+		start_ += 64;
+	}
+	base_.store(base, std::memory_order_release);
+}
+
+inline void
+xid_window::grow(size_t words)
+{
+	size_t n = bits_.size();
+	while (n < words)
+		n *= 2;
+	std::vector<uint64_t> nb(n);
+	for (size_t i = 0; i < bits_.size(); i++)
+		nb[i] = bits_[(head_ + i) & (bits_.size() - 1)];
+	bits_.swap(nb);
+	head_ = 0;
+}
+
+#endif